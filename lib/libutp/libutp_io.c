@@ -0,0 +1,545 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifdef __linux__
+	#define _GNU_SOURCE		// recvmmsg(), sendmmsg()
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "libutp_io.h"
+
+#ifdef __linux__
+	#include <linux/filter.h>
+
+	#ifndef SO_ATTACH_REUSEPORT_CBPF
+		#define SO_ATTACH_REUSEPORT_CBPF 51
+	#endif
+#endif
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	#define HAVE_MMSG 1
+
+	// not in older libc headers
+	#ifndef SOL_UDP
+		#define SOL_UDP 17
+	#endif
+	#ifndef UDP_SEGMENT
+		#define UDP_SEGMENT 103
+	#endif
+	#ifndef UDP_GRO
+		#define UDP_GRO 104
+	#endif
+#endif
+
+// One queued datagram, or one GSO run of segment_size datagrams
+struct utp_io_msg {
+	size_t off;
+	size_t len;
+	size_t segment_size;	// 0 unless sent with UDP_SEGMENT
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+struct utp_io {
+	utp_context *ctx;
+	int fd;
+	int offload;
+
+	// receive ring, refilled by every recvmmsg()
+	byte *recv_buf;
+	size_t recv_buf_size;
+	size_t recv_slots;
+	struct sockaddr_storage recv_addr[UTP_IO_BATCH];
+
+	// packets waiting for utp_process_udp_batch()
+	size_t recv_npkt;
+	struct utp_udp_packet recv_pkt[UTP_IO_BATCH];
+
+	// send queue, emptied by utp_io_flush()
+	size_t send_count;
+	size_t send_used;
+	struct utp_io_msg send[UTP_IO_BATCH];
+
+#ifdef HAVE_MMSG
+	struct mmsghdr recv_msg[UTP_IO_BATCH];
+	struct mmsghdr send_msg[UTP_IO_BATCH];
+	struct iovec recv_iov[UTP_IO_BATCH];
+	struct iovec send_iov[UTP_IO_BATCH];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} recv_cmsg[UTP_IO_BATCH];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+	} send_cmsg[UTP_IO_BATCH];
+#endif
+
+	utp_io_stats stats;
+
+	byte send_buf[UTP_IO_SEND_SIZE];
+};
+
+utp_io* utp_io_create(utp_context *ctx, int fd)
+{
+	utp_io *io = (utp_io*)calloc(1, sizeof(utp_io));
+	if (!io) return NULL;
+
+	io->ctx = ctx;
+	io->fd = fd;
+	io->recv_buf_size = UTP_IO_BUF_SIZE;
+	io->recv_slots = UTP_IO_BATCH;
+	io->recv_buf = (byte*)malloc(io->recv_slots * io->recv_buf_size);
+	if (!io->recv_buf) {
+		free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+void utp_io_destroy(utp_io *io)
+{
+	free(io->recv_buf);
+	free(io);
+}
+
+// Ask for segmentation offload.  Returns the subset of flags that the kernel
+// supports and that are now in effect.
+int utp_io_enable_offload(utp_io *io, int flags)
+{
+#ifdef HAVE_MMSG
+	if (flags & UTP_IO_GSO) {
+		int val;
+		socklen_t len = sizeof(val);
+		if (getsockopt(io->fd, SOL_UDP, UDP_SEGMENT, &val, &len) == 0)
+			io->offload |= UTP_IO_GSO;
+	}
+
+	if ((flags & UTP_IO_GRO) && !(io->offload & UTP_IO_GRO)) {
+		int one = 1;
+		byte *buf = (byte*)malloc(UTP_IO_GRO_BATCH * UTP_IO_GRO_BUF_SIZE);
+		if (buf && setsockopt(io->fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0) {
+			free(io->recv_buf);
+			io->recv_buf = buf;
+			io->recv_buf_size = UTP_IO_GRO_BUF_SIZE;
+			io->recv_slots = UTP_IO_GRO_BATCH;
+			io->offload |= UTP_IO_GRO;
+		} else {
+			free(buf);
+		}
+	}
+#endif
+
+	return io->offload & flags;
+}
+
+static void utp_io_process(utp_io *io)
+{
+	if (io->recv_npkt == 0) return;
+	utp_process_udp_batch(io->ctx, io->recv_pkt, io->recv_npkt);
+	io->recv_npkt = 0;
+}
+
+// Queue a received datagram for libutp, cutting it into segment_size pieces
+// if the kernel coalesced it.  A full batch is processed right away.
+static void utp_io_received(utp_io *io, const byte *buf, size_t len, size_t segment_size,
+							const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	if (segment_size == 0 || segment_size > len)
+		segment_size = len;
+	else
+		io->stats.ngro++;
+
+	while (len > 0) {
+		size_t n = len < segment_size ? len : segment_size;
+		struct utp_udp_packet *pkt = &io->recv_pkt[io->recv_npkt++];
+
+		pkt->buf = buf;
+		pkt->len = n;
+		pkt->addr = (const struct sockaddr *)addr;
+		pkt->addrlen = addrlen;
+		io->stats.nrecv++;
+
+		if (io->recv_npkt == UTP_IO_BATCH)
+			utp_io_process(io);
+
+		buf += n;
+		len -= n;
+	}
+}
+
+// Fill the receive ring once and hand what was read to libutp.  Returns the
+// number of datagrams read, 0 if the socket had nothing to read, or -1 on
+// error.
+static int utp_io_recv_batch(utp_io *io)
+{
+	int n;
+
+#ifdef HAVE_MMSG
+	for (size_t i = 0; i < io->recv_slots; i++) {
+		struct msghdr *hdr = &io->recv_msg[i].msg_hdr;
+
+		io->recv_iov[i].iov_base = io->recv_buf + i * io->recv_buf_size;
+		io->recv_iov[i].iov_len = io->recv_buf_size;
+		hdr->msg_iov = &io->recv_iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &io->recv_addr[i];
+		hdr->msg_namelen = sizeof(io->recv_addr[i]);
+		hdr->msg_control = (io->offload & UTP_IO_GRO) ? io->recv_cmsg[i].buf : NULL;
+		hdr->msg_controllen = (io->offload & UTP_IO_GRO) ? sizeof(io->recv_cmsg[i].buf) : 0;
+		hdr->msg_flags = 0;
+	}
+
+	n = recvmmsg(io->fd, io->recv_msg, io->recv_slots, MSG_DONTWAIT, NULL);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+	for (int i = 0; i < n; i++) {
+		struct msghdr *hdr = &io->recv_msg[i].msg_hdr;
+		int segment_size = 0;
+
+		if (hdr->msg_controllen > 0) {
+			struct cmsghdr *cmsg;
+			for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+					memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+			}
+		}
+
+		utp_io_received(io, (byte*)io->recv_iov[i].iov_base, io->recv_msg[i].msg_len,
+						segment_size, &io->recv_addr[i], hdr->msg_namelen);
+	}
+#else
+	for (n = 0; n < (int)io->recv_slots; n++) {
+		byte *buf = io->recv_buf + n * io->recv_buf_size;
+		socklen_t addrlen = sizeof(io->recv_addr[n]);
+		ssize_t len = recvfrom(io->fd, buf, io->recv_buf_size, MSG_DONTWAIT,
+							   (struct sockaddr *)&io->recv_addr[n], &addrlen);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			if (n == 0)
+				return -1;
+			break;
+		}
+
+		utp_io_received(io, buf, len, 0, &io->recv_addr[n], addrlen);
+	}
+#endif
+
+	utp_io_process(io);
+
+	if (n > 0)
+		io->stats.nrecv_calls++;
+	return n;
+}
+
+// Read everything the socket has, feed it to libutp one batch at a time and
+// flush whatever libutp queued in response.  Returns the number of datagrams
+// received, or -1 if the socket reported an error.
+int utp_io_recv(utp_io *io)
+{
+	int total = 0;
+	int n;
+
+	while ((n = utp_io_recv_batch(io)) > 0) {
+		total += n;
+
+		// Flush between batches so that acks go out while we are still
+		// reading, and so the send queue does not overflow under load
+		utp_io_flush(io);
+
+		if (n < (int)io->recv_slots)
+			break;
+	}
+
+	utp_io_flush(io);
+
+	return n < 0 ? -1 : total;
+}
+
+// Make room for a datagram of len bytes, flushing if need be.  Returns the
+// queue entry, or NULL if the kernel would not take the queued datagrams.
+static struct utp_io_msg* utp_io_reserve(utp_io *io, size_t len)
+{
+	if (io->send_count == UTP_IO_BATCH || io->send_used + len > UTP_IO_SEND_SIZE) {
+		utp_io_flush(io);
+		if (io->send_count == UTP_IO_BATCH || io->send_used + len > UTP_IO_SEND_SIZE)
+			return NULL;
+	}
+
+	struct utp_io_msg *m = &io->send[io->send_count++];
+	m->off = io->send_used;
+	m->len = len;
+	m->segment_size = 0;
+	io->send_used += len;
+	return m;
+}
+
+// Queue one datagram.  If the queue is full it is flushed first; if the kernel
+// won't take any of it either, the datagram is dropped and counted, and uTP
+// will retransmit.  Returns 0 if queued, -1 if dropped.
+int utp_io_sendto(utp_io *io, const byte *buf, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	struct utp_io_msg *m;
+
+	if (tolen > sizeof(struct sockaddr_storage) || !(m = utp_io_reserve(io, len))) {
+		io->stats.ndropped++;
+		return -1;
+	}
+
+	memcpy(io->send_buf + m->off, buf, len);
+	memcpy(&m->addr, to, tolen);
+	m->addrlen = tolen;
+	return 0;
+}
+
+// Queue one datagram gathered from num_iovecs buffers (for UTP_SENDTO_IOV).
+// Returns 0 if queued, -1 if it was dropped.
+int utp_io_sendtov(utp_io *io, const struct utp_iovec *iovec, size_t num_iovecs, const struct sockaddr *to, socklen_t tolen)
+{
+	struct utp_io_msg *m;
+	size_t len = 0, i;
+	byte *p;
+
+	for (i = 0; i < num_iovecs; i++)
+		len += iovec[i].iov_len;
+
+	if (tolen > sizeof(struct sockaddr_storage) || !(m = utp_io_reserve(io, len))) {
+		io->stats.ndropped++;
+		return -1;
+	}
+
+	p = io->send_buf + m->off;
+	for (i = 0; i < num_iovecs; i++) {
+		memcpy(p, iovec[i].iov_base, iovec[i].iov_len);
+		p += iovec[i].iov_len;
+	}
+	memcpy(&m->addr, to, tolen);
+	m->addrlen = tolen;
+	return 0;
+}
+
+// Queue a run of datagrams of segment_size bytes each (the last one may be
+// shorter).  Without UTP_IO_GSO this is the same as queueing each of them
+// with utp_io_sendto().  Returns 0 if queued, -1 if anything was dropped.
+int utp_io_sendto_run(utp_io *io, const byte *buf, size_t len, size_t segment_size, const struct sockaddr *to, socklen_t tolen)
+{
+	struct utp_io_msg *m;
+
+	if (!(io->offload & UTP_IO_GSO) || segment_size == 0 || len <= segment_size) {
+		int ret = 0;
+		while (len > 0) {
+			size_t n = (segment_size && len > segment_size) ? segment_size : len;
+			if (utp_io_sendto(io, buf, n, to, tolen) < 0)
+				ret = -1;
+			buf += n;
+			len -= n;
+		}
+		return ret;
+	}
+
+	if (tolen > sizeof(struct sockaddr_storage) || !(m = utp_io_reserve(io, len))) {
+		io->stats.ndropped += (len + segment_size - 1) / segment_size;
+		return -1;
+	}
+
+	memcpy(io->send_buf + m->off, buf, len);
+	memcpy(&m->addr, to, tolen);
+	m->addrlen = tolen;
+	m->segment_size = segment_size;
+	return 0;
+}
+
+// The kernel refused a GSO run (e.g. the route's device can't checksum it);
+// stop using GSO and send that run's datagrams one by one.
+static void utp_io_send_split(utp_io *io, const struct utp_io_msg *m)
+{
+	io->offload &= ~UTP_IO_GSO;
+
+	for (size_t off = 0; off < m->len; off += m->segment_size) {
+		size_t n = m->len - off < m->segment_size ? m->len - off : m->segment_size;
+		io->stats.nsend_calls++;
+		if (sendto(io->fd, io->send_buf + m->off + off, n, MSG_DONTWAIT,
+				   (const struct sockaddr *)&m->addr, m->addrlen) < 0)
+			io->stats.ndropped++;
+		else
+			io->stats.nsent++;
+	}
+}
+
+// Write out the send queue.  Datagrams the kernel did not accept because the
+// socket would block stay queued for the next flush; datagrams that failed for
+// any other reason are dropped, as a plain sendto() would.  Returns the number
+// of queue entries written.
+int utp_io_flush(utp_io *io)
+{
+	size_t sent = 0;
+
+	while (sent < io->send_count) {
+#ifdef HAVE_MMSG
+		for (size_t i = sent; i < io->send_count; i++) {
+			struct utp_io_msg *m = &io->send[i];
+			struct msghdr *hdr = &io->send_msg[i].msg_hdr;
+
+			io->send_iov[i].iov_base = io->send_buf + m->off;
+			io->send_iov[i].iov_len = m->len;
+			hdr->msg_iov = &io->send_iov[i];
+			hdr->msg_iovlen = 1;
+			hdr->msg_name = &m->addr;
+			hdr->msg_namelen = m->addrlen;
+			hdr->msg_flags = 0;
+
+			if (m->segment_size) {
+				struct cmsghdr *cmsg;
+				uint16_t segment_size = (uint16_t)m->segment_size;
+
+				hdr->msg_control = io->send_cmsg[i].buf;
+				hdr->msg_controllen = sizeof(io->send_cmsg[i].buf);
+				cmsg = CMSG_FIRSTHDR(hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+				memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+			} else {
+				hdr->msg_control = NULL;
+				hdr->msg_controllen = 0;
+			}
+		}
+
+		int n = sendmmsg(io->fd, &io->send_msg[sent], io->send_count - sent, MSG_DONTWAIT);
+#else
+		int n = sendto(io->fd, io->send_buf + io->send[sent].off, io->send[sent].len, MSG_DONTWAIT,
+					   (const struct sockaddr *)&io->send[sent].addr, io->send[sent].addrlen) < 0 ? -1 : 1;
+#endif
+		io->stats.nsend_calls++;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break;
+			// The first datagram was refused (e.g. ICMP-induced error or an
+			// unreachable address); skip it rather than stall the queue
+			if (io->send[sent].segment_size && (errno == EIO || errno == EINVAL))
+				utp_io_send_split(io, &io->send[sent]);
+			else
+				io->stats.ndropped++;
+			sent++;
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct utp_io_msg *m = &io->send[sent + i];
+			if (m->segment_size) {
+				io->stats.ngso++;
+				io->stats.nsent += (m->len + m->segment_size - 1) / m->segment_size;
+			} else {
+				io->stats.nsent++;
+			}
+		}
+		sent += n;
+	}
+
+	if (sent > 0 && sent < io->send_count) {
+		size_t left = io->send_count - sent;
+		size_t base = io->send[sent].off;
+
+		memmove(io->send_buf, io->send_buf + base, io->send_used - base);
+		memmove(io->send, &io->send[sent], left * sizeof(io->send[0]));
+		for (size_t i = 0; i < left; i++)
+			io->send[i].off -= base;
+		io->send_used -= base;
+	} else if (sent == io->send_count) {
+		io->send_used = 0;
+	}
+	io->send_count -= sent;
+
+	return (int)sent;
+}
+
+size_t utp_io_pending(utp_io *io)
+{
+	return io->send_count;
+}
+
+utp_io_stats* utp_io_get_stats(utp_io *io)
+{
+	return &io->stats;
+}
+
+// The shard a datagram belongs to out of shard_count.  Packets of a
+// connection carry the receiver's connection ID, except the SYN, which
+// carries one less; so the key is connid, plus one for SYNs.
+int utp_io_shard_of(const byte *buf, size_t len, int shard_count)
+{
+	uint32 key;
+
+	if (shard_count <= 1 || len < 4)
+		return 0;
+	key = ((uint32)buf[2] << 8) | buf[3];
+	if ((buf[0] >> 4) == 4)		// ST_SYN
+		key++;
+	return (int)((key & 0xffff) % (uint32)shard_count);
+}
+
+// Make the kernel steer datagrams arriving on fd's SO_REUSEPORT group with
+// utp_io_shard_of(): shard i is the socket bound i-th.  Returns 0, or -1
+// with errno set if the platform cannot steer.
+int utp_io_attach_shard_filter(int fd, int shard_count)
+{
+#ifdef __linux__
+	// the program sees the UDP payload
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),				// A = ver_type
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),				// A = type
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 3),		// ST_SYN?
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),				// A = connid + 1
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1),
+		BPF_STMT(BPF_JMP | BPF_JA, 1),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),				// A = connid
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32)shard_count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	if (shard_count < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+	(void)fd;
+	(void)shard_count;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
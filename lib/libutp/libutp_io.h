@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __LIBUTP_IO_H__
+#define __LIBUTP_IO_H__
+
+// A small UDP I/O driver for POSIX hosts.
+//
+// utp_io_recv() drains the socket into a ring of buffers, with recvmmsg()
+// where available, and hands each batch to utp_process_udp_batch().  Packets
+// produced by libutp are queued with utp_io_sendto() (call it from your
+// UTP_SENDTO callback) and written out with a single sendmmsg() by
+// utp_io_flush(), which utp_io_recv() also does at the end of its pass.
+// utp_io_sendtov() does the same for UTP_SENDTO_IOV, gathering the datagram
+// straight into the send queue.
+//
+// On Linux, utp_io_enable_offload() turns on UDP segmentation offload.  With
+// UTP_IO_GSO, runs queued with utp_io_sendto_run() (call it from your
+// UTP_SENDTO_RUN callback) go to the kernel as one buffer that it cuts into
+// datagrams; with UTP_IO_GRO, the kernel hands back coalesced datagrams which
+// the driver splits again before libutp sees them.
+//
+// The driver does not own the socket or the context; it only borrows them.
+//
+// To spread one port over several cores, bind one socket per shard to it
+// with SO_REUSEPORT, call utp_io_attach_shard_filter() on any of them, and
+// give each shard its own context with UTP_SHARD_INDEX and UTP_SHARD_COUNT
+// set.  The kernel then hands every packet of a connection to the shard that
+// owns it, and incoming connections spread evenly since their IDs are random.
+
+#include "utp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of datagrams moved per recvmmsg()/sendmmsg()
+#define UTP_IO_BATCH		64
+// size of each receive buffer
+#define UTP_IO_BUF_SIZE		4096
+// size of each receive buffer, and number of them, with UTP_IO_GRO
+#define UTP_IO_GRO_BUF_SIZE	65536
+#define UTP_IO_GRO_BATCH	16
+// bytes of queued datagrams between flushes
+#define UTP_IO_SEND_SIZE	(256 * 1024)
+
+// utp_io_enable_offload() flags
+enum {
+	UTP_IO_GSO = 1,
+	UTP_IO_GRO = 2,
+};
+
+typedef struct utp_io utp_io;
+
+// Returned by utp_io_get_stats()
+typedef struct {
+	uint64 nrecv;			// datagrams received (after GRO splitting)
+	uint64 nsent;			// datagrams handed to the kernel (before GSO splitting)
+	uint64 nrecv_calls;		// recvmmsg()/recvfrom() calls that returned data
+	uint64 nsend_calls;		// sendmmsg()/sendto() calls
+	uint64 ndropped;		// datagrams dropped because the send queue was full
+	uint64 ngso;			// runs sent with UDP_SEGMENT
+	uint64 ngro;			// coalesced datagrams received with UDP_GRO
+} utp_io_stats;
+
+utp_io*			utp_io_create			(utp_context *ctx, int fd);
+void			utp_io_destroy			(utp_io *io);
+int				utp_io_enable_offload	(utp_io *io, int flags);
+int				utp_io_recv				(utp_io *io);
+int				utp_io_sendto			(utp_io *io, const byte *buf, size_t len, const struct sockaddr *to, socklen_t tolen);
+int				utp_io_sendtov			(utp_io *io, const struct utp_iovec *iovec, size_t num_iovecs, const struct sockaddr *to, socklen_t tolen);
+int				utp_io_sendto_run		(utp_io *io, const byte *buf, size_t len, size_t segment_size, const struct sockaddr *to, socklen_t tolen);
+int				utp_io_flush			(utp_io *io);
+size_t			utp_io_pending			(utp_io *io);
+utp_io_stats*	utp_io_get_stats		(utp_io *io);
+int				utp_io_shard_of			(const byte *buf, size_t len, int shard_count);
+int				utp_io_attach_shard_filter	(int fd, int shard_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBUTP_IO_H__
@@ -0,0 +1,187 @@
+import os, struct, sys
+
+# usage: parse_trace.py [--dump] trace-file [connection ID to focus on]
+#
+# Reads a trace written by utp_trace_dump() (ucat -t).  With --dump, prints
+# every record as a line of text.  Otherwise plots the congestion window,
+# delays and losses of one connection with gnuplot.
+
+EVENTS = {
+    1: ('sent', ['length', 'transmissions', 'cur_window', 'max_window']),
+    2: ('acked', ['payload', 'transmissions', 'rtt_us', 'cur_window']),
+    3: ('lost', ['payload', 'transmissions', 'cur_window', 'max_window']),
+    4: ('cwnd', ['max_window', 'cur_window', 'our_delay_us', 'target_delay_us']),
+    5: ('rto', ['timeout_ms', 'max_window', 'cur_window_packets', 'retransmit_count']),
+    6: ('mtu_probe', ['size', 'mtu_floor', 'mtu_ceiling', 'outcome']),
+    7: ('overrun', ['count', '', '', '']),
+}
+
+HEADER = struct.Struct('=8sII')
+RECORD = struct.Struct('=QHHI4I')
+
+def read_trace(path):
+    f = open(path, 'rb')
+    magic, version, record_size = HEADER.unpack(f.read(HEADER.size))
+    if magic != b'UTPTRACE' or version != 1 or record_size != RECORD.size:
+        sys.exit('%s: not a version 1 uTP trace' % path)
+    while True:
+        b = f.read(RECORD.size)
+        if len(b) < RECORD.size: break
+        yield RECORD.unpack(b)
+    f.close()
+
+args = sys.argv[1:]
+dump = '--dump' in args
+if dump: args.remove('--dump')
+if not args:
+    sys.exit('usage: parse_trace.py [--dump] trace-file [connection-id]')
+path = args[0]
+
+if dump:
+    for t, conn, seq, event, a0, a1, a2, a3 in read_trace(path):
+        name, fields = EVENTS.get(event, ('event%d' % event, ['a0', 'a1', 'a2', 'a3']))
+        values = ' '.join('%s:%d' % (n, v) for n, v in zip(fields, (a0, a1, a2, a3)) if n)
+        print('%d %05d %-9s seq:%d %s' % (t, conn, name, seq, values))
+    sys.exit(0)
+
+overruns = 0
+if len(args) >= 2:
+    socket_filter = int(args[1])
+else:
+    print('scanning for socket with the most packets')
+    sockets = {}
+    for t, conn, seq, event, a0, a1, a2, a3 in read_trace(path):
+        if event == 7:
+            overruns += a0
+        elif event == 4:
+            sockets[conn] = sockets.get(conn, 0) + 1
+    if not sockets:
+        sys.exit('%s: no window updates' % path)
+    items = sorted(sockets.items(), key=lambda x: -x[1])
+    for conn, count in items[:6]:
+        print('%05d: %d' % (conn, count))
+    socket_filter = items[0][0]
+    print('\nfocusing on socket %05d' % socket_filter)
+    if overruns:
+        print('warning: %d records were lost to ring overruns' % overruns)
+
+out_file = 'utp.out%05d' % socket_filter
+out = open(out_file, 'w')
+
+columns = ['max_window', 'cur_window', 'our_delay', 'target_delay', 'rtt', 'loss', 'timeout']
+metrics = {
+    'max_window': ['cwnd (B)', 'x1y1', 'steps lc rgb "green"'],
+    'cur_window': ['bytes in-flight (B)', 'x1y1', 'steps lc rgb "sea-green"'],
+    'our_delay': ['our delay (ms)', 'x1y2', 'dots lc rgb "blue"'],
+    'target_delay': ['target delay (ms)', 'x1y2', 'steps lw 2 lc rgb "red"'],
+    'rtt': ['rtt (ms)', 'x1y2', 'lines lc rgb "light-blue"'],
+    'loss': ['packet loss', 'x1y1', 'impulses lc rgb "orange"'],
+    'timeout': ['timeout', 'x1y1', 'impulses lc rgb "black"'],
+}
+
+histogram_quantization = 1
+delay_histogram = {}
+
+begin = None
+rtt = 0
+loss = 0
+timeout = 0
+counter = 0
+
+print('reading trace file')
+
+for t, conn, seq, event, a0, a1, a2, a3 in read_trace(path):
+    if conn != socket_filter or event == 7:
+        continue
+
+    counter += 1
+    if counter % 3000 == 0:
+        sys.stdout.write('\r%d  ' % counter)
+        sys.stdout.flush()
+
+    if begin is None:
+        begin = t
+
+    if event == 2 and a2:
+        rtt = a2 / 1000.
+    elif event == 3:
+        loss += 1
+    elif event == 5:
+        timeout += 1
+    elif event == 4:
+        our_delay = a2 / 1000.
+        bucket = int(our_delay / histogram_quantization)
+        delay_histogram[bucket] = 1 + delay_histogram.get(bucket, 0)
+        out.write('%f\t%d\t%d\t%f\t%f\t%f\t%d\t%d\n' % (
+            (t - begin) / 1000000., a0, a1, our_delay, a3 / 1000., rtt,
+            loss * 8000, timeout * 8000))
+        loss = 0
+        timeout = 0
+
+out.close()
+print('')
+
+out = open('%s.histogram' % out_file, 'w')
+for d, f in sorted(delay_histogram.items()):
+    out.write('%f %d\n' % (float(d * histogram_quantization) + histogram_quantization / 2., f))
+out.close()
+
+plot = [
+    {
+        'data': ['max_window', 'cur_window', 'rtt', 'loss', 'timeout'],
+        'title': 'window',
+        'y1': 'Bytes',
+        'y2': 'Time (ms)'
+    },
+    {
+        'data': ['our_delay', 'max_window', 'target_delay', 'cur_window'],
+        'title': 'uploading',
+        'y1': 'Bytes',
+        'y2': 'Time (ms)'
+    },
+    {
+        'data': ['our_delay', 'target_delay', 'rtt'],
+        'title': 'our-delay',
+        'y1': '',
+        'y2': 'Time (ms)'
+    },
+]
+
+title = 'socket: %05d' % socket_filter
+
+out = open('utp.gnuplot', 'w')
+
+out.write('set term png size 1280,800\n')
+out.write('set output "%s.delays.png"\n' % out_file)
+out.write('set xrange [0:250]\n')
+out.write('set xlabel "delay (ms)"\n')
+out.write('set boxwidth 1\n')
+out.write('set style fill solid\n')
+out.write('set ylabel "number of packets"\n')
+out.write('plot "%s.histogram" using 1:2 with boxes\n' % out_file)
+
+out.write('set style data steps\n')
+out.write('set y2range [*:*]\n')
+
+for p in plot:
+    out.write('set title "%s %s"\n' % (p['title'], title))
+    out.write('set xlabel "time (s)"\n')
+    out.write('set ylabel "%s"\n' % p['y1'])
+    out.write('set tics nomirror\n')
+    out.write('set y2tics\n')
+    out.write('set y2label "%s"\n' % p['y2'])
+    out.write('set xrange [0:*]\n')
+    out.write('set key box\n')
+    out.write('set term png size 1280,800\n')
+    out.write('set output "%s-%s.png"\n' % (out_file, p['title']))
+
+    lines = []
+    for c in p['data']:
+        i = columns.index(c)
+        lines.append('"%s" using 1:%d title "%s-%s" axes %s with %s' % (
+            out_file, i + 2, metrics[c][0], metrics[c][1], metrics[c][1], metrics[c][2]))
+    out.write('plot %s\n' % ', '.join(lines))
+
+out.close()
+
+os.system('gnuplot utp.gnuplot')
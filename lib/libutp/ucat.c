@@ -37,6 +37,8 @@
 #include <poll.h>
 #include <netdb.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #ifdef __linux__
 	#include <linux/errqueue.h>
@@ -44,6 +46,7 @@
 #endif
 
 #include "utp.h"
+#include "libutp_io.h"
 
 // options
 int o_debug;
@@ -52,13 +55,36 @@ char *o_local_address,  *o_local_port,
 int o_listen;
 int o_buf_size = 4096;
 int o_numeric;
+int o_shards;
+char *o_trace;
+int o_ccontrol = UTP_CC_LEDBAT;
+int o_pacing;
+int o_large_window;
+
+// trace file actually written; shards each get their own
+char trace_path[1024];
+time_t trace_dumped;
 
 utp_context *ctx;
 utp_socket *s;
+utp_io *io;
 
 int fd;
+int shard;				// with -S, which shard this process serves
+pid_t *shard_pids;		// with -S, in the first shard, the other shards' processes
 int buf_len = 0;
 unsigned char *buf, *p;
+
+// Written data is sent with utp_write_ref(), so it stays referenced by libutp
+// until it has been acked.  Each buffer counts the writes still pointing into
+// it, and a drained buffer that is still referenced is retired and replaced
+// rather than refilled.
+typedef struct {
+	int refs;
+	int retired;
+} buf_hdr;
+
+#define BUF_HDR(b) ((buf_hdr *)(b) - 1)
 int eof_flag, quit_flag, exit_code;
 
 void die(char *fmt, ...)
@@ -121,6 +147,29 @@ void handler(int number)
 	exit_code++;
 }
 
+void handler_chld(int number)
+{
+	debug("a shard exited\n");
+	quit_flag = 1;
+}
+
+unsigned char *buf_alloc(void)
+{
+	buf_hdr *h = malloc(sizeof(buf_hdr) + o_buf_size);
+	if (! h)
+		pdie("malloc");
+	h->refs = 0;
+	h->retired = 0;
+	return (unsigned char *) (h + 1);
+}
+
+void buf_release(void *cookie)
+{
+	buf_hdr *h = BUF_HDR(cookie);
+	if (--h->refs == 0 && h->retired)
+		free(h);
+}
+
 void write_data(void)
 {
 	if (! s)
@@ -129,16 +178,21 @@ void write_data(void)
 	while (p < buf+buf_len) {
 		size_t sent;
 
-		sent = utp_write(s, p, buf+buf_len-p);
+		sent = utp_write_ref(s, p, buf+buf_len-p, &buf_release, buf);
 		if (sent == 0) {
 			debug("socket no longer writable\n");
 			return;
 		}
 
+		BUF_HDR(buf)->refs++;
 		p += sent;
 
 		if (p == buf+buf_len) {
 				debug("wrote %zd bytes; buffer now empty\n", sent);
+				if (BUF_HDR(buf)->refs) {
+					BUF_HDR(buf)->retired = 1;
+					buf = buf_alloc();
+				}
 				p = buf;
 				buf_len = 0;
 			}
@@ -196,7 +250,7 @@ uint64 callback_on_accept(utp_callback_arguments *a)
 {
 	assert(!s);
 	s = a->socket;
-	debug("Accepted inbound socket %p\n", s);
+	debug("Accepted inbound socket %p (shard %d)\n", s, shard);
 	write_data();
 	return 0;
 }
@@ -214,7 +268,7 @@ uint64 callback_on_error(utp_callback_arguments *a)
 uint64 callback_on_state_change(utp_callback_arguments *a)
 {
 	debug("state %d: %s\n", a->state, utp_state_names[a->state]);
-	utp_socket_stats *stats;
+	utp_socket_stats_ex stats;
 
 	switch (a->state) {
 		case UTP_STATE_CONNECT:
@@ -230,17 +284,23 @@ uint64 callback_on_state_change(utp_callback_arguments *a)
 		case UTP_STATE_DESTROYING:
 			debug("UTP socket is being destroyed; exiting\n");
 
-			stats = utp_get_stats(a->socket);
-			if (stats) {
+			stats.size = sizeof(stats);
+			if (utp_get_socket_stats(a->socket, &stats) == 0) {
 				debug("Socket Statistics:\n");
-				debug("    Bytes sent:          %d\n", stats->nbytes_xmit);
-				debug("    Bytes received:      %d\n", stats->nbytes_recv);
-				debug("    Packets received:    %d\n", stats->nrecv);
-				debug("    Packets sent:        %d\n", stats->nxmit);
-				debug("    Duplicate receives:  %d\n", stats->nduprecv);
-				debug("    Retransmits:         %d\n", stats->rexmit);
-				debug("    Fast Retransmits:    %d\n", stats->fastrexmit);
-				debug("    Best guess at MTU:   %d\n", stats->mtu_guess);
+				debug("    Bytes sent:          %llu\n", (unsigned long long)stats.nbytes_xmit);
+				debug("    Bytes received:      %llu\n", (unsigned long long)stats.nbytes_recv);
+				debug("    Packets received:    %llu\n", (unsigned long long)stats.nrecv);
+				debug("    Packets sent:        %llu\n", (unsigned long long)stats.nxmit);
+				debug("    Duplicate receives:  %llu\n", (unsigned long long)stats.nduprecv);
+				debug("    Retransmits:         %llu\n", (unsigned long long)stats.rexmit);
+				debug("    Fast Retransmits:    %llu\n", (unsigned long long)stats.fastrexmit);
+				debug("    Timeouts:            %llu\n", (unsigned long long)stats.nrto);
+				debug("    EACKs sent/received: %llu/%llu\n", (unsigned long long)stats.neack_sent, (unsigned long long)stats.neack_recv);
+				debug("    MTU probes:          %llu\n", (unsigned long long)stats.nmtu_probes);
+				debug("    Window limited:      %llu ms (cwnd), %llu ms (peer)\n",
+					(unsigned long long)stats.cwnd_limited_ms, (unsigned long long)stats.rwnd_limited_ms);
+				debug("    RTT:                 %u ms (var %u, rto %u)\n", stats.rtt, stats.rtt_var, stats.rto);
+				debug("    Best guess at MTU:   %u\n", stats.mtu_guess);
 			}
 			else {
 				debug("No socket statistics available\n");
@@ -264,7 +324,32 @@ uint64 callback_sendto(utp_callback_arguments *a)
 	if (o_debug >= 3)
 		hexdump(a->buf, a->len);
 
-	sendto(fd, a->buf, a->len, 0, a->address, a->address_len);
+	if (utp_io_sendto(io, a->buf, a->len, a->address, a->address_len) < 0)
+		debug("sendto: send queue full, packet dropped\n");
+	return 0;
+}
+
+uint64 callback_sendto_run(utp_callback_arguments *a)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) a->address;
+
+	debug("sendto_run: %zd bytes in %zd byte segments to %s:%d\n", a->len, a->segment_size,
+				inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+
+	if (utp_io_sendto_run(io, a->buf, a->len, a->segment_size, a->address, a->address_len) < 0)
+		debug("sendto_run: send queue full, packets dropped\n");
+	return 0;
+}
+
+uint64 callback_sendto_iov(utp_callback_arguments *a)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) a->address;
+
+	debug("sendto_iov: %zd byte packet in %zd pieces to %s:%d\n", a->len, a->num_iovecs,
+				inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+
+	if (utp_io_sendtov(io, a->iovec, a->num_iovecs, a->address, a->address_len) < 0)
+		debug("sendto_iov: send queue full, packet dropped\n");
 	return 0;
 }
 
@@ -274,11 +359,93 @@ uint64 callback_log(utp_callback_arguments *a)
 	return 0;
 }
 
+int open_socket(struct addrinfo *res)
+{
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		pdie("socket");
+
+	#ifdef __linux__
+	if (setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) != 0)
+		pdie("setsockopt");
+	#endif
+
+	if (o_shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+		pdie("setsockopt SO_REUSEPORT");
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) != 0)
+		pdie("bind");
+
+	return fd;
+}
+
+// Bind one socket per shard, in shard order, and have the kernel steer
+// packets between them by connection ID.  Then fork a process for every
+// shard but the first, which stays with us.  Returns this process's socket.
+int start_shards(struct addrinfo *res)
+{
+	int fds[o_shards], i;
+	struct sigaction sa;
+
+	for (i = 0; i < o_shards; i++)
+		fds[i] = open_socket(res);
+
+	if (utp_io_attach_shard_filter(fds[0], o_shards) != 0)
+		pdie("utp_io_attach_shard_filter");
+
+	// the connection is served by whichever shard it lands on; when that
+	// one is done, so are we
+	sa.sa_handler = handler_chld;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	shard_pids = calloc(o_shards, sizeof(pid_t));
+	for (i = 1; i < o_shards; i++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			pdie("fork");
+		if (pid == 0) {
+			shard = i;
+			free(shard_pids);
+			shard_pids = NULL;
+			break;
+		}
+		shard_pids[i] = pid;
+	}
+
+	for (i = 0; i < o_shards; i++)
+		if (i != shard)
+			close(fds[i]);
+
+	debug("Shard %d of %d, pid %d\n", shard, o_shards, getpid());
+	return fds[shard];
+}
+
+void stop_shards(void)
+{
+	int i, status;
+
+	for (i = 1; i < o_shards; i++) {
+		// the shard that served the connection exits by itself, and its
+		// status is ours
+		if (waitpid(shard_pids[i], &status, WNOHANG) == shard_pids[i]) {
+			if (WIFEXITED(status))
+				exit_code += WEXITSTATUS(status);
+			continue;
+		}
+		kill(shard_pids[i], SIGTERM);
+		waitpid(shard_pids[i], &status, 0);
+	}
+}
+
 void setup(void)
 {
 	struct addrinfo hints, *res;
 	struct sockaddr_in sin, *sinp;
-	int error;
+	int error, offload;
 	struct sigaction sigIntHandler;
 
 	sigIntHandler.sa_handler = handler;
@@ -287,21 +454,9 @@ void setup(void)
 
 	sigaction(SIGINT, &sigIntHandler, NULL);
 
-	p = buf = malloc(o_buf_size);
-	if (!buf)
-		pdie("malloc");
+	p = buf = buf_alloc();
 	debug("Allocatd %d buffer\n", o_buf_size);
 
-	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (fd < 0)
-		pdie("socket");
-
-	#ifdef __linux__
-	int on = 1;
-	if (setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) != 0)
-		pdie("setsockopt");
-	#endif
-
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -312,8 +467,10 @@ void setup(void)
 	if ((error = getaddrinfo(o_local_address, o_local_port, &hints, &res)))
 		die("getaddrinfo: %s\n", gai_strerror(error));
 
-	if (bind(fd, res->ai_addr, res->ai_addrlen) != 0)
-		pdie("bind");
+	if (o_shards > 1)
+		fd = start_shards(res);
+	else
+		fd = open_socket(res);
 
 	freeaddrinfo(res);
 
@@ -322,18 +479,56 @@ void setup(void)
 		pdie("getsockname");
 	debug("Bound to local %s:%d\n", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
 
+	// libutp's default UTP_GET_RANDOM is rand(); without this every run
+	// would use the same connection ID, and land on the same -S shard
+	srand(getpid() ^ time(NULL));
+
 	ctx = utp_init(2);
 	assert(ctx);
 	debug("UTP context %p\n", ctx);
 
+	io = utp_io_create(ctx, fd);
+	assert(io);
+	offload = utp_io_enable_offload(io, UTP_IO_GSO | UTP_IO_GRO);
+	debug("UDP segmentation offload:%s%s\n", (offload & UTP_IO_GSO) ? " GSO" : "", (offload & UTP_IO_GRO) ? " GRO" : "");
+
 	utp_set_callback(ctx, UTP_LOG,				&callback_log);
 	utp_set_callback(ctx, UTP_SENDTO,			&callback_sendto);
+	utp_set_callback(ctx, UTP_SENDTO_RUN,		&callback_sendto_run);
+	utp_set_callback(ctx, UTP_SENDTO_IOV,		&callback_sendto_iov);
 	utp_set_callback(ctx, UTP_ON_ERROR,			&callback_on_error);
 	utp_set_callback(ctx, UTP_ON_STATE_CHANGE,	&callback_on_state_change);
 	utp_set_callback(ctx, UTP_ON_READ,			&callback_on_read);
 	utp_set_callback(ctx, UTP_ON_FIREWALL,		&callback_on_firewall);
 	utp_set_callback(ctx, UTP_ON_ACCEPT,		&callback_on_accept);
 
+	utp_context_set_option(ctx, UTP_CCONTROL, o_ccontrol);
+	utp_context_set_option(ctx, UTP_PACING, o_pacing);
+	if (o_large_window) {
+		utp_context_set_option(ctx, UTP_LARGE_WINDOW, 1);
+		utp_context_set_option(ctx, UTP_SNDBUF, 32 * 1024 * 1024);
+		utp_context_set_option(ctx, UTP_RCVBUF, 32 * 1024 * 1024);
+	}
+
+	// read the clock once per batch of datagrams, except for RTT samples
+	utp_context_set_option(ctx, UTP_CLOCK_MODE, UTP_CLOCK_CACHED);
+	utp_context_set_option(ctx, UTP_PRECISE_RTT, 1);
+
+	if (o_shards > 1) {
+		utp_context_set_option(ctx, UTP_SHARD_INDEX, shard);
+		utp_context_set_option(ctx, UTP_SHARD_COUNT, o_shards);
+	}
+
+	if (o_trace) {
+		if (o_shards > 1)
+			snprintf(trace_path, sizeof(trace_path), "%s.%d", o_trace, shard);
+		else
+			snprintf(trace_path, sizeof(trace_path), "%s", o_trace);
+		if (utp_context_set_option(ctx, UTP_TRACE_SIZE, 1 << 18) != 0)
+			die("Unable to allocate trace ring\n");
+		debug("Tracing to %s\n", trace_path);
+	}
+
 	if (o_debug >= 2) {
 		utp_context_set_option(ctx, UTP_LOG_NORMAL, 1);
 		utp_context_set_option(ctx, UTP_LOG_MTU,    1);
@@ -474,21 +669,20 @@ void handle_icmp()
 
 void network_loop(void)
 {
-	unsigned char socket_data[4096];
-	struct sockaddr_in src_addr;
-	socklen_t addrlen = sizeof(src_addr);
 	ssize_t len;
 	int ret;
 
 	struct pollfd p[2];
 
+	// shards leave stdin alone until a connection has picked one of them
 	p[0].fd = STDIN_FILENO;
-	p[0].events = (o_buf_size-buf_len && !eof_flag) ? POLLIN : 0;
+	p[0].events = (o_buf_size-buf_len && !eof_flag && (o_shards <= 1 || s)) ? POLLIN : 0;
 
 	p[1].fd = fd;
-	p[1].events = POLLIN;
+	p[1].events = POLLIN | (utp_io_pending(io) ? POLLOUT : 0);
 
-	ret = poll(p, 2, 500);
+	// sleep until input arrives or libutp's next deadline
+	ret = poll(p, 2, utp_next_timeout_ms(ctx));
 	if (ret < 0) {
 		if (errno == EINTR)
 			debug("poll() returned EINTR\n");
@@ -522,28 +716,19 @@ void network_loop(void)
 		#endif
 
 		if ((p[1].revents & POLLIN) == POLLIN) {
-			while (1) {
-				len = recvfrom(fd, socket_data, sizeof(socket_data), MSG_DONTWAIT, (struct sockaddr *)&src_addr, &addrlen);
-				if (len < 0) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK) {
-						utp_issue_deferred_acks(ctx);
-						break;
-					}
-					else
-						pdie("recv");
-				}
-
-				debug("Received %zd byte UDP packet from %s:%d\n", len, inet_ntoa(src_addr.sin_addr), ntohs(src_addr.sin_port));
-				if (o_debug >= 3)
-					hexdump(socket_data, len);
-
-				if (! utp_process_udp(ctx, socket_data, len, (struct sockaddr *)&src_addr, addrlen))
-					debug("UDP packet not handled by UTP.  Ignoring.\n");
-			}
+			if (utp_io_recv(io) < 0)
+				pdie("recv");
 		}
 	}
 
 	utp_check_timeouts(ctx);
+	utp_io_flush(io);
+
+	if (o_trace && time(NULL) != trace_dumped) {
+		if (utp_trace_dump(ctx, trace_path) < 0)
+			pdie("trace dump");
+		trace_dumped = time(NULL);
+	}
 }
 
 void usage(char *name)
@@ -560,6 +745,11 @@ void usage(char *name)
 	fprintf(stderr, "    -s <IP>     Source IP\n");
 	fprintf(stderr, "    -B <size>   Buffer size\n");
 	fprintf(stderr, "    -n          Don't resolve hostnames\n");
+	fprintf(stderr, "    -S <n>      Listen with n processes sharing the port (needs -l and -p)\n");
+	fprintf(stderr, "    -t <file>   Append a congestion control trace to file (see parse_trace.py)\n");
+	fprintf(stderr, "    -c <cc>     Congestion control: ledbat (default) or cubic\n");
+	fprintf(stderr, "    -P          Pace packets instead of sending bursts\n");
+	fprintf(stderr, "    -W          Offer a large window, with 32 MB send and receive buffers\n");
 	fprintf(stderr, "\n");
 	exit(1);
 }
@@ -571,7 +761,7 @@ int main(int argc, char *argv[])
 	o_local_address = "0.0.0.0";
 
 	while (1) {
-		int c = getopt (argc, argv, "hdlp:B:s:n");
+		int c = getopt (argc, argv, "hdlp:B:s:nS:t:c:PW");
 		if (c == -1) break;
 		switch(c) {
 			case 'h': usage(argv[0]);				break;
@@ -581,6 +771,18 @@ int main(int argc, char *argv[])
 			case 'B': o_buf_size = atoi(optarg);	break;
 			case 's': o_local_address = optarg;		break;
 			case 'n': o_numeric++;					break;
+			case 'S': o_shards = atoi(optarg);		break;
+			case 't': o_trace = optarg;				break;
+			case 'c':
+				if (!strcmp(optarg, "ledbat"))
+					o_ccontrol = UTP_CC_LEDBAT;
+				else if (!strcmp(optarg, "cubic"))
+					o_ccontrol = UTP_CC_CUBIC;
+				else
+					usage(argv[0]);
+				break;
+			case 'P': o_pacing++;					break;
+			case 'W': o_large_window++;				break;
 			//case 'w': break;	// timeout for connects and final net reads
 			default:
 				die("Unhandled argument: %c\n", c);
@@ -600,6 +802,9 @@ int main(int argc, char *argv[])
 	if (! o_listen && (!o_remote_port || !o_remote_address))
 		usage(argv[0]);
 
+	if (o_shards > 1 && (!o_listen || !o_local_port))
+		usage(argv[0]);
+
 	setup();
 	while (!quit_flag)
 		network_loop();
@@ -617,12 +822,44 @@ int main(int argc, char *argv[])
 			stats->_nraw_send[0], stats->_nraw_send[1], stats->_nraw_send[2], stats->_nraw_send[3], stats->_nraw_send[4]);
 		debug("Number of packets recv:  %5d   %5d   %5d    %5d    %5d\n",
 			stats->_nraw_recv[0], stats->_nraw_recv[1], stats->_nraw_recv[2], stats->_nraw_recv[3], stats->_nraw_recv[4]);
+		debug("Socket cache hits/misses: %llu/%llu\n",
+			(unsigned long long)stats->socket_cache_hits, (unsigned long long)stats->socket_cache_misses);
 	}
 	else {
 		debug("utp_get_context_stats() failed?\n");
 	}
 
+	utp_io_stats *io_stats = utp_io_get_stats(io);
+	debug("UDP datagrams sent: %llu (%llu GSO runs), received: %llu (%llu GRO), dropped: %llu\n",
+		(unsigned long long)io_stats->nsent, (unsigned long long)io_stats->ngso,
+		(unsigned long long)io_stats->nrecv, (unsigned long long)io_stats->ngro,
+		(unsigned long long)io_stats->ndropped);
+
+	utp_pool_stats *pool_stats = utp_get_pool_stats(ctx);
+	debug("Packet buffers pooled: %llu, malloc'd: %llu, slots: %u (%u in use)\n",
+		(unsigned long long)pool_stats->nalloc, (unsigned long long)pool_stats->nfallback,
+		pool_stats->nslots, pool_stats->nslots_used);
+
+	static utp_context_histograms hists;
+	static const char *hist_names[UTP_HIST_COUNT] = { "RTT", "Queuing delay", "Reorder wait", "Send wait", "Ack wait" };
+	if (utp_get_context_histograms(ctx, &hists, 0) == 0) {
+		debug("Latencies (us):         count       p50       p99\n");
+		for (i = 0; i < UTP_HIST_COUNT; i++) {
+			debug("  %-16s %11llu %9llu %9llu\n", hist_names[i],
+				(unsigned long long)hists.hist[i].count,
+				(unsigned long long)utp_histogram_percentile(&hists.hist[i], 50),
+				(unsigned long long)utp_histogram_percentile(&hists.hist[i], 99));
+		}
+	}
+
+	if (shard_pids)
+		stop_shards();
+
+	if (o_trace && utp_trace_dump(ctx, trace_path) < 0)
+		pdie("trace dump");
+
 	debug("Destroying context\n");
 	utp_destroy(ctx);
+	utp_io_destroy(io);
 	return exit_code;
 }
@@ -82,6 +82,8 @@ enum {
 	UTP_GET_RANDOM,
 	UTP_LOG,
 	UTP_SENDTO,
+	UTP_SENDTO_RUN,
+	UTP_SENDTO_IOV,
 
 	// context and socket options that may be set/queried
     UTP_LOG_NORMAL,
@@ -90,6 +92,16 @@ enum {
 	UTP_SNDBUF,
 	UTP_RCVBUF,
 	UTP_TARGET_DELAY,
+	UTP_POOL_MAX_SLOTS,
+	UTP_SHARD_INDEX,
+	UTP_SHARD_COUNT,
+	UTP_TRACE_SIZE,
+	UTP_CLOCK_MODE,
+	UTP_PRECISE_RTT,
+	UTP_CCONTROL,
+	UTP_PACING,
+	UTP_PACING_QUANTUM,
+	UTP_LARGE_WINDOW,
 
 	UTP_ARRAY_SIZE,	// must be last
 };
@@ -116,16 +128,148 @@ typedef struct {
 		socklen_t address_len;
 		int type;
 	};
+
+	// UTP_SENDTO_RUN only: buf holds len / segment_size datagrams of
+	// segment_size bytes each, all for the same address
+	size_t segment_size;
+
+	// UTP_SENDTO_IOV only: one datagram of len bytes, gathered from
+	// num_iovecs buffers; buf is NULL
+	const struct utp_iovec *iovec;
+	size_t num_iovecs;
 } utp_callback_arguments;
 
 typedef uint64 utp_callback_t(utp_callback_arguments *);
 
+// Passed to utp_write_ref(), called once libutp no longer references the buffer
+typedef void utp_release_t(void *cookie);
+
 // Returned by utp_get_context_stats()
 typedef struct {
 	uint32 _nraw_recv[5];	// total packets recieved less than 300/600/1200/MTU bytes fpr all connections (context-wide)
 	uint32 _nraw_send[5];	// total packets sent     less than 300/600/1200/MTU bytes for all connections (context-wide)
+	uint64 socket_cache_hits;	// incoming packets whose socket was found in the lookup cache
+	uint64 socket_cache_misses;	// ... and those that had to go to the socket table
 } utp_context_stats;
 
+// A log-linear histogram of microsecond values.  Values below 8 get a bucket
+// each; above that every power of two is split into 8 equal buckets, so a
+// bucket is never wider than an eighth of its lower bound.  The last bucket
+// also takes everything beyond it (about 76 hours).
+#define UTP_HIST_BUCKETS 288
+
+typedef struct {
+	uint64 count;
+	uint64 sum;
+	uint64 buckets[UTP_HIST_BUCKETS];
+} utp_histogram;
+
+// Histograms kept by every context
+enum {
+	UTP_HIST_RTT = 0,			// round trip time of packets acked after one transmission
+	UTP_HIST_QUEUING_DELAY,		// our one-way queuing delay, as fed to congestion control
+	UTP_HIST_REORDER_WAIT,		// time out-of-order packets wait for the gap before them
+	UTP_HIST_SEND_WAIT,			// time from utp_writev() to a packet's first transmission
+	UTP_HIST_ACK_WAIT,			// time from a packet's first transmission to its ack
+
+	UTP_HIST_COUNT,	// must be last
+};
+
+// Filled in by utp_get_context_histograms()
+typedef struct {
+	utp_histogram hist[UTP_HIST_COUNT];
+} utp_context_histograms;
+
+// Values of UTP_CLOCK_MODE
+//
+// UTP_CLOCK_DIRECT calls UTP_GET_MICROSECONDS/UTP_GET_MILLISECONDS every
+// time the library needs the time.  UTP_CLOCK_CACHED calls each at most once
+// per call into the library (once per utp_process_udp_batch(), say) and
+// reuses the value.  UTP_CLOCK_HOST never calls them; the host supplies the
+// time with utp_set_time(), typically once per pass of its event loop.  Until
+// the first utp_set_time() the time reads as 0, so call it before anything
+// else once the mode is set.
+//
+// With UTP_PRECISE_RTT set, the packet timestamps that RTT and delay
+// estimates are computed from still read the clock callback every time.
+enum {
+	UTP_CLOCK_DIRECT = 0,
+	UTP_CLOCK_CACHED,
+	UTP_CLOCK_HOST,
+};
+
+// Values of UTP_CCONTROL, the congestion controller.  Set on the context it
+// is the default for new sockets; set on a socket it switches it over.
+enum {
+	UTP_CC_LEDBAT = 0,	// yields to other traffic once queuing delay reaches UTP_TARGET_DELAY
+	UTP_CC_CUBIC,		// loss-based, competes like TCP; for links of our own
+};
+
+// With UTP_PACING set (on the context for new sockets, or on a socket), new
+// data is not sent as one burst of everything the window allows, but spread
+// out at twice the congestion window per RTT in slow start and 1.25 times it
+// otherwise.  Packets held back are sent by utp_send_paced(), which
+// utp_check_timeouts() also calls; utp_next_send_us() says when it next has
+// something to do, and utp_next_timeout_ms() takes it into account.
+//
+// UTP_PACING_QUANTUM is how far behind schedule, in microseconds, a socket
+// may fall and then catch up with one burst.  It should cover the host's
+// timer granularity: the default of 1000 suits a loop that sleeps in
+// utp_next_timeout_ms().
+
+// With UTP_LARGE_WINDOW set on the context, new connections offer to keep up
+// to 16384 packets in flight each way instead of 1024, which is what it takes
+// to fill 1 Gbit/s at 100 ms and over.  The other end has to offer it too, or
+// nothing changes.  Raise UTP_SNDBUF and UTP_RCVBUF to match; each socket may
+// then buffer that many out-of-order packets from its peer.  Selective acks
+// still cover at most the 1024 packets past the last in-order one, so a loss
+// further ahead than that is only repaired by the retransmit timeout.
+
+// Congestion control events recorded when UTP_TRACE_SIZE is set.  seq_nr and
+// arg[] mean:
+//
+//   UTP_TRACE_SENT      packet sent; length, transmissions, cur_window, max_window
+//   UTP_TRACE_ACKED     packet acked; payload, transmissions, rtt (us, 0 if
+//                       resent), cur_window
+//   UTP_TRACE_LOST      packet resent on duplicate or selective acks; payload,
+//                       transmissions, cur_window, max_window
+//   UTP_TRACE_CWND      window updated on ack (seq_nr unused); max_window,
+//                       cur_window, our delay (us), target delay (us)
+//   UTP_TRACE_RTO       retransmit timeout on the oldest unacked packet;
+//                       timeout (ms), max_window, cur_window_packets,
+//                       retransmit_count
+//   UTP_TRACE_MTU_PROBE MTU probe sent (arg[3] = 0), acked (1) or lost (2);
+//                       probe size, mtu_floor, mtu_ceiling, outcome
+//   UTP_TRACE_OVERRUN   records lost because the ring wrapped before it was
+//                       read (conn_id and seq_nr unused); count
+enum {
+	UTP_TRACE_SENT = 1,
+	UTP_TRACE_ACKED,
+	UTP_TRACE_LOST,
+	UTP_TRACE_CWND,
+	UTP_TRACE_RTO,
+	UTP_TRACE_MTU_PROBE,
+	UTP_TRACE_OVERRUN,
+};
+
+// Filled in by utp_trace_read()
+typedef struct {
+	uint64 time;		// microseconds
+	uint16 conn_id;		// the socket's receive connection ID
+	uint16 seq_nr;
+	uint32 event;		// UTP_TRACE_*
+	uint32 arg[4];
+} utp_trace_record;
+
+// Returned by utp_get_pool_stats()
+typedef struct {
+	uint64 nalloc;		// packet buffers served from the pool
+	uint64 nfallback;	// packet buffers that had to be malloc'd (too large, or pool at UTP_POOL_MAX_SLOTS)
+	uint32 nslots;		// slots carved so far
+	uint32 nslots_used;	// slots currently holding a packet
+	uint32 nchunks;		// chunks the slots were carved from
+} utp_pool_stats;
+
 // Returned by utp_get_stats()
 typedef struct {
 	uint64 nbytes_recv;	// total bytes received
@@ -138,6 +282,42 @@ typedef struct {
 	uint32 mtu_guess;	// Best guess at MTU
 } utp_socket_stats;
 
+// Filled in by utp_get_socket_stats() and utp_get_context_socket_stats().
+// Set size to sizeof(utp_socket_stats_ex) before the call; libutp fills in
+// as much of the struct as both sides know about and sets size to that, so
+// fields can be added at the end without breaking older callers.
+typedef struct {
+	uint32 size;
+	uint32 nsockets;			// 1, or the number of sockets aggregated
+
+	uint64 nbytes_recv;			// total bytes received
+	uint64 nbytes_xmit;			// total bytes transmitted
+	uint64 nrecv;				// packets received
+	uint64 nxmit;				// packets transmitted
+	uint64 rexmit;				// packets resent after being reported lost
+	uint64 fastrexmit;			// packets resent by fast retransmit
+	uint64 nduprecv;			// duplicate packets received
+	uint64 neack_sent;			// selective acks sent
+	uint64 neack_recv;			// selective acks received
+	uint64 nrto;				// retransmit timeouts
+	uint64 nmtu_probes;			// MTU probes sent
+	uint64 cwnd_limited_ms;		// time spent unable to send because of the congestion window (or UTP_SNDBUF)
+	uint64 rwnd_limited_ms;		// time spent unable to send because of the peer's receive window
+
+	// Current values.  In the context-wide aggregate the windows are summed
+	// (and clamped to 32 bits; see the totals below) and the rest are
+	// averaged over the sockets.
+	uint32 mtu_guess;			// best guess at MTU
+	uint32 max_window;			// congestion window, bytes
+	uint32 cur_window;			// bytes in flight
+	uint32 rtt;					// smoothed round trip time, ms
+	uint32 rtt_var;				// its variance, ms
+	uint32 rto;					// retransmit timeout, ms
+
+	uint64 max_window_total;	// max_window, unclamped
+	uint64 cur_window_total;	// cur_window, unclamped
+} utp_socket_stats_ex;
+
 #define UTP_IOV_MAX 1024
 
 // For utp_writev, to writes data from multiple buffers
@@ -146,6 +326,14 @@ struct utp_iovec {
 	size_t iov_len;
 };
 
+// For utp_process_udp_batch, one received datagram and its source address
+struct utp_udp_packet {
+	const byte *buf;
+	size_t len;
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+};
+
 // Public Functions
 utp_context*	utp_init						(int version);
 void			utp_destroy						(utp_context *ctx);
@@ -155,11 +343,21 @@ void*			utp_context_get_userdata		(utp_context *ctx);
 int				utp_context_set_option			(utp_context *ctx, int opt, int val);
 int				utp_context_get_option			(utp_context *ctx, int opt);
 int				utp_process_udp					(utp_context *ctx, const byte *buf, size_t len, const struct sockaddr *to, socklen_t tolen);
+int				utp_process_udp_batch			(utp_context *ctx, const struct utp_udp_packet *packets, size_t count);
 int				utp_process_icmp_error			(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen);
 int				utp_process_icmp_fragmentation	(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen, uint16 next_hop_mtu);
 void			utp_check_timeouts				(utp_context *ctx);
+int				utp_next_timeout_ms				(utp_context *ctx);
+void			utp_send_paced					(utp_context *ctx);
+int				utp_next_send_us				(utp_context *ctx);
 void			utp_issue_deferred_acks			(utp_context *ctx);
 utp_context_stats* utp_get_context_stats		(utp_context *ctx);
+utp_pool_stats*	utp_get_pool_stats				(utp_context *ctx);
+int				utp_get_context_histograms		(utp_context *ctx, utp_context_histograms *out, int reset);
+uint64			utp_histogram_percentile		(const utp_histogram *h, double percentile);
+void			utp_set_time					(utp_context *ctx, uint64 microseconds);
+size_t			utp_trace_read					(utp_context *ctx, utp_trace_record *out, size_t count);
+ssize_t			utp_trace_dump					(utp_context *ctx, const char *path);
 utp_socket*		utp_create_socket				(utp_context *ctx);
 void*			utp_set_userdata				(utp_socket *s, void *userdata);
 void*			utp_get_userdata				(utp_socket *s);
@@ -168,10 +366,13 @@ int				utp_getsockopt					(utp_socket *s, int opt);
 int				utp_connect						(utp_socket *s, const struct sockaddr *to, socklen_t tolen);
 ssize_t			utp_write						(utp_socket *s, void *buf, size_t count);
 ssize_t			utp_writev						(utp_socket *s, struct utp_iovec *iovec, size_t num_iovecs);
+ssize_t			utp_write_ref					(utp_socket *s, const void *buf, size_t count, utp_release_t *release, void *cookie);
 int				utp_getpeername					(utp_socket *s, struct sockaddr *addr, socklen_t *addrlen);
 void			utp_read_drained				(utp_socket *s);
 int				utp_get_delays					(utp_socket *s, uint32 *ours, uint32 *theirs, uint32 *age);
 utp_socket_stats* utp_get_stats					(utp_socket *s);
+int				utp_get_socket_stats			(utp_socket *s, utp_socket_stats_ex *stats);
+int				utp_get_context_socket_stats	(utp_context *ctx, utp_socket_stats_ex *stats);
 utp_context*	utp_get_context					(utp_socket *s);
 void			utp_close						(utp_socket *s);
 
@@ -45,6 +45,8 @@ const char * utp_callback_names[] = {
 	"UTP_GET_RANDOM",
 	"UTP_LOG",
 	"UTP_SENDTO",
+	"UTP_SENDTO_RUN",
+	"UTP_SENDTO_IOV",
 };
 
 const char * utp_error_code_names[] = {
@@ -64,14 +66,31 @@ const char *utp_state_names[] = {
 struct_utp_context::struct_utp_context()
 	: userdata(NULL)
 	, current_ms(0)
-	, last_utp_socket(NULL)
+	, send_run_open(false)
+	, send_run_buf(NULL)
+	, send_run_seg_size(0)
+	, send_run_count(0)
+	, clock_mode(UTP_CLOCK_DIRECT)
+	, clock_precise_rtt(false)
+	, clock_us_valid(false)
+	, clock_ms_valid(false)
+	, clock_us(0)
+	, clock_ms(0)
+	, sys_clock_offset(0)
+	, sys_clock_previous(0)
+	, sys_clock_skew(0)
 	, log_normal(false)
 	, log_mtu(false)
 	, log_debug(false)
 {
 	memset(&context_stats, 0, sizeof(context_stats));
+	memset(socket_cache, 0, sizeof(socket_cache));
 	memset(callbacks, 0, sizeof(callbacks));
 	target_delay = CCONTROL_TARGET;
+	ccontrol = UTP_CC_LEDBAT;
+	pacing = false;
+	pacing_quantum = 1000;
+	large_window = false;
 	utp_sockets = new UTPSocketHT;
 
 	callbacks[UTP_GET_UDP_MTU]      = &utp_default_get_udp_mtu;
@@ -90,10 +109,13 @@ struct_utp_context::struct_utp_context()
 	// their receive buffer set much lower, to say 60 kiB or so
 	opt_rcvbuf = opt_sndbuf = 1024 * 1024;
 	last_check = 0;
+	shard_index = 0;
+	shard_count = 1;
 }
 
 struct_utp_context::~struct_utp_context() {
 	delete this->utp_sockets;
+	free(this->send_run_buf);
 }
 
 utp_context* utp_init (int version)
@@ -131,6 +153,11 @@ utp_context_stats* utp_get_context_stats(utp_context *ctx) {
 	return ctx ? &ctx->context_stats : NULL;
 }
 
+utp_pool_stats* utp_get_pool_stats(utp_context *ctx) {
+	assert(ctx);
+	return ctx ? &ctx->pool.stats : NULL;
+}
+
 ssize_t utp_write(utp_socket *socket, void *buf, size_t len) {
 	struct utp_iovec iovec = { buf, len };
 	return utp_writev(socket, &iovec, 1);
@@ -0,0 +1,833 @@
+// vim:set ts=4 sw=4 ai:
+
+/*
+ * Copyright (c) 2010-2013 BitTorrent, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Microbenchmarks for libutp.  "make bench" runs them all; run utp_bench
+// with no arguments for the list.  Numbers are wall clock and only mean
+// something relative to each other on the same machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+	#include <linux/perf_event.h>
+#endif
+#include <arpa/inet.h>
+
+#include "utp_internal.h"
+#include "libutp_io.h"
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32 rnd_state = 1;
+
+static uint32 rnd()
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static PackedSockAddr random_addr()
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x0a000000 | (rnd() & 0xffffff));
+	sin.sin_port = htons(1024 + rnd() % 60000);
+	return PackedSockAddr((const SOCKADDR_STORAGE*)&sin, sizeof(sin));
+}
+
+// Lookup cost of the socket table at various sizes, for keys that are
+// present (in random order, as packets from many peers arrive) and for keys
+// that are not (stray packets, new connections).
+static void bench_hash()
+{
+	static const size_t sizes[] = { 100, 10000, 100000 };
+	const size_t lookups = 4000000;
+
+	printf("hash: ns per lookup\n");
+	printf("%10s %10s %10s\n", "sockets", "hit", "miss");
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t n = sizes[s];
+		utpHashTable<UTPSocketKey, UTPSocketKeyData> table;
+		UTPSocketKey *keys = (UTPSocketKey*)malloc(n * sizeof(UTPSocketKey));
+		UTPSocketKey *absent = (UTPSocketKey*)malloc(n * sizeof(UTPSocketKey));
+		uint32 *order = (uint32*)malloc(lookups * sizeof(uint32));
+
+		table.Init();
+		table.Create(UTP_SOCKET_INIT);
+		for (size_t i = 0; i < n; i++) {
+			UTPSocketKey key(random_addr(), rnd()), other(random_addr(), rnd());
+			memcpy((void*)&keys[i], &key, sizeof(key));
+			memcpy((void*)&absent[i], &other, sizeof(other));
+			table.Add(keys[i])->socket = NULL;
+		}
+		for (size_t i = 0; i < lookups; i++)
+			order[i] = rnd() % n;
+
+		size_t found = 0;
+		double t0 = now_sec();
+		for (size_t i = 0; i < lookups; i++)
+			found += table.Lookup(keys[order[i]]) != NULL;
+		double t1 = now_sec();
+		for (size_t i = 0; i < lookups; i++)
+			found += table.Lookup(absent[order[i]]) != NULL;
+		double t2 = now_sec();
+
+		if (found != lookups)
+			printf("hash: %zu of %zu lookups found, expected %zu\n", found, 2 * lookups, lookups);
+		printf("%10zu %10.1f %10.1f\n", n, (t1 - t0) * 1e9 / lookups, (t2 - t1) * 1e9 / lookups);
+
+		table.Free();
+		free(keys);
+		free(absent);
+		free(order);
+	}
+}
+
+// One connection over loopback per thread, each end in a context of its own,
+// so that nothing is shared between threads but the process.  Aggregate
+// throughput should grow with the thread count up to the number of cores;
+// where it stops is where something global (a lock, a static, a cache line)
+// is being fought over.
+struct flow_end {
+	struct flow *f;
+	int fd;
+	utp_context *ctx;
+	utp_io *io;
+	uint64 datagrams, bytes;	// sent, UDP payload
+};
+
+struct flow {
+	flow_end end[2];		// [0] sends, [1] receives
+	utp_socket *s;
+	size_t target, sent, received;
+	pthread_t thread;
+};
+
+static pthread_barrier_t flow_start;
+static byte flow_data[1 << 20];
+
+static void flow_noop_release(void *cookie) {}
+
+static void flow_write(flow *f)
+{
+	while (f->sent < f->target) {
+		size_t n = f->target - f->sent;
+		if (n > sizeof(flow_data)) n = sizeof(flow_data);
+		ssize_t w = utp_write_ref(f->s, flow_data, n, &flow_noop_release, NULL);
+		if (w <= 0) return;
+		f->sent += w;
+	}
+}
+
+static uint64 flow_sendto(utp_callback_arguments *a)
+{
+	flow_end *e = (flow_end*)utp_context_get_userdata(a->context);
+	e->datagrams++;
+	e->bytes += a->len;
+	utp_io_sendto(e->io, a->buf, a->len, a->address, a->address_len);
+	return 0;
+}
+
+static uint64 flow_sendto_run(utp_callback_arguments *a)
+{
+	flow_end *e = (flow_end*)utp_context_get_userdata(a->context);
+	e->datagrams += (a->len + a->segment_size - 1) / a->segment_size;
+	e->bytes += a->len;
+	utp_io_sendto_run(e->io, a->buf, a->len, a->segment_size, a->address, a->address_len);
+	return 0;
+}
+
+static uint64 flow_sendto_iov(utp_callback_arguments *a)
+{
+	flow_end *e = (flow_end*)utp_context_get_userdata(a->context);
+	e->datagrams++;
+	e->bytes += a->len;
+	utp_io_sendtov(e->io, a->iovec, a->num_iovecs, a->address, a->address_len);
+	return 0;
+}
+
+static uint64 flow_on_state_change(utp_callback_arguments *a)
+{
+	flow_end *e = (flow_end*)utp_context_get_userdata(a->context);
+	if (a->socket == e->f->s && (a->state == UTP_STATE_CONNECT || a->state == UTP_STATE_WRITABLE))
+		flow_write(e->f);
+	return 0;
+}
+
+static uint64 flow_on_read(utp_callback_arguments *a)
+{
+	flow_end *e = (flow_end*)utp_context_get_userdata(a->context);
+	e->f->received += a->len;
+	utp_read_drained(a->socket);
+	return 0;
+}
+
+static uint64 flow_on_accept(utp_callback_arguments *a)
+{
+	return 0;
+}
+
+// Binds to the loopback address of family, AF_INET or AF_INET6
+static bool flow_open(flow_end *e, flow *f, int family)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in*)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ss;
+	socklen_t sslen;
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET6) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_loopback;
+		sslen = sizeof(*sin6);
+	} else {
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sslen = sizeof(*sin);
+	}
+
+	e->f = f;
+	e->fd = socket(family, SOCK_DGRAM, 0);
+	if (e->fd < 0 || bind(e->fd, (struct sockaddr*)&ss, sslen) != 0)
+		return false;
+	int bufsize = 4 << 20;
+	setsockopt(e->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	setsockopt(e->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+	e->ctx = utp_init(2);
+	e->io = utp_io_create(e->ctx, e->fd);
+	if (!e->ctx || !e->io)
+		return false;
+	utp_io_enable_offload(e->io, UTP_IO_GSO | UTP_IO_GRO);
+	utp_context_set_userdata(e->ctx, e);
+	utp_set_callback(e->ctx, UTP_SENDTO, &flow_sendto);
+	utp_set_callback(e->ctx, UTP_SENDTO_RUN, &flow_sendto_run);
+	utp_set_callback(e->ctx, UTP_SENDTO_IOV, &flow_sendto_iov);
+	utp_set_callback(e->ctx, UTP_ON_STATE_CHANGE, &flow_on_state_change);
+	utp_set_callback(e->ctx, UTP_ON_READ, &flow_on_read);
+	utp_set_callback(e->ctx, UTP_ON_ACCEPT, &flow_on_accept);
+	utp_context_set_option(e->ctx, UTP_CLOCK_MODE, UTP_CLOCK_CACHED);
+	return true;
+}
+
+static void flow_close(flow_end *e)
+{
+	if (e->io) utp_io_destroy(e->io);
+	if (e->ctx) utp_destroy(e->ctx);
+	if (e->fd >= 0) close(e->fd);
+}
+
+// Moves f->target bytes from end[0] to end[1]
+static void flow_transfer(flow *f)
+{
+	struct sockaddr_storage to;
+	socklen_t tolen = sizeof(to);
+
+	getsockname(f->end[1].fd, (struct sockaddr*)&to, &tolen);
+	f->s = utp_create_socket(f->end[0].ctx);
+	utp_connect(f->s, (struct sockaddr*)&to, tolen);
+	utp_io_flush(f->end[0].io);
+
+	while (f->received < f->target) {
+		struct pollfd p[2];
+		int timeout = utp_next_timeout_ms(f->end[0].ctx);
+		int other = utp_next_timeout_ms(f->end[1].ctx);
+		if (other >= 0 && (timeout < 0 || other < timeout)) timeout = other;
+
+		for (int i = 0; i < 2; i++) {
+			p[i].fd = f->end[i].fd;
+			p[i].events = POLLIN | (utp_io_pending(f->end[i].io) ? POLLOUT : 0);
+		}
+		if (poll(p, 2, timeout) < 0)
+			break;
+		for (int i = 0; i < 2; i++) {
+			if (p[i].revents & POLLIN)
+				utp_io_recv(f->end[i].io);
+			utp_check_timeouts(f->end[i].ctx);
+			utp_io_flush(f->end[i].io);
+		}
+	}
+}
+
+static void *flow_run(void *arg)
+{
+	pthread_barrier_wait(&flow_start);
+	flow_transfer((flow*)arg);
+	return NULL;
+}
+
+// threads [max threads] [MB per thread]
+static void bench_threads(int argc, char **argv)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = argc > 0 ? atoi(argv[0]) : (ncpu > 0 ? (int)ncpu : 1);
+	size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+
+	printf("threads: %zu MB per thread over loopback, %ld cores\n", mb, ncpu);
+	printf("%10s %12s %12s\n", "threads", "MB/s", "per thread");
+
+	// 1, 2, 4, ... and max_threads itself
+	for (int n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		flow *flows = (flow*)calloc(n, sizeof(flow));
+		bool ok = true;
+
+		for (int i = 0; i < n; i++) {
+			flows[i].target = mb << 20;
+			flows[i].end[0].fd = flows[i].end[1].fd = -1;
+			ok = ok && flow_open(&flows[i].end[0], &flows[i], AF_INET) && flow_open(&flows[i].end[1], &flows[i], AF_INET);
+		}
+		if (!ok) {
+			perror("threads: setup");
+			exit(1);
+		}
+
+		pthread_barrier_init(&flow_start, NULL, n + 1);
+		for (int i = 0; i < n; i++)
+			pthread_create(&flows[i].thread, NULL, &flow_run, &flows[i]);
+		pthread_barrier_wait(&flow_start);
+		double t0 = now_sec();
+		size_t total = 0;
+		for (int i = 0; i < n; i++) {
+			pthread_join(flows[i].thread, NULL);
+			total += flows[i].received;
+		}
+		double t1 = now_sec();
+		pthread_barrier_destroy(&flow_start);
+
+		double rate = total / (t1 - t0) / (1 << 20);
+		printf("%10d %12.1f %12.1f\n", n, rate, rate / n);
+
+		for (int i = 0; i < n; i++) {
+			flow_close(&flows[i].end[0]);
+			flow_close(&flows[i].end[1]);
+		}
+		free(flows);
+		if (n >= max_threads)
+			break;
+	}
+}
+
+// A virtual-time link between two contexts: each direction has a rate, a
+// one-way delay, a drop-tail queue and random loss.  The clock callbacks
+// return the simulated time, so a run takes a fraction of the time it
+// simulates and gives the same result every time.
+#define LINK_RING 8192		// packets in flight per direction, a power of two
+
+struct link_packet {
+	uint64 due;
+	size_t len;
+	byte buf[1600];
+};
+
+struct link_dir {
+	link_packet *ring;
+	size_t head, tail;
+	uint64 free_at;			// when the sender's side of the link is next idle
+};
+
+struct link_sim {
+	utp_context *ctx[2];	// [0] sends, [1] receives
+	struct sockaddr_in addr[2];
+	link_dir dir[2];		// dir[i] carries packets into ctx[i]
+	uint64 now_us;
+	double rate_bps;
+	uint64 delay_us;		// one way
+	uint32 loss;			// per 100000 packets
+	size_t queue_max;		// packets waiting for the link
+	uint64 received, drops;
+	bool writable;
+};
+
+static uint64 link_microseconds(utp_callback_arguments *a)
+{
+	return ((link_sim*)utp_context_get_userdata(a->context))->now_us;
+}
+
+static uint64 link_milliseconds(utp_callback_arguments *a)
+{
+	return ((link_sim*)utp_context_get_userdata(a->context))->now_us / 1000;
+}
+
+static uint64 link_sendto(utp_callback_arguments *a)
+{
+	link_sim *l = (link_sim*)utp_context_get_userdata(a->context);
+	link_dir *d = &l->dir[a->context == l->ctx[0] ? 1 : 0];
+	uint64 ser = (uint64)(a->len * 8 / l->rate_bps * 1e6);
+	uint64 start = d->free_at > l->now_us ? d->free_at : l->now_us;
+
+	if (rnd() % 100000 < l->loss) {
+		l->drops++;
+		return 0;
+	}
+	if (d->tail - d->head == LINK_RING || (ser && (start - l->now_us) / ser > l->queue_max)) {
+		l->drops++;
+		return 0;
+	}
+	d->free_at = start + ser;
+
+	link_packet *p = &d->ring[d->tail++ & (LINK_RING - 1)];
+	p->due = start + ser + l->delay_us;
+	p->len = a->len;
+	memcpy(p->buf, a->buf, a->len);
+	return 0;
+}
+
+static uint64 link_on_read(utp_callback_arguments *a)
+{
+	((link_sim*)utp_context_get_userdata(a->context))->received += a->len;
+	utp_read_drained(a->socket);
+	return 0;
+}
+
+static uint64 link_on_state_change(utp_callback_arguments *a)
+{
+	if (a->state == UTP_STATE_CONNECT || a->state == UTP_STATE_WRITABLE)
+		((link_sim*)utp_context_get_userdata(a->context))->writable = true;
+	return 0;
+}
+
+static uint64 link_on_accept(utp_callback_arguments *a)
+{
+	return 0;
+}
+
+// Goodput in bit/s of one bulk transfer over the link, after seconds of
+// simulated time.
+static double link_run(int ccontrol, uint32 loss, uint64 rtt_ms, double mbit, double seconds)
+{
+	static byte junk[65536];
+	link_sim l;
+
+	memset(&l, 0, sizeof(l));
+	l.now_us = 1000000;
+	l.rate_bps = mbit * 1e6;
+	l.delay_us = rtt_ms * 500;
+	l.loss = loss;
+	l.queue_max = 1000;
+	rnd_state = 1;
+
+	for (int i = 0; i < 2; i++) {
+		l.dir[i].ring = (link_packet*)malloc(LINK_RING * sizeof(link_packet));
+		l.addr[i].sin_family = AF_INET;
+		l.addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		l.addr[i].sin_port = htons(1000 + i);
+
+		utp_context *ctx = l.ctx[i] = utp_init(2);
+		utp_context_set_userdata(ctx, &l);
+		utp_set_callback(ctx, UTP_SENDTO, &link_sendto);
+		utp_set_callback(ctx, UTP_ON_READ, &link_on_read);
+		utp_set_callback(ctx, UTP_ON_STATE_CHANGE, &link_on_state_change);
+		utp_set_callback(ctx, UTP_ON_ACCEPT, &link_on_accept);
+		utp_set_callback(ctx, UTP_GET_MICROSECONDS, &link_microseconds);
+		utp_set_callback(ctx, UTP_GET_MILLISECONDS, &link_milliseconds);
+		utp_context_set_option(ctx, UTP_SNDBUF, 64 << 20);
+		utp_context_set_option(ctx, UTP_RCVBUF, 64 << 20);
+		utp_context_set_option(ctx, UTP_CCONTROL, ccontrol);
+	}
+
+	utp_socket *s = utp_create_socket(l.ctx[0]);
+	utp_connect(s, (struct sockaddr*)&l.addr[1], sizeof(l.addr[1]));
+
+	uint64 start = l.now_us, end = l.now_us + (uint64)(seconds * 1e6), next_tick = l.now_us;
+	while (l.now_us < end) {
+		if (l.writable) {
+			while (utp_write(s, junk, sizeof(junk)) > 0)
+				;
+			l.writable = false;
+		}
+
+		// jump to the next arrival or timer tick
+		uint64 t = next_tick;
+		for (int i = 0; i < 2; i++)
+			if (l.dir[i].head != l.dir[i].tail && l.dir[i].ring[l.dir[i].head & (LINK_RING - 1)].due < t)
+				t = l.dir[i].ring[l.dir[i].head & (LINK_RING - 1)].due;
+		l.now_us = t;
+
+		for (int i = 0; i < 2; i++) {
+			link_dir *d = &l.dir[i];
+			while (d->head != d->tail && d->ring[d->head & (LINK_RING - 1)].due <= l.now_us) {
+				link_packet *p = &d->ring[d->head++ & (LINK_RING - 1)];
+				utp_process_udp(l.ctx[i], p->buf, p->len, (struct sockaddr*)&l.addr[1 - i], sizeof(l.addr[0]));
+			}
+			utp_issue_deferred_acks(l.ctx[i]);
+		}
+		if (l.now_us >= next_tick) {
+			utp_check_timeouts(l.ctx[0]);
+			utp_check_timeouts(l.ctx[1]);
+			next_tick = l.now_us + 5000;
+		}
+		// a write may have failed only for lack of window
+		l.writable = true;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		utp_destroy(l.ctx[i]);
+		free(l.dir[i].ring);
+	}
+	return l.received * 8 / ((l.now_us - start) / 1e6);
+}
+
+// loss [rtt ms] [Mbit/s] [seconds]
+static void bench_loss(int argc, char **argv)
+{
+	static const uint32 losses[] = { 0, 10, 100, 1000 };	// per 100000 packets
+	uint64 rtt_ms = argc > 0 ? atoi(argv[0]) : 50;
+	double mbit = argc > 1 ? atof(argv[1]) : 100;
+	double seconds = argc > 2 ? atof(argv[2]) : 30;
+
+	printf("loss: goodput in Mbit/s, %d ms RTT, %.0f Mbit/s link, %.0f s simulated\n", (int)rtt_ms, mbit, seconds);
+	printf("%10s %10s %10s\n", "loss %", "LEDBAT", "CUBIC");
+	for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+		double ledbat = link_run(UTP_CC_LEDBAT, losses[i], rtt_ms, mbit, seconds);
+		double cubic = link_run(UTP_CC_CUBIC, losses[i], rtt_ms, mbit, seconds);
+		printf("%10.3f %10.2f %10.2f\n", losses[i] / 1000., ledbat / 1e6, cubic / 1e6);
+	}
+}
+
+// Hardware cache miss counters for the calling thread, where the kernel
+// lets us have them (not in most VMs, nor with perf_event_paranoid > 2).
+struct miss_counters {
+	int fd[2];				// L1 data read misses, last level cache misses
+	uint64 start[2];
+};
+
+static void counters_open(miss_counters *c)
+{
+	c->fd[0] = c->fd[1] = -1;
+	#ifdef __linux__
+	static const uint32 types[2] = { PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+	static const uint64 configs[2] = {
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+	};
+	for (int i = 0; i < 2; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[i];
+		attr.config = configs[i];
+		attr.exclude_kernel = 1;
+		c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	#endif
+}
+
+static uint64 counter_read(int fd)
+{
+	uint64 v = 0;
+	if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v)) return 0;
+	return v;
+}
+
+static void counters_start(miss_counters *c)
+{
+	for (int i = 0; i < 2; i++)
+		c->start[i] = counter_read(c->fd[i]);
+}
+
+// misses per operation since counters_start(), or "n/a"
+static void counters_print(miss_counters *c, size_t ops)
+{
+	for (int i = 0; i < 2; i++) {
+		if (c->fd[i] < 0)
+			printf(" %10s", "n/a");
+		else
+			printf(" %10.2f", (double)(counter_read(c->fd[i]) - c->start[i]) / ops);
+	}
+	printf("\n");
+}
+
+static void counters_close(miss_counters *c)
+{
+	for (int i = 0; i < 2; i++)
+		if (c->fd[i] >= 0) close(c->fd[i]);
+}
+
+// Per-packet cost of the receive path with many connected sockets, each
+// packet going to a different one in random order, as on a busy seed.  The
+// sockets connect to made-up peers; the SYN-ACKs are built by hand from what
+// the SYNs carried, and the data that follows arrives in order per socket.
+struct sockets_peer {
+	struct sockaddr_in addr;
+	uint16 conn_id;			// the one our SYN carried
+	uint16 ack_nr;			// the seq_nr our SYN carried
+	uint16 seq_nr;			// the peer's next
+};
+
+static sockets_peer *sockets_syn_peer;	// whose SYN is being sent
+static uint64 sockets_read;
+
+static uint64 sockets_sendto(utp_callback_arguments *a)
+{
+	const byte *b = a->buf;
+	// a version 1 ST_SYN: note the connection id and sequence number
+	if (sockets_syn_peer && b[0] == ((4 << 4) | 1)) {
+		sockets_syn_peer->conn_id = (b[2] << 8) | b[3];
+		sockets_syn_peer->ack_nr = (b[16] << 8) | b[17];
+	}
+	return 0;
+}
+
+static uint64 sockets_on_read(utp_callback_arguments *a)
+{
+	sockets_read += a->len;
+	utp_read_drained(a->socket);
+	return 0;
+}
+
+static uint64 sockets_on_accept(utp_callback_arguments *a)
+{
+	return 0;
+}
+
+// A version 1 header with no extensions and a 1 MB window
+static void sockets_header(byte *p, int type, const sockets_peer *peer)
+{
+	memset(p, 0, 20);
+	p[0] = (type << 4) | 1;
+	p[2] = peer->conn_id >> 8;
+	p[3] = peer->conn_id;
+	p[13] = 0x10;
+	p[16] = peer->seq_nr >> 8;
+	p[17] = peer->seq_nr;
+	p[18] = peer->ack_nr >> 8;
+	p[19] = peer->ack_nr;
+}
+
+// sockets [count] [packets per socket]
+static void bench_sockets(int argc, char **argv)
+{
+	size_t n = argc > 0 ? atoi(argv[0]) : 100000;
+	size_t rounds = argc > 1 ? atoi(argv[1]) : 20;
+	size_t total = n * rounds;
+	byte pkt[20 + 100];
+
+	utp_context *ctx = utp_init(2);
+	utp_set_callback(ctx, UTP_SENDTO, &sockets_sendto);
+	utp_set_callback(ctx, UTP_ON_READ, &sockets_on_read);
+	utp_set_callback(ctx, UTP_ON_ACCEPT, &sockets_on_accept);
+
+	sockets_peer *peers = (sockets_peer*)calloc(n, sizeof(sockets_peer));
+	uint32 *order = (uint32*)malloc(total * sizeof(uint32));
+	rnd_state = 1;
+
+	for (size_t i = 0; i < n; i++) {
+		sockets_peer *peer = &peers[i];
+		peer->addr.sin_family = AF_INET;
+		peer->addr.sin_addr.s_addr = htonl(0x0a000000 + i / 60000);
+		peer->addr.sin_port = htons(1024 + i % 60000);
+		peer->seq_nr = rnd();
+
+		sockets_syn_peer = peer;
+		utp_connect(utp_create_socket(ctx), (struct sockaddr*)&peer->addr, sizeof(peer->addr));
+		sockets_syn_peer = NULL;
+
+		// ST_STATE: the SYN-ACK
+		sockets_header(pkt, 2, peer);
+		utp_process_udp(ctx, pkt, 20, (struct sockaddr*)&peer->addr, sizeof(peer->addr));
+	}
+
+	// every socket once per round, in a different random order each time
+	for (size_t r = 0; r < rounds; r++) {
+		uint32 *o = order + r * n;
+		for (size_t i = 0; i < n; i++)
+			o[i] = i;
+		for (size_t i = n - 1; i > 0; i--) {
+			size_t j = rnd() % (i + 1);
+			uint32 t = o[i]; o[i] = o[j]; o[j] = t;
+		}
+	}
+
+	memset(pkt + 20, 'x', sizeof(pkt) - 20);
+	sockets_read = 0;
+
+	miss_counters counters;
+	counters_open(&counters);
+	counters_start(&counters);
+	double t0 = now_sec();
+	for (size_t k = 0; k < total; k++) {
+		sockets_peer *peer = &peers[order[k]];
+		// ST_DATA; the first reuses the SYN-ACK's seq_nr, as libutp takes
+		// ack_nr = seq_nr - 1 from the SYN-ACK
+		sockets_header(pkt, 0, peer);
+		peer->seq_nr++;
+		utp_process_udp(ctx, pkt, sizeof(pkt), (struct sockaddr*)&peer->addr, sizeof(peer->addr));
+		if ((k & 63) == 63)
+			utp_issue_deferred_acks(ctx);
+	}
+	double t1 = now_sec();
+
+	if (sockets_read != total * (sizeof(pkt) - 20))
+		printf("sockets: read %llu bytes, expected %llu\n", (unsigned long long)sockets_read,
+			(unsigned long long)(total * (sizeof(pkt) - 20)));
+	printf("sockets: %zu sockets, %zu packets in random socket order\n", n, total);
+	printf("%10s %10s %10s\n", "ns/packet", "L1D miss", "LLC miss");
+	printf("%10.1f", (t1 - t0) * 1e9 / total);
+	counters_print(&counters, total);
+	counters_close(&counters);
+
+	utp_destroy(ctx);
+	free(peers);
+	free(order);
+}
+
+// What libutp's default MTU would be for IPv6 if it did not assume every
+// IPv6 path may be Teredo: the IPv4 figure less the 20 extra header bytes.
+static uint64 v6_native_mtu(utp_callback_arguments *a)
+{
+	return 1500 - 40 - 8 - 24 - 8 - 2 - 36;
+}
+
+// v6 [MB]
+static void bench_v6(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		int family;
+		bool native_mtu;
+	} runs[] = {
+		{ "127.0.0.1", AF_INET, false },
+		{ "::1", AF_INET6, false },
+		{ "::1 no Teredo", AF_INET6, true },
+	};
+	size_t mb = argc > 0 ? atoi(argv[0]) : 64;
+
+	printf("v6: %zu MB over loopback; wire bytes add the IP and UDP headers\n", mb);
+	printf("%-14s %10s %10s %10s %10s\n", "", "MB/s", "datagram", "datagrams", "efficiency");
+	for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+		flow f;
+		memset(&f, 0, sizeof(f));
+		f.target = mb << 20;
+		f.end[0].fd = f.end[1].fd = -1;
+		if (!flow_open(&f.end[0], &f, runs[i].family) || !flow_open(&f.end[1], &f, runs[i].family)) {
+			perror("v6: setup");
+			exit(1);
+		}
+		if (runs[i].native_mtu)
+			utp_set_callback(f.end[0].ctx, UTP_GET_UDP_MTU, &v6_native_mtu);
+
+		double t0 = now_sec();
+		flow_transfer(&f);
+		double t1 = now_sec();
+
+		size_t ip_udp = runs[i].family == AF_INET6 ? 40 + 8 : 20 + 8;
+		uint64 wire = f.end[0].bytes + f.end[0].datagrams * ip_udp;
+		printf("%-14s %10.1f %10.1f %10llu %9.1f%%\n", runs[i].name, f.received / (t1 - t0) / (1 << 20),
+			(double)f.end[0].bytes / f.end[0].datagrams, (unsigned long long)f.end[0].datagrams,
+			100. * f.received / wire);
+
+		flow_close(&f.end[0]);
+		flow_close(&f.end[1]);
+	}
+}
+
+// The first advance() of a wheel whose timers were scheduled before it ever
+// saw the clock, as when utp_connect() runs straight after utp_init().  That
+// should cost the same however long the machine has been up, and the timer
+// should still fire when it is due and not before.
+static void bench_timers(int argc, char **argv)
+{
+	static const uint64 clocks[] = { 1000, 16000000, 1000000000, 1000000000000ULL };
+	const int rounds = argc > 0 ? atoi(argv[0]) : 100;
+
+	printf("timers: first advance after an early schedule, us\n");
+	printf("%16s %10s\n", "clock ms", "advance");
+
+	for (size_t c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++) {
+		uint64 now = clocks[c];
+		double total = 0;
+
+		for (int r = 0; r < rounds; r++) {
+			utp_timer_wheel *wheel = new utp_timer_wheel;
+			utp_timer timer;
+			utp_timer_list due;
+
+			wheel->schedule(&timer, now + 500);
+
+			double t0 = now_sec();
+			wheel->advance(now, &due);
+			total += now_sec() - t0;
+
+			wheel->advance(now + 499, &due);
+			if (!due.empty())
+				printf("timers: fired early at clock %llu\n", (unsigned long long)now);
+			wheel->advance(now + 500, &due);
+			if (due.pop() != &timer)
+				printf("timers: did not fire on time at clock %llu\n", (unsigned long long)now);
+			delete wheel;
+		}
+		printf("%16llu %10.2f\n", (unsigned long long)now, total * 1e6 / rounds);
+	}
+}
+
+struct bench {
+	const char *name;
+	void (*run)(int argc, char **argv);
+	const char *help;
+};
+
+static void run_hash(int argc, char **argv) { bench_hash(); }
+
+static const bench benches[] = {
+	{ "hash", run_hash, "socket table lookups at 100, 10k and 100k sockets" },
+	{ "loss", bench_loss, "LEDBAT and CUBIC goodput over a simulated lossy link [RTT ms] [Mbit/s] [s]" },
+	{ "sockets", bench_sockets, "receive path cost and cache misses with many sockets [count] [packets each]" },
+	{ "threads", bench_threads, "aggregate throughput of one context pair per thread [max threads] [MB]" },
+	{ "timers", bench_timers, "first timer wheel advance after an early schedule, by clock value [rounds]" },
+	{ "v6", bench_v6, "datagram size and goodput over ::1 against 127.0.0.1 [MB]" },
+};
+
+int main(int argc, char **argv)
+{
+	const size_t count = sizeof(benches) / sizeof(benches[0]);
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: utp_bench <benchmark> [args]\n\n");
+		for (size_t i = 0; i < count; i++)
+			fprintf(stderr, "  %-8s %s\n", benches[i].name, benches[i].help);
+		return 1;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(argv[1], benches[i].name) == 0) {
+			benches[i].run(argc - 2, argv + 2);
+			return 0;
+		}
+	}
+	fprintf(stderr, "utp_bench: unknown benchmark %s\n", argv[1]);
+	return 1;
+}
@@ -143,16 +143,44 @@ uint16 utp_call_get_udp_overhead(utp_context *ctx, utp_socket *socket, const str
 uint64 utp_call_get_milliseconds(utp_context *ctx, utp_socket *socket)
 {
 	utp_callback_arguments args;
+	if (ctx->clock_ms_valid) return ctx->clock_ms;
+	// in UTP_CLOCK_HOST, before the first utp_set_time()
+	if (ctx->clock_mode == UTP_CLOCK_HOST) return 0;
 	if (!ctx->callbacks[UTP_GET_MILLISECONDS]) return 0;
 	args.callback_type = UTP_GET_MILLISECONDS;
 	args.context = ctx;
 	args.socket = socket;
-	return ctx->callbacks[UTP_GET_MILLISECONDS](&args);
+	uint64 ms = ctx->callbacks[UTP_GET_MILLISECONDS](&args);
+	if (ctx->clock_mode != UTP_CLOCK_DIRECT) {
+		ctx->clock_ms = ms;
+		ctx->clock_ms_valid = true;
+	}
+	return ms;
 }
 
 uint64 utp_call_get_microseconds(utp_context *ctx, utp_socket *socket)
 {
 	utp_callback_arguments args;
+	if (ctx->clock_us_valid) return ctx->clock_us;
+	if (ctx->clock_mode == UTP_CLOCK_HOST) return 0;
+	if (!ctx->callbacks[UTP_GET_MICROSECONDS]) return 0;
+	args.callback_type = UTP_GET_MICROSECONDS;
+	args.context = ctx;
+	args.socket = socket;
+	uint64 us = ctx->callbacks[UTP_GET_MICROSECONDS](&args);
+	if (ctx->clock_mode != UTP_CLOCK_DIRECT) {
+		ctx->clock_us = us;
+		ctx->clock_us_valid = true;
+	}
+	return us;
+}
+
+// For the timestamps RTT and delay estimates are computed from; with
+// UTP_PRECISE_RTT set these bypass the cached clock
+uint64 utp_call_get_precise_microseconds(utp_context *ctx, utp_socket *socket)
+{
+	utp_callback_arguments args;
+	if (!ctx->clock_precise_rtt) return utp_call_get_microseconds(ctx, socket);
 	if (!ctx->callbacks[UTP_GET_MICROSECONDS]) return 0;
 	args.callback_type = UTP_GET_MICROSECONDS;
 	args.context = ctx;
@@ -206,3 +234,35 @@ void utp_call_sendto(utp_context *ctx, utp_socket *socket, const byte *buf, size
 	ctx->callbacks[UTP_SENDTO](&args);
 }
 
+uint64 utp_call_sendto_run(utp_context *ctx, utp_socket *socket, const byte *buf, size_t len, size_t segment_size, const struct sockaddr *address, socklen_t address_len)
+{
+	utp_callback_arguments args;
+	if (!ctx->callbacks[UTP_SENDTO_RUN]) return 1;
+	args.callback_type = UTP_SENDTO_RUN;
+	args.context = ctx;
+	args.socket = socket;
+	args.buf = buf;
+	args.len = len;
+	args.segment_size = segment_size;
+	args.address = address;
+	args.address_len = address_len;
+	args.flags = 0;
+	return ctx->callbacks[UTP_SENDTO_RUN](&args);
+}
+
+uint64 utp_call_sendto_iov(utp_context *ctx, utp_socket *socket, const struct utp_iovec *iovec, size_t num_iovecs, size_t len, const struct sockaddr *address, socklen_t address_len, uint32 flags)
+{
+	utp_callback_arguments args;
+	if (!ctx->callbacks[UTP_SENDTO_IOV]) return 1;
+	args.callback_type = UTP_SENDTO_IOV;
+	args.context = ctx;
+	args.socket = socket;
+	args.buf = NULL;
+	args.len = len;
+	args.iovec = iovec;
+	args.num_iovecs = num_iovecs;
+	args.address = address;
+	args.address_len = address_len;
+	args.flags = flags;
+	return ctx->callbacks[UTP_SENDTO_IOV](&args);
+}
@@ -39,9 +39,12 @@ uint16 utp_call_get_udp_mtu(utp_context *ctx, utp_socket *s, const struct sockad
 uint16 utp_call_get_udp_overhead(utp_context *ctx, utp_socket *s, const struct sockaddr *address, socklen_t address_len);
 uint64 utp_call_get_milliseconds(utp_context *ctx, utp_socket *s);
 uint64 utp_call_get_microseconds(utp_context *ctx, utp_socket *s);
+uint64 utp_call_get_precise_microseconds(utp_context *ctx, utp_socket *s);
 uint32 utp_call_get_random(utp_context *ctx, utp_socket *s);
 size_t utp_call_get_read_buffer_size(utp_context *ctx, utp_socket *s);
 void utp_call_log(utp_context *ctx, utp_socket *s, const byte *buf);
 void utp_call_sendto(utp_context *ctx, utp_socket *s, const byte *buf, size_t len, const struct sockaddr *address, socklen_t address_len, uint32 flags);
+uint64 utp_call_sendto_run(utp_context *ctx, utp_socket *s, const byte *buf, size_t len, size_t segment_size, const struct sockaddr *address, socklen_t address_len);
+uint64 utp_call_sendto_iov(utp_context *ctx, utp_socket *s, const struct utp_iovec *iovec, size_t num_iovecs, size_t len, const struct sockaddr *address, socklen_t address_len, uint32 flags);
 
 #endif // __UTP_CALLBACKS_H__
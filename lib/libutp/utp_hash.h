@@ -32,86 +32,50 @@
 // TODO: make utp_link_t a template parameter to HashTable
 typedef uint32 utp_link_t;
 
-#ifdef _MSC_VER
-// Silence the warning about the C99-compliant zero-length array at the end of the structure
-#pragma warning (disable: 4200)
-#endif
-
-typedef uint32 (*utp_hash_compute_t)(const void *keyp, size_t keysize);
-typedef uint (*utp_hash_equal_t)(const void *key_a, const void *key_b, size_t keysize);
-
-// In memory the HashTable is laid out as follows:
-//  ---------------------------- low
-//  | hash table data members  |
-//  ----------------------------  _
-//  |  indices                 |  ^
-//  |  .                       |  |  utp_link_t indices into the key-values.
-//  |  .                       |  .
-//  ----------------------------  -  <----- bep
-//  |  keys and values         |     each key-value pair has size total_size
-//  |  .                       |
-//  |  .                       |
-//  ---------------------------- high
-//
-// The code depends on the ability of the compiler to pad the length
-// of the hash table data members structure to
-// a length divisible by 32-bits with no remainder.
-//
-// Since the number of hash buckets (indices) should be odd, the code
-// asserts this and adds one to the hash bucket count to ensure that the
-// following key-value pairs array starts on a 32-bit boundary.
-//
-// The key-value pairs array should start on a 32-bit boundary, otherwise
-// processors like the ARM will silently mangle 32-bit data in these structures
-// (e.g., turning 0xABCD into 0XCDAB when moving a value from memory to register
-// when the memory address is 16 bits offset from a 32-bit boundary),
-// also, the value will be stored at an address two bytes lower than the address
-// value would ordinarily indicate.
-//
-// The key-value pair is of type T. The first field in T must
-// be the key, i.e., the first K bytes of T contains the key.
-// total_size = sizeof(T) and thus sizeof(T) >= sizeof(K)
-//
-// N is the number of buckets.
-//
-struct utp_hash_t {
-	utp_link_t N;
-	byte K;
-	byte E;
-	size_t count;
-	utp_hash_compute_t hash_compute;
-	utp_hash_equal_t hash_equal;
-	utp_link_t allocated;
-	utp_link_t used;
-	utp_link_t free;
-	utp_link_t inits[0];
-};
+#define LIBUTP_HASH_UNUSED ((utp_link_t)-1)
+
+// Smallest slot array, and the load factor (used/slots) at which it doubles
+#define LIBUTP_HASH_MIN_SLOTS 16
+#define LIBUTP_HASH_MAX_LOAD(n) ((n) - (n) / 8)
+
+uint utp_hash_mem(const void *keyp, size_t keysize);
 
-#ifdef _MSC_VER
-#pragma warning (default: 4200)
-#endif
+// Finalizer from MurmurHash3.  The table indexes slots with the low bits of
+// the hash, which K::compute_hash() makes no promise about.
+static inline uint32 utp_hash_mix(uint32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+struct utp_hash_slot {
+	uint32 hash;		// mixed hash of the entry's key, compared before the key
+	utp_link_t index;	// into the entries array, LIBUTP_HASH_UNUSED if empty
+};
 
 struct utp_hash_iterator_t {
-	utp_link_t bucket;
 	utp_link_t elem;
 
-	utp_hash_iterator_t() : bucket(0xffffffff), elem(0xffffffff) {}
+	utp_hash_iterator_t() : elem(LIBUTP_HASH_UNUSED) {}
 };
 
-uint utp_hash_mem(const void *keyp, size_t keysize);
-uint utp_hash_comp(const void *key_a, const void *key_b, size_t keysize);
+/*
+	An open-addressing hash table with Robin Hood probing.
 
-utp_hash_t *utp_hash_create(int N, int key_size, int total_size, int initial, utp_hash_compute_t hashfun = utp_hash_mem, utp_hash_equal_t eqfun = NULL);
-void *utp_hash_lookup(utp_hash_t *hash, const void *key);
-void *utp_hash_add(utp_hash_t **hashp, const void *key);
-void *utp_hash_del(utp_hash_t *hash, const void *key);
+	Entries are kept densely in an Array<T>; the slot array, whose size is a
+	power of two, maps each key to its entry.  Each slot carries the full hash
+	of its key, so a probe only compares keys (with K::operator==, inlined)
+	when the hashes match, and Robin Hood ordering keeps probes short and lets
+	lookups of absent keys stop early.  The slot array doubles once it is 7/8
+	full.
 
-void *utp_hash_iterate(utp_hash_t *hash, utp_hash_iterator_t *iter);
-void utp_hash_free_mem(utp_hash_t *hash);
-
-/*
-	This HashTable requires that T have at least sizeof(K)+sizeof(utp_link_t) bytes.
-	Usually done like this:
+	T must start with the key K and have a utp_link_t link member, which the
+	table uses to remember the slot of each entry.  K must provide
+	operator== and compute_hash().
 
 	struct K {
 		int whatever;
@@ -121,26 +85,151 @@ void utp_hash_free_mem(utp_hash_t *hash);
 		K wtf;
 		utp_link_t link; // also wtf
 	};
+
+	Delete() moves the last entry into the hole, so T pointers are only good
+	until the next Add() or Delete().  Iterate() walks the entries from last
+	to first, which makes it safe to Delete() the entry it just returned.
 */
 
 template<typename K, typename T> class utpHashTable {
-	utp_hash_t *hash;
+	Array<utp_hash_slot> slots;
+	Array<T> entries;
+	size_t mask;
+	uint64 deleted[(sizeof(T) + 7) / 8];	// copy of the last deleted entry
+
+	static const K &key_of(const T &elem) { return *(const K*)&elem; }
+
+	size_t distance(size_t pos, uint32 hash) const {
+		return (pos - (hash & mask)) & mask;
+	}
+
+	// Put an entry that is known not to be present into the slot array,
+	// displacing richer entries as we go
+	void insert_slot(utp_hash_slot slot) {
+		size_t pos = slot.hash & mask;
+		size_t dist = 0;
+		for (;;) {
+			utp_hash_slot &cur = slots[pos];
+			if (cur.index == LIBUTP_HASH_UNUSED) {
+				cur = slot;
+				entries[slot.index].link = pos;
+				return;
+			}
+			size_t cur_dist = distance(pos, cur.hash);
+			if (cur_dist < dist) {
+				utp_hash_slot tmp = cur;
+				cur = slot;
+				entries[slot.index].link = pos;
+				slot = tmp;
+				dist = cur_dist;
+			}
+			pos = (pos + 1) & mask;
+			dist++;
+		}
+	}
+
+	void resize(size_t n) {
+		slots.Resize(n);
+		mask = n - 1;
+		for (size_t i = 0; i < n; i++)
+			slots[i].index = LIBUTP_HASH_UNUSED;
+		for (size_t i = 0; i < entries.GetCount(); i++) {
+			utp_hash_slot slot;
+			slot.hash = utp_hash_mix(key_of(entries[i]).compute_hash());
+			slot.index = i;
+			insert_slot(slot);
+		}
+	}
+
+	// Returns the slot position of key, or LIBUTP_HASH_UNUSED
+	size_t find(const K &key, uint32 hash) const {
+		size_t pos = hash & mask;
+		for (size_t dist = 0;; dist++) {
+			const utp_hash_slot &cur = slots[pos];
+			if (cur.index == LIBUTP_HASH_UNUSED || distance(pos, cur.hash) < dist)
+				return LIBUTP_HASH_UNUSED;
+			if (cur.hash == hash && key_of(entries[cur.index]) == key)
+				return pos;
+			pos = (pos + 1) & mask;
+		}
+	}
+
+	// Empty slot pos, shifting the rest of its cluster back by one
+	void remove_slot(size_t pos) {
+		for (;;) {
+			size_t next = (pos + 1) & mask;
+			utp_hash_slot &cur = slots[next];
+			if (cur.index == LIBUTP_HASH_UNUSED || distance(next, cur.hash) == 0)
+				break;
+			slots[pos] = cur;
+			entries[cur.index].link = pos;
+			pos = next;
+		}
+		slots[pos].index = LIBUTP_HASH_UNUSED;
+	}
+
 public:
-	static uint compare(const void *k1, const void *k2, size_t ks) {
-		return *((K*)k1) == *((K*)k2);
+	void Init() { mask = 0; }
+	bool Allocated() { return (slots.GetAlloc() != 0); }
+	void Free() { slots.Free(); entries.Free(); mask = 0; }
+	void Create(int initial) {
+		size_t n = LIBUTP_HASH_MIN_SLOTS;
+		while (LIBUTP_HASH_MAX_LOAD(n) < (size_t)initial)
+			n *= 2;
+		entries.Resize(initial);
+		resize(n);
 	}
-	static uint32 compute_hash(const void *k, size_t ks) {
-		return ((K*)k)->compute_hash();
+
+	T *Lookup(const K &key) {
+		size_t pos = find(key, utp_hash_mix(key.compute_hash()));
+		return pos == LIBUTP_HASH_UNUSED ? NULL : &entries[slots[pos].index];
 	}
-	void Init() { hash = NULL; }
-	bool Allocated() { return (hash != NULL); }
-	void Free() { utp_hash_free_mem(hash); hash = NULL; }
-	void Create(int N, int initial) { hash = utp_hash_create(N, sizeof(K), sizeof(T), initial, &compute_hash, &compare); }
-	T *Lookup(const K &key) { return (T*)utp_hash_lookup(hash, &key); }
-	T *Add(const K &key) { return (T*)utp_hash_add(&hash, &key); }
-	T *Delete(const K &key) { return (T*)utp_hash_del(hash, &key); }
-	T *Iterate(utp_hash_iterator_t &iterator) { return (T*)utp_hash_iterate(hash, &iterator); }
-	size_t GetCount() { return hash->count; }
+
+	// Add a new element to the hash table.
+	// Returns a pointer to the new element.
+	// This assumes the element is not already present!
+	T *Add(const K &key) {
+		if (entries.GetCount() + 1 > LIBUTP_HASH_MAX_LOAD(mask + 1))
+			resize((mask + 1) * 2);
+
+		utp_hash_slot slot;
+		slot.hash = utp_hash_mix(key.compute_hash());
+		slot.index = entries.GetCount();
+
+		T &elem = entries.Append();
+		memcpy((void*)&elem, &key, sizeof(K));
+		insert_slot(slot);
+		return &elem;
+	}
+
+	// Delete an element from the table.
+	// Returns a pointer to a copy of the deleted element, good until the
+	// next Delete().
+	T *Delete(const K &key) {
+		size_t pos = find(key, utp_hash_mix(key.compute_hash()));
+		if (pos == LIBUTP_HASH_UNUSED)
+			return NULL;
+
+		size_t index = slots[pos].index;
+		memcpy(deleted, &entries[index], sizeof(T));
+		remove_slot(pos);
+
+		// fill the hole with the last entry
+		if (entries.MoveUpLast(index))
+			slots[entries[index].link].index = index;
+		return (T*)deleted;
+	}
+
+	T *Iterate(utp_hash_iterator_t &iterator) {
+		size_t n = entries.GetCount();
+		if (iterator.elem == LIBUTP_HASH_UNUSED || iterator.elem > n)
+			iterator.elem = n;
+		if (iterator.elem == 0)
+			return NULL;
+		return &entries[--iterator.elem];
+	}
+
+	size_t GetCount() { return entries.GetCount(); }
 };
 
 #endif //__UTP_HASH_H__
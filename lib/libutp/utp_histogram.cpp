@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "utp_internal.h"
+
+utp_histograms::utp_histograms()
+	: seq(0)
+{
+	memset(&live, 0, sizeof(live));
+	memset(&baseline, 0, sizeof(baseline));
+}
+
+void utp_histograms::snapshot(utp_context_histograms *out, bool reset)
+{
+	uint32 s1, s2;
+
+	do {
+		s1 = seq;
+		utp_fence_acquire();
+		memcpy(out, &live, sizeof(live));
+		utp_fence_acquire();
+		s2 = seq;
+	} while ((s1 & 1) || s1 != s2);
+
+	utp_context_histograms totals;
+	if (reset)
+		memcpy(&totals, out, sizeof(totals));
+
+	for (size_t i = 0; i < UTP_HIST_COUNT; i++) {
+		utp_histogram *h = &out->hist[i];
+		const utp_histogram *b = &baseline.hist[i];
+		h->count -= b->count;
+		h->sum -= b->sum;
+		for (size_t j = 0; j < UTP_HIST_BUCKETS; j++)
+			h->buckets[j] -= b->buckets[j];
+	}
+
+	if (reset)
+		memcpy(&baseline, &totals, sizeof(baseline));
+}
+
+// The largest value that falls in bucket b
+static uint64 utp_hist_bucket_max(size_t b)
+{
+	if (b < 8) return b;
+	if (b == UTP_HIST_BUCKETS - 1) return (uint64)-1;
+	int shift = (int)(b / 8) - 1;
+	uint64 lo = (uint64)(b % 8 + 8) << shift;
+	return lo + ((uint64)1 << shift) - 1;
+}
+
+extern "C" {
+
+int utp_get_context_histograms(utp_context *ctx, utp_context_histograms *out, int reset)
+{
+	assert(ctx && out);
+	if (!ctx || !out) return -1;
+	ctx->histograms.snapshot(out, reset != 0);
+	return 0;
+}
+
+// The value below which percentile percent of the samples in h fall, rounded
+// up to the edge of its bucket; 0 if h is empty
+uint64 utp_histogram_percentile(const utp_histogram *h, double percentile)
+{
+	if (!h || h->count == 0) return 0;
+
+	uint64 rank = (uint64)(percentile / 100.0 * (double)h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > h->count) rank = h->count;
+
+	uint64 seen = 0;
+	for (size_t b = 0; b < UTP_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank)
+			return utp_hist_bucket_max(b);
+	}
+	return utp_hist_bucket_max(UTP_HIST_BUCKETS - 1);
+}
+
+}
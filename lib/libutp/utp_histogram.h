@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __UTP_HISTOGRAM_H__
+#define __UTP_HISTOGRAM_H__
+
+#include "utp.h"
+
+// The histograms of one context (see utp_context_histograms).
+//
+// record() is only ever called from the thread driving the context, but
+// snapshot() may be called from any one other thread at a time, so the two
+// synchronize with a sequence lock: the writer makes seq odd while it
+// updates a histogram, and the reader retries its copy until it sees the
+// same even seq before and after.  Resetting does not touch what the writer
+// writes; the reader keeps the totals it last reset at in baseline and
+// subtracts them.
+
+#ifdef _MSC_VER
+	#define utp_fence_release() MemoryBarrier()
+	#define utp_fence_acquire() MemoryBarrier()
+#else
+	#define utp_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+	#define utp_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+// Which bucket v falls in
+static inline size_t utp_hist_bucket(uint64 v)
+{
+	if (v < 8) return (size_t)v;
+
+	int msb;
+#if defined(__GNUC__)
+	msb = 63 - __builtin_clzll(v);
+#else
+	msb = 0;
+	for (uint64 t = v; t >>= 1;) msb++;
+#endif
+	int shift = msb - 3;
+	size_t b = (size_t)(shift + 1) * 8 + (size_t)((v >> shift) - 8);
+	return b < UTP_HIST_BUCKETS ? b : UTP_HIST_BUCKETS - 1;
+}
+
+struct utp_histograms {
+	volatile uint32 seq;
+	utp_context_histograms live;		// written by record() only
+	utp_context_histograms baseline;	// written by snapshot() only
+
+	utp_histograms();
+
+	void record(int which, uint64 us) {
+		utp_histogram *h = &live.hist[which];
+		seq = seq + 1;
+		utp_fence_release();
+		h->count++;
+		h->sum += us;
+		h->buckets[utp_hist_bucket(us)]++;
+		utp_fence_release();
+		seq = seq + 1;
+	}
+
+	void snapshot(utp_context_histograms *out, bool reset);
+};
+
+#endif //__UTP_HISTOGRAM_H__
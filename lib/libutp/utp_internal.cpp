@@ -28,6 +28,8 @@
 #include <errno.h>
 #include <limits.h> // for UINT_MAX
 #include <time.h>
+#include <stddef.h> // for offsetof
+#include <math.h> // for cbrt
 
 #include "utp_types.h"
 #include "utp_packedsockaddr.h"
@@ -50,12 +52,49 @@
 #define DELAY_BASE_HISTORY 13
 #define MAX_WINDOW_DECAY 100 // ms
 
+// CUBIC (RFC 8312) window growth constant, in packets per second cubed,
+// and multiplicative decrease factor
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+// HyStart leaves slow start once the RTT grows this far over its minimum,
+// clamped to [CUBIC_HYSTART_MIN, CUBIC_HYSTART_MAX] microseconds
+#define CUBIC_HYSTART_MIN 4000
+#define CUBIC_HYSTART_MAX 16000
+
+// with UTP_PACING, packets go out at this many percent of the congestion
+// window per RTT, in slow start and afterwards
+#define PACING_GAIN_SLOW_START 200
+#define PACING_GAIN 125
+
 #define REORDER_BUFFER_SIZE 32
 #define REORDER_BUFFER_MAX_SIZE 1024
+
+// Extension bits (extension 2, carried by the SYN and the SYN-ACK) that we
+// set.  EXT_LARGE_SACK says selective acks longer than the classic 4 bytes
+// are understood, so the other end may cover its whole reorder buffer.
+// EXT_LARGE_WINDOW (with UTP_LARGE_WINDOW) says packets up to
+// LARGE_WINDOW_MAX_SIZE ahead are accepted, so the other end may have that
+// many in flight.  A peer that sets no bits gets exactly what it always did.
+#define EXT_BITS_LEN 8
+#define EXT_BITS_BYTE 7		// the byte of the bit field that holds our bits
+#define EXT_LARGE_SACK 0x01
+#define EXT_LARGE_WINDOW 0x02
 #define OUTGOING_BUFFER_MAX_SIZE 1024
 
+// With EXT_LARGE_WINDOW, the send queue and the reorder buffer may hold this
+// many packets instead: about 23 MB of full-size packets, enough for 1 Gbit/s
+// at 180 ms.  It has to stay well under half the sequence number space for
+// the wrapping comparisons to hold.
+#define LARGE_WINDOW_MAX_SIZE 16384
+
 #define PACKET_SIZE 1435
 
+// at most this many full-size packets, and this many bytes, are handed to
+// the host in one UTP_SENDTO_RUN call (64 is the kernel's UDP GSO limit, and
+// the largest UDP payload over IPv4 is 65507 bytes)
+#define SEND_RUN_MAX_PACKETS 64
+#define SEND_RUN_MAX_BYTES 65000
+
 // this is the minimum max_window value. It can never drop below this
 #define MIN_WINDOW_SIZE 10
 
@@ -86,7 +125,7 @@
 //   2: Brackets around IPv6 address when port is present
 //   6: Port (including colon)
 //   1: Terminating null byte
-char addrbuf[65];
+static THREAD_LOCAL char addrbuf[65];
 #define addrfmt(x, s) x.fmt(s, sizeof(s))
 
 
@@ -136,7 +175,7 @@ struct PACKED_ATTRIBUTE PacketFormatAckV1 {
 	PacketFormatV1 pf;
 	byte ext_next;
 	byte ext_len;
-	byte acks[4];
+	byte acks[REORDER_BUFFER_MAX_SIZE / 8];
 };
 
 #if (defined(__SVR4) && defined(__sun))
@@ -176,15 +215,106 @@ static const cstr statenames[] = {
 	"UNINITIALIZED", "IDLE","SYN_SENT", "SYN_RECV", "CONNECTED","CONNECTED_FULL","GOT_FIN","DESTROY_DELAY","FIN_SENT","RESET","DESTROY"
 };
 
+// What keeps a socket from sending, see UTPSocket::set_limited_by()
+enum {
+	LIMITED_NONE = 0,
+	LIMITED_CWND,		// congestion window, or UTP_SNDBUF
+	LIMITED_RWND,		// the peer's receive window
+};
+
+// A buffer passed to utp_write_ref().  Every packet carrying a slice of it
+// holds a reference, and so does utp_write_ref() while it runs.
+struct utp_buf_ref {
+	utp_release_t *release;
+	void *cookie;
+	size_t refs;
+};
+
 struct OutgoingPacket {
 	size_t length;
 	size_t payload;
 	uint64 time_sent; // microseconds
+	// microseconds; until the first transmission when the packet was
+	// queued, after it when it was first sent
+	uint64 time_first;
 	uint transmissions:31;
 	bool need_resend:1;
+	// if ref is set, the payload is not in data but at ref_payload, inside
+	// a utp_write_ref() buffer
+	utp_buf_ref *ref;
+	const byte *ref_payload;
 	byte data[1];
 };
 
+// A read position in the iovecs passed to utp_writev(), which are consumed
+// without being modified
+struct utp_iovec_cursor {
+	const struct utp_iovec *iovec;
+	size_t num_iovecs;
+	size_t i;	// current iovec
+	size_t off;	// bytes of it already consumed
+
+	utp_iovec_cursor(const struct utp_iovec *v, size_t n) : iovec(v), num_iovecs(n), i(0), off(0) {}
+
+	size_t remaining() const {
+		size_t n = 0;
+		for (size_t j = i; j < num_iovecs; j++)
+			n += iovec[j].iov_len;
+		return n - off;
+	}
+
+	// Copy the next len bytes to dst
+	void copy(byte *dst, size_t len) {
+		while (len) {
+			assert(i < num_iovecs);
+			size_t num = min<size_t>(len, iovec[i].iov_len - off);
+			memcpy(dst, (const byte*)iovec[i].iov_base + off, num);
+			dst += num;
+			len -= num;
+			off += num;
+			if (off == iovec[i].iov_len) {
+				i++;
+				off = 0;
+			}
+		}
+	}
+
+	// Skip the next len bytes, which must all be in the current iovec, and
+	// return where they start
+	const byte *take(size_t len) {
+		assert(i < num_iovecs && iovec[i].iov_len - off >= len);
+		const byte *p = (const byte*)iovec[i].iov_base + off;
+		off += len;
+		if (off == iovec[i].iov_len) {
+			i++;
+			off = 0;
+		}
+		return p;
+	}
+};
+
+// An out-of-order packet waiting in inbuf for the gap before it to fill
+struct ReorderEntry {
+	uint64 time_received; // microseconds
+	size_t len;
+	byte data[1];
+};
+
+static void utp_release_ref(utp_context *ctx, utp_buf_ref *ref)
+{
+	assert(ref->refs > 0);
+	if (--ref->refs > 0) return;
+	ref->release(ref->cookie);
+	free(ref);
+}
+
+static void utp_free_packet(utp_context *ctx, OutgoingPacket *pkt)
+{
+	if (pkt && pkt->ref)
+		utp_release_ref(ctx, pkt->ref);
+	ctx->pool.free(pkt);
+}
+
 struct SizableCircularBuffer {
 	// This is the mask. Since it's always a power of 2, adding 1 to this value will return the size.
 	size_t mask;
@@ -394,23 +524,54 @@ struct DelayHist {
 	}
 };
 
-struct UTPSocket {
-	~UTPSocket();
+struct UTPSocket;
 
-	PackedSockAddr addr;
-	utp_context *ctx;
+// A congestion controller.  It owns max_window (and slow_start and ssthresh,
+// if it has a use for them); the socket tells it about acks, losses and
+// timeouts, and asks it how many bytes may be in flight.  Hooks other than
+// on_ack and cwnd may be NULL.
+struct utp_ccontrol {
+	const char *name;
 
-	int ida; //for ack socket list
+	// the socket was initialized, or switched to this controller
+	void (*init)(UTPSocket *conn);
 
-	uint16 retransmit_count;
+	// bytes_acked bytes were newly acked.  our_delay is our queuing delay
+	// estimate in microseconds, or -1 if the ack carried no delay sample;
+	// min_rtt is the smallest RTT of the acked packets in microseconds.
+	// max_window is clamped to [MIN_WINDOW_SIZE, opt_sndbuf] afterwards.
+	void (*on_ack)(UTPSocket *conn, size_t bytes_acked, int32 our_delay, int64 min_rtt);
 
-	uint16 reorder_count;
-	byte duplicate_ack;
+	// a one-way delay sample from an incoming packet, in microseconds
+	void (*on_delay_sample)(UTPSocket *conn, uint32 actual_delay);
 
-	// the number of packets in the send queue. Packets that haven't
-	// yet been sent count as well as packets marked as needing resend
-	// the oldest un-acked packet in the send queue is seq_nr - cur_window_packets
-	uint16 cur_window_packets;
+	// packets were resent because of duplicate or selective acks
+	void (*on_loss)(UTPSocket *conn);
+
+	// the retransmit timer fired on the oldest unacked packet
+	void (*on_timeout)(UTPSocket *conn);
+
+	// the congestion window, in bytes
+	size_t (*cwnd)(const UTPSocket *conn);
+};
+
+struct ALIGNED_ATTRIBUTE(64) UTPSocket {
+	~UTPSocket();
+
+	// Fields read or written for nearly every packet sent or received come
+	// first, packed by size into the first 128 bytes, so that with many
+	// sockets each packet touches as few cache lines of its socket as
+	// possible.  Anything that is only needed on acks, timeouts or less
+	// often belongs further down.  The struct is cache line aligned (new
+	// honors that from C++17 on), so those 128 bytes are exactly two lines;
+	// "utp_bench sockets" measures the effect.
+
+	utp_context *ctx;
+
+	// the congestion controller, see UTP_CCONTROL
+	const utp_ccontrol *cc;
+
+	SizableCircularBuffer inbuf, outbuf;
 
 	// how much of the window is used, number of bytes in-flight
 	// packets that have not yet been sent do not count, packets
@@ -419,31 +580,20 @@ struct UTPSocket {
 	size_t cur_window;
 	// maximum window size, in bytes
 	size_t max_window;
+	// max receive window for other end, in bytes
+	size_t max_window_user;
 	// UTP_SNDBUF setting, in bytes
 	size_t opt_sndbuf;
-	// UTP_RCVBUF setting, in bytes
-	size_t opt_rcvbuf;
-
-	// this is the target delay, in microseconds
-	// for this socket. defaults to 100000.
-	size_t target_delay;
-
-	// Is a FIN packet in the reassembly buffer?
-	bool got_fin:1;
-	// Timeout procedure
-	bool fast_timeout:1;
 
-	// max receive window for other end, in bytes
-	size_t max_window_user;
 	CONN_STATE state;
-	// TickCount when we last decayed window (wraps)
-	int64 last_rwin_decay;
+	// Connection ID for packets I receive
+	uint32 conn_id_recv;
+	// Connection ID for packets I send
+	uint32 conn_id_send;
+	uint32 reply_micro;
 
-	// the sequence number of the FIN packet. This field is only set
-	// when we have received a FIN, and the flag field has the FIN flag set.
-	// it is used to know when it is safe to destroy the socket, we must have
-	// received all packets up to this sequence number first.
-	uint16 eof_pkt;
+	int ida; //for ack socket list
+	int idp; //for paced socket list
 
 	// All sequence numbers up to including this have been properly received
 	// by us
@@ -451,7 +601,12 @@ struct UTPSocket {
 	// This is the sequence number for the next packet to be sent.
 	uint16 seq_nr;
 
-	uint16 timeout_seq_nr;
+	// the number of packets in the send queue. Packets that haven't
+	// yet been sent count as well as packets marked as needing resend
+	// the oldest un-acked packet in the send queue is seq_nr - cur_window_packets
+	uint16 cur_window_packets;
+
+	uint16 reorder_count;
 
 	// This is the sequence number of the next packet we're allowed to
 	// do a fast resend with. This makes sure we only do a fast-resend
@@ -459,9 +614,26 @@ struct UTPSocket {
 	// or any later packet (with a higher sequence number).
 	uint16 fast_resend_seq_nr;
 
-	uint32 reply_micro;
+	byte duplicate_ack;
+
+	// Is a FIN packet in the reassembly buffer?
+	bool got_fin:1;
+	// Timeout procedure
+	bool fast_timeout:1;
+
+	// true if we're in slow-start (exponential growth) phase
+	bool slow_start;
+
+	// UTP_PACING, see pace_next below
+	bool pacing;
 
 	uint64 last_got_packet;
+
+	// End of the per-packet fields.  What follows changes on acks and
+	// timeouts.
+
+	PackedSockAddr addr;
+
 	uint64 last_sent_packet;
 	uint64 last_measured_delay;
 
@@ -470,34 +642,100 @@ struct UTPSocket {
 	// from growing when we're not sending at capacity
 	mutable uint64 last_maxed_out_window;
 
-	void *userdata;
-
 	// Round trip time
 	uint rtt;
 	// Round trip time variance
 	uint rtt_var;
 	// Round trip timeout
 	uint rto;
-	DelayHist rtt_hist;
 	uint retransmit_timeout;
 	// The RTO timer will timeout here.
 	uint64 rto_timeout;
 	// When the window size is set to zero, start this timer. It will send a new packet every 30secs.
 	uint64 zerowindow_time;
 
-	uint32 conn_seed;
-	// Connection ID for packets I receive
-	uint32 conn_id_recv;
-	// Connection ID for packets I send
-	uint32 conn_id_send;
+	uint16 retransmit_count;
+	uint16 timeout_seq_nr;
+
+	// the sequence number of the FIN packet. This field is only set
+	// when we have received a FIN, and the flag field has the FIN flag set.
+	// it is used to know when it is safe to destroy the socket, we must have
+	// received all packets up to this sequence number first.
+	uint16 eof_pkt;
+
+	// what is_full() last found to be holding us back, and since when;
+	// feeds _stats.cwnd_limited_ms and rwnd_limited_ms
+	byte limited_by;
+	uint64 limited_since;
+	void set_limited_by(byte why);
+
+	// UTP_RCVBUF setting, in bytes
+	size_t opt_rcvbuf;
 	// Last rcv window we advertised, in bytes
 	size_t last_rcv_win;
 
-	DelayHist our_hist;
-	DelayHist their_hist;
+	// this is the target delay, in microseconds
+	// for this socket. defaults to 100000.
+	size_t target_delay;
+
+	// the slow-start threshold, in bytes
+	size_t ssthresh;
+
+	// TickCount when we last decayed window (wraps)
+	int64 last_rwin_decay;
+
+	// UTP_PACING state.  pace_next is when the pacer lets the next packet
+	// out, microseconds; unsent_bytes is the payload queued in outbuf but not
+	// sent yet, which is_full() counts against the window so that packets
+	// held back by the pacer don't let the send queue grow without bound
+	uint64 pace_next;
+	size_t unsent_bytes;
+
+	// CUBIC state; windows in packets, times in milliseconds
+	double cubic_w_max;			// window before the last reduction
+	double cubic_w_est;			// what Reno would have grown to since then
+	double cubic_k;				// time to climb back to cubic_w_max
+	uint64 cubic_epoch_start;	// start of this growth epoch, 0 if none yet
+	uint64 cubic_rtt_min;		// smallest RTT seen, microseconds; for HyStart
+
+	// in ctx->timers, set to fire at next_timeout(); owner is set once the
+	// socket is in the socket table
+	utp_timer timer;
+
+	// The rest is set up once per connection, or only read now and then:
+	// MTU discovery, the delay histories and statistics.
+
+	void *userdata;
+
+	uint32 conn_seed;
 
 	// extension bytes from SYN packet
-	byte extensions[8];
+	byte extensions[EXT_BITS_LEN];
+
+	// UTP_LARGE_WINDOW when the socket was created: we set EXT_LARGE_WINDOW
+	bool large_window;
+
+	// whether the peer set EXT_LARGE_SACK
+	bool large_sack() const
+	{
+		return (extensions[EXT_BITS_BYTE] & EXT_LARGE_SACK) != 0;
+	}
+
+	// The most packets the send queue may hold.  Only more than usual if
+	// both ends set EXT_LARGE_WINDOW.
+	uint16 outgoing_buffer_max() const
+	{
+		return large_window && (extensions[EXT_BITS_BYTE] & EXT_LARGE_WINDOW)
+			? LARGE_WINDOW_MAX_SIZE : OUTGOING_BUFFER_MAX_SIZE;
+	}
+
+	// How far past ack_nr packets are accepted.  More than usual as soon as
+	// we have set EXT_LARGE_WINDOW, in case the peer saw it but we never see
+	// its answer.
+	uint16 reorder_buffer_max() const
+	{
+		return large_window ? LARGE_WINDOW_MAX_SIZE : REORDER_BUFFER_MAX_SIZE;
+	}
 
 	// MTU Discovery
 	// time when we should restart the MTU discovery
@@ -536,18 +774,14 @@ struct UTPSocket {
 	// just used for logging
 	int32 clock_drift_raw;
 
-	SizableCircularBuffer inbuf, outbuf;
-
-	#ifdef _DEBUG
-	// Public per-socket statistics, returned by utp_get_stats()
-	utp_socket_stats _stats;
-	#endif
-
-	// true if we're in slow-start (exponential growth) phase
-	bool slow_start;
+	DelayHist rtt_hist;
+	DelayHist our_hist;
+	DelayHist their_hist;
 
-	// the slow-start threshold, in bytes
-	size_t ssthresh;
+	// Public per-socket statistics, returned by utp_get_socket_stats()
+	utp_socket_stats_ex _stats;
+	// What utp_get_stats() returns, filled in from _stats
+	utp_socket_stats _legacy_stats;
 
 	void log(int level, char const *fmt, ...)
 	{
@@ -570,8 +804,24 @@ struct UTPSocket {
 		ctx->log_unchecked(this, buf2);
 	}
 
+	// Appends an event to the context's trace ring, if it has one.  time is
+	// in microseconds; pass 0 to have it read from the clock.
+	void trace(uint32 event, uint seq, uint32 a0, uint32 a1, uint32 a2, uint32 a3, uint64 time = 0)
+	{
+		if (!ctx->trace.enabled())
+			return;
+		if (time == 0)
+			time = utp_call_get_microseconds(ctx, this);
+		ctx->trace.record(time, (uint16)conn_id_recv, (uint16)seq, event, a0, a1, a2, a3);
+	}
+
 	void schedule_ack();
 
+	// puts the socket on ctx->paced_sockets for utp_send_paced()
+	void schedule_pace();
+	// moves pace_next along for a packet of length bytes sent at now_us
+	void pace_sent(size_t length, uint64 now_us);
+
 	// called every time mtu_floor or mtu_ceiling are adjusted
 	void mtu_search_update();
 	void mtu_reset();
@@ -632,7 +882,8 @@ struct UTPSocket {
 		return get_udp_overhead() + get_header_size();
 	}
 
-	void send_data(byte* b, size_t length, bandwidth_type_t type, uint32 flags = 0);
+	void send_data(byte* b, size_t length, bandwidth_type_t type, uint32 flags = 0,
+				   const byte *payload = NULL, size_t payload_len = 0);
 
 	void send_ack(bool synack = false);
 
@@ -644,15 +895,18 @@ struct UTPSocket {
 
 	void send_packet(OutgoingPacket *pkt);
 
-	bool is_full(int bytes = -1);
+	bool is_full(int bytes = -1, bool sending = false);
 	bool flush_packets();
-	void write_outgoing_packet(size_t payload, uint flags, struct utp_iovec *iovec, size_t num_iovecs);
+	bool write_outgoing_packet(size_t payload, uint flags, utp_iovec_cursor *data,
+							   utp_buf_ref *ref = NULL);
 
 	#ifdef _DEBUG
 	void check_invariant();
 	#endif
 
 	void check_timeouts();
+	uint64 next_timeout() const;
+	void schedule_timeout(bool force = false);
 	int ack_packet(uint16 seq);
 	size_t selective_ack_bytes(uint base, const byte* mask, byte len, int64& min_rtt);
 	void selective_ack(uint base, const byte *mask, byte len);
@@ -660,6 +914,23 @@ struct UTPSocket {
 	size_t get_packet_size() const;
 };
 
+void removeSocketFromPaceList(UTPSocket *conn)
+{
+	if (conn->idp >= 0)
+	{
+		UTPSocket *last = conn->ctx->paced_sockets[conn->ctx->paced_sockets.GetCount() - 1];
+
+		assert(last->idp < (int)(conn->ctx->paced_sockets.GetCount()));
+		assert(conn->ctx->paced_sockets[last->idp] == last);
+		last->idp = conn->idp;
+		conn->ctx->paced_sockets[conn->idp] = last;
+		conn->idp = -1;
+
+		// Decrease the count
+		conn->ctx->paced_sockets.SetCount(conn->ctx->paced_sockets.GetCount() - 1);
+	}
+}
+
 void removeSocketFromAckList(UTPSocket *conn)
 {
 	if (conn->ida >= 0)
@@ -677,6 +948,55 @@ void removeSocketFromAckList(UTPSocket *conn)
 	}
 }
 
+static inline UTPSocketCacheEntry *socket_cache_set(utp_context *ctx, const PackedSockAddr &addr, uint32 id)
+{
+	// the connection ID is random, so a multiplicative hash of it mixed
+	// with the low address word and port spreads the sets well enough
+	uint32 h = (id ^ addr._sin6d[3] ^ ((uint32)addr._port << 16)) * 0x9E3779B1;
+	return ctx->socket_cache[(h >> 16) & (UTP_SOCKET_CACHE_SETS - 1)];
+}
+
+// Finds the socket for a packet from addr to our receive ID id, first in
+// ctx->socket_cache and then in ctx->utp_sockets, and moves it to the
+// front of its cache set.
+static UTPSocket *lookup_socket(utp_context *ctx, const PackedSockAddr &addr, uint32 id)
+{
+	UTPSocketCacheEntry *set = socket_cache_set(ctx, addr, id);
+
+	for (int i = 0; i < UTP_SOCKET_CACHE_WAYS && set[i].socket; i++) {
+		if (set[i].recv_id == id && set[i].socket->addr == addr) {
+			UTPSocketCacheEntry e = set[i];
+			memmove(set + 1, set, i * sizeof(*set));
+			set[0] = e;
+			ctx->context_stats.socket_cache_hits++;
+			return e.socket;
+		}
+	}
+
+	ctx->context_stats.socket_cache_misses++;
+	UTPSocketKeyData* keyData = ctx->utp_sockets->Lookup(UTPSocketKey(addr, id));
+	if (!keyData)
+		return NULL;
+
+	memmove(set + 1, set, (UTP_SOCKET_CACHE_WAYS - 1) * sizeof(*set));
+	set[0].socket = keyData->socket;
+	set[0].recv_id = id;
+	return set[0].socket;
+}
+
+void removeSocketFromCache(UTPSocket *conn)
+{
+	UTPSocketCacheEntry *set = socket_cache_set(conn->ctx, conn->addr, conn->conn_id_recv);
+
+	for (int i = 0; i < UTP_SOCKET_CACHE_WAYS; i++) {
+		if (set[i].socket == conn) {
+			memmove(set + i, set + i + 1, (UTP_SOCKET_CACHE_WAYS - 1 - i) * sizeof(*set));
+			set[UTP_SOCKET_CACHE_WAYS - 1].socket = NULL;
+			break;
+		}
+	}
+}
+
 static void utp_register_sent_packet(utp_context *ctx, size_t length)
 {
 	if (length <= PACKET_SIZE_MID) {
@@ -694,14 +1014,131 @@ static void utp_register_sent_packet(utp_context *ctx, size_t length)
 	}
 }
 
+// Hand the queued run to the host.  A run of a single packet, or a host that
+// has no UTP_SENDTO_RUN callback or declines the run by returning non-zero,
+// gets one UTP_SENDTO call per packet instead.
+static void utp_flush_send_run(utp_context *ctx)
+{
+	size_t count = ctx->send_run_count;
+	if (count == 0) return;
+	ctx->send_run_count = 0;
+
+	size_t seg_size = ctx->send_run_seg_size;
+	socklen_t tolen;
+	SOCKADDR_STORAGE to = ctx->send_run_addr.get_sockaddr_storage(&tolen);
+
+	if (count > 1 &&
+		utp_call_sendto_run(ctx, NULL, ctx->send_run_buf, count * seg_size, seg_size,
+							(const struct sockaddr *)&to, tolen) == 0)
+		return;
+
+	for (size_t i = 0; i < count; i++)
+		utp_call_sendto(ctx, NULL, ctx->send_run_buf + i * seg_size, seg_size,
+						(const struct sockaddr *)&to, tolen, 0);
+}
+
+static void send_to_addr_iov(utp_context *ctx, const byte *p, size_t len, const byte *payload, size_t payload_len,
+							 const PackedSockAddr &addr, int flags);
+
+// Called by send_data() for full-size packets while a run is open.  A change
+// of peer or packet size, or a full run, flushes what is queued before
+// starting a new run.  The packet is p, followed by payload_len bytes at
+// payload for packets written with utp_write_ref().
+static void utp_queue_send_run(utp_context *ctx, const PackedSockAddr &addr, const byte *p, size_t len,
+							   const byte *payload, size_t payload_len)
+{
+	size_t hdr_len = len;
+	len += payload_len;
+
+	if (ctx->send_run_count > 0 &&
+		(ctx->send_run_addr != addr ||
+		 ctx->send_run_seg_size != len ||
+		 ctx->send_run_count == SEND_RUN_MAX_PACKETS ||
+		 (ctx->send_run_count + 1) * len > SEND_RUN_MAX_BYTES)) {
+		utp_flush_send_run(ctx);
+	}
+
+	if (!ctx->send_run_buf)
+		ctx->send_run_buf = (byte*)malloc(SEND_RUN_MAX_BYTES);
+	if (!ctx->send_run_buf) {
+		// no memory to collect runs in, send this one by itself
+		send_to_addr_iov(ctx, p, hdr_len, payload, payload_len, addr, 0);
+		return;
+	}
+
+	ctx->send_run_addr = addr;
+	ctx->send_run_seg_size = len;
+	byte *dst = ctx->send_run_buf + ctx->send_run_count * len;
+	memcpy(dst, p, hdr_len);
+	if (payload_len)
+		memcpy(dst + hdr_len, payload, payload_len);
+	ctx->send_run_count++;
+	utp_register_sent_packet(ctx, len);
+}
+
+// Start collecting full-size packets for UTP_SENDTO_RUN, if the host wants
+// runs and no enclosing call has started collecting already.  Returns whether
+// it did, to be passed to the matching utp_end_send_run().
+static bool utp_begin_send_run(utp_context *ctx)
+{
+	if (!ctx->callbacks[UTP_SENDTO_RUN] || ctx->send_run_open)
+		return false;
+	ctx->send_run_open = true;
+	return true;
+}
+
+static void utp_end_send_run(utp_context *ctx, bool begun)
+{
+	if (!begun) return;
+	ctx->send_run_open = false;
+	utp_flush_send_run(ctx);
+}
+
 void send_to_addr(utp_context *ctx, const byte *p, size_t len, const PackedSockAddr &addr, int flags = 0)
 {
+	// keep datagrams in the order they were produced
+	if (ctx->send_run_count)
+		utp_flush_send_run(ctx);
+
 	socklen_t tolen;
 	SOCKADDR_STORAGE to = addr.get_sockaddr_storage(&tolen);
 	utp_register_sent_packet(ctx, len);
 	utp_call_sendto(ctx, NULL, p, len, (const struct sockaddr *)&to, tolen, flags);
 }
 
+// Send a header and a separate payload as one datagram.  Hosts without a
+// UTP_SENDTO_IOV callback, or that decline by returning non-zero, get the two
+// gathered into one buffer for UTP_SENDTO.
+static void send_to_addr_iov(utp_context *ctx, const byte *p, size_t len, const byte *payload, size_t payload_len,
+							 const PackedSockAddr &addr, int flags)
+{
+	if (ctx->send_run_count)
+		utp_flush_send_run(ctx);
+
+	socklen_t tolen;
+	SOCKADDR_STORAGE to = addr.get_sockaddr_storage(&tolen);
+	utp_register_sent_packet(ctx, len + payload_len);
+
+	struct utp_iovec iov[2] = { { (void*)p, len }, { (void*)payload, payload_len } };
+	if (utp_call_sendto_iov(ctx, NULL, iov, 2, len + payload_len, (const struct sockaddr *)&to, tolen, flags) == 0)
+		return;
+
+	if (!payload_len) {
+		utp_call_sendto(ctx, NULL, p, len, (const struct sockaddr *)&to, tolen, flags);
+		return;
+	}
+
+	// the run buffer is free, it was flushed above
+	if (!ctx->send_run_buf)
+		ctx->send_run_buf = (byte*)malloc(SEND_RUN_MAX_BYTES);
+	// out of memory: the datagram is lost, and will be resent like one
+	if (!ctx->send_run_buf) return;
+	assert(len + payload_len <= SEND_RUN_MAX_BYTES);
+	memcpy(ctx->send_run_buf, p, len);
+	memcpy(ctx->send_run_buf + len, payload, payload_len);
+	utp_call_sendto(ctx, NULL, ctx->send_run_buf, len + payload_len, (const struct sockaddr *)&to, tolen, flags);
+}
+
 void UTPSocket::schedule_ack()
 {
 	if (ida == -1){
@@ -716,12 +1153,43 @@ void UTPSocket::schedule_ack()
 	}
 }
 
-void UTPSocket::send_data(byte* b, size_t length, bandwidth_type_t type, uint32 flags)
+void UTPSocket::schedule_pace()
+{
+	if (idp == -1)
+		idp = ctx->paced_sockets.Append(this);
+}
+
+void UTPSocket::pace_sent(size_t length, uint64 now_us)
+{
+	// without an RTT there's nothing to spread the window over
+	if (rtt == 0)
+		return;
+
+	const size_t window = max<size_t>(min(cc->cwnd(this), opt_sndbuf, max_window_user),
+									  get_packet_size());
+	const uint64 gain = slow_start ? PACING_GAIN_SLOW_START : PACING_GAIN;
+	const uint64 interval = (uint64)length * rtt * 1000 * 100 / (window * gain);
+
+	// time not used for sending is only banked up to the quantum
+	const uint64 earliest = now_us - min<uint64>(now_us, ctx->pacing_quantum);
+	pace_next = max(pace_next, earliest) + interval;
+}
+
+void UTPSocket::send_data(byte* b, size_t length, bandwidth_type_t type, uint32 flags,
+						  const byte *payload, size_t payload_len)
 {
+	const size_t hdr_len = length;
+	length += payload_len;
+
 	// time stamp this packet with local time, the stamp goes into
 	// the header of every packet at the 8th byte for 8 bytes :
 	// two integers, check packet.h for more
-	uint64 time = utp_call_get_microseconds(ctx, this);
+	uint64 time = utp_call_get_precise_microseconds(ctx, this);
+
+	// only full-size data packets (never MTU probes) are batched into runs
+	bool run = ctx->send_run_open && flags == 0 &&
+		(type == payload_bandwidth || type == retransmit_overhead) &&
+		length == get_header_size() + get_packet_size();
 
 	PacketFormatV1* b1 = (PacketFormatV1*)b;
 	b1->tv_usec = (uint32)time;
@@ -729,10 +1197,8 @@ void UTPSocket::send_data(byte* b, size_t length, bandwidth_type_t type, uint32
 
 	last_sent_packet = ctx->current_ms;
 
-	#ifdef _DEBUG
 	_stats.nbytes_xmit += length;
 	++_stats.nxmit;
-	#endif
 
 	if (ctx->callbacks[UTP_ON_OVERHEAD_STATISTICS]) {
 		size_t n;
@@ -754,10 +1220,26 @@ void UTPSocket::send_data(byte* b, size_t length, bandwidth_type_t type, uint32
 		addrfmt(addr, addrbuf), (uint)length, conn_id_send, time, reply_micro, flagnames[flags2],
 		seq_nr, ack_nr);
 #endif
-	send_to_addr(ctx, b, length, addr, flags);
+	if (run)
+		utp_queue_send_run(ctx, addr, b, hdr_len, payload, payload_len);
+	else if (payload_len)
+		send_to_addr_iov(ctx, b, hdr_len, payload, payload_len, addr, flags);
+	else
+		send_to_addr(ctx, b, length, addr, flags);
 	removeSocketFromAckList(this);
 }
 
+// Writes an extension bits header with the bits we set to p, with no
+// extension following it, and returns its length
+static size_t write_extension_bits(byte *p, bool large_window)
+{
+	p[0] = 0;
+	p[1] = EXT_BITS_LEN;
+	memset(p + 2, 0, EXT_BITS_LEN);
+	p[2 + EXT_BITS_BYTE] = EXT_LARGE_SACK | (large_window ? EXT_LARGE_WINDOW : 0);
+	return 2 + EXT_BITS_LEN;
+}
+
 void UTPSocket::send_ack(bool synack)
 {
 	PacketFormatAckV1 pfa;
@@ -784,33 +1266,39 @@ void UTPSocket::send_ack(bool synack)
 		assert(!synack);
 		pfa.pf.ext = 1;
 		pfa.ext_next = 0;
-		pfa.ext_len = 4;
-		uint m = 0;
 
 		// reorder count should only be non-zero
 		// if the packet ack_nr + 1 has not yet
 		// been received
 		assert(inbuf.get(ack_nr + 1) == NULL);
-		size_t window = min<size_t>(14+16, inbuf.size());
+
+		// if the peer takes longer masks, cover the whole reorder buffer
+		size_t window = large_sack() ? REORDER_BUFFER_MAX_SIZE : 14+16;
+		window = min<size_t>(window, inbuf.size());
+		size_t last = 0;
 		// Generate bit mask of segments received.
 		for (size_t i = 0; i < window; i++) {
 			if (inbuf.get(ack_nr + i + 2) != NULL) {
-				m |= 1 << i;
+				pfa.acks[i >> 3] |= 1 << (i & 7);
+				last = i;
 
 				#if UTP_DEBUG_LOGGING
 				log(UTP_LOG_DEBUG, "EACK packet [%u]", ack_nr + i + 2);
 				#endif
 			}
 		}
-		pfa.acks[0] = (byte)m;
-		pfa.acks[1] = (byte)(m >> 8);
-		pfa.acks[2] = (byte)(m >> 16);
-		pfa.acks[3] = (byte)(m >> 24);
-		len += 4 + 2;
+		// the mask is a multiple of 4 bytes, and no longer than it has to be
+		pfa.ext_len = (byte)max<size_t>(4, (last / 32 + 1) * 4);
+		len += pfa.ext_len + 2;
+		++_stats.neack_sent;
 
 		#if UTP_DEBUG_LOGGING
-		log(UTP_LOG_DEBUG, "Sending EACK %u [%u] bits:[%032b]", ack_nr, conn_id_send, m);
+		log(UTP_LOG_DEBUG, "Sending EACK %u [%u] len:%u", ack_nr, conn_id_send, pfa.ext_len);
 		#endif
+	} else if (synack && large_sack()) {
+		// the peer sent extension bits with its SYN; answer with ours
+		pfa.pf.ext = 2;
+		len += write_extension_bits(&pfa.ext_next, large_window);
 	} else {
 		#if UTP_DEBUG_LOGGING
 		log(UTP_LOG_DEBUG, "Sending ACK %u [%u]", ack_nr, conn_id_send);
@@ -872,7 +1360,17 @@ void UTPSocket::send_packet(OutgoingPacket *pkt)
 
 	PacketFormatV1* p1 = (PacketFormatV1*)pkt->data;
 	p1->ack_nr = ack_nr;
-	pkt->time_sent = utp_call_get_microseconds(this->ctx, this);
+	pkt->time_sent = utp_call_get_precise_microseconds(this->ctx, this);
+
+	if (pkt->transmissions == 0) {
+		ctx->histograms.record(UTP_HIST_SEND_WAIT, pkt->time_sent - pkt->time_first);
+		pkt->time_first = pkt->time_sent;
+		assert(unsent_bytes >= pkt->payload);
+		unsent_bytes -= pkt->payload;
+	}
+
+	if (pacing)
+		pace_sent(pkt->length, pkt->time_sent);
 
 	//socklen_t salen;
 	//SOCKADDR_STORAGE sa = addr.get_sockaddr_storage(&salen);
@@ -909,50 +1407,83 @@ void UTPSocket::send_packet(OutgoingPacket *pkt)
  		use_as_mtu_probe = true;
 		log(UTP_LOG_MTU, "MTU [PROBE] floor:%d ceiling:%d current:%d"
 			, mtu_floor, mtu_ceiling, mtu_probe_size);
+		trace(UTP_TRACE_MTU_PROBE, mtu_probe_seq, mtu_probe_size, mtu_floor, mtu_ceiling, 0, pkt->time_sent);
+		++_stats.nmtu_probes;
  	}
 
 	pkt->transmissions++;
+	trace(UTP_TRACE_SENT, ((PacketFormatV1*)pkt->data)->seq_nr, (uint32)pkt->length,
+		pkt->transmissions, (uint32)cur_window, (uint32)max_window, pkt->time_sent);
+	if (pkt->ref) {
+		send_data((byte*)pkt->data, pkt->length - pkt->payload,
+			(pkt->transmissions == 1) ? payload_bandwidth : retransmit_overhead,
+			use_as_mtu_probe ? UTP_UDP_DONTFRAG : 0,
+			pkt->ref_payload, pkt->payload);
+		return;
+	}
 	send_data((byte*)pkt->data, pkt->length,
 		(state == CS_SYN_SENT) ? connect_overhead
 		: (pkt->transmissions == 1) ? payload_bandwidth
 		: retransmit_overhead, use_as_mtu_probe ? UTP_UDP_DONTFRAG : 0);
 }
 
-bool UTPSocket::is_full(int bytes)
+// With sending set, the packet is already queued and only the window matters;
+// otherwise the send queue has to have room for it, and with UTP_PACING the
+// packets the pacer is holding back count against the window as well
+bool UTPSocket::is_full(int bytes, bool sending)
 {
 	size_t packet_size = get_packet_size();
 	if (bytes < 0) bytes = packet_size;
 	else if (bytes > (int)packet_size) bytes = (int)packet_size;
-	size_t max_send = min(max_window, opt_sndbuf, max_window_user);
+	size_t max_send = min(cc->cwnd(this), opt_sndbuf, max_window_user);
+	size_t window = cur_window + (pacing && !sending ? unsent_bytes : 0);
 
 	// subtract one to save space for the FIN packet
-	if (cur_window_packets >= OUTGOING_BUFFER_MAX_SIZE - 1) {
+	if (!sending && cur_window_packets >= outgoing_buffer_max() - 1) {
 
 		#if UTP_DEBUG_LOGGING
-		log(UTP_LOG_DEBUG, "is_full:false cur_window_packets:%d MAX:%d", cur_window_packets, OUTGOING_BUFFER_MAX_SIZE - 1);
+		log(UTP_LOG_DEBUG, "is_full:false cur_window_packets:%d MAX:%d", cur_window_packets, outgoing_buffer_max() - 1);
 		#endif
 
 		last_maxed_out_window = ctx->current_ms;
+		set_limited_by(LIMITED_CWND);
 		return true;
 	}
 
 	#if UTP_DEBUG_LOGGING
-	log(UTP_LOG_DEBUG, "is_full:%s. cur_window:%u pkt:%u max:%u cur_window_packets:%u max_window:%u"
-		, (cur_window + bytes > max_send) ? "true" : "false"
-		, cur_window, bytes, max_send, cur_window_packets
+	log(UTP_LOG_DEBUG, "is_full:%s. cur_window:%u unsent:%u pkt:%u max:%u cur_window_packets:%u max_window:%u"
+		, (window + bytes > max_send) ? "true" : "false"
+		, cur_window, unsent_bytes, bytes, max_send, cur_window_packets
 		, max_window);
 	#endif
 
-	if (cur_window + bytes > max_send) {
+	if (window + bytes > max_send) {
 		last_maxed_out_window = ctx->current_ms;
+		set_limited_by(max_send == max_window_user ? LIMITED_RWND : LIMITED_CWND);
 		return true;
 	}
+	set_limited_by(LIMITED_NONE);
 	return false;
 }
 
+void UTPSocket::set_limited_by(byte why)
+{
+	if (why == limited_by) return;
+	if (limited_by == LIMITED_CWND)
+		_stats.cwnd_limited_ms += ctx->current_ms - limited_since;
+	else if (limited_by == LIMITED_RWND)
+		_stats.rwnd_limited_ms += ctx->current_ms - limited_since;
+	limited_by = why;
+	limited_since = ctx->current_ms;
+}
+
 bool UTPSocket::flush_packets()
 {
 	size_t packet_size = get_packet_size();
+	bool full = false;
+	bool paced = false;
+	bool run = utp_begin_send_run(ctx);
+	const uint64 now_us = pacing ? utp_call_get_microseconds(ctx, this) : 0;
 
 	// send packets that are waiting on the pacer to be sent
 	// i has to be an unsigned 16 bit counter to wrap correctly
@@ -961,7 +1492,16 @@ bool UTPSocket::flush_packets()
 		OutgoingPacket *pkt = (OutgoingPacket*)outbuf.get(i);
 		if (pkt == 0 || (pkt->transmissions > 0 && pkt->need_resend == false)) continue;
 		// have we run out of quota?
-		if (is_full()) return true;
+		if (is_full(-1, true)) {
+			full = true;
+			break;
+		}
+
+		// is the pacer holding us back?  utp_send_paced() picks up from here
+		if (pacing && pace_next > now_us) {
+			paced = true;
+			break;
+		}
 
 		// Nagle check
 		// don't send the last packet if we have one packet in-flight
@@ -972,15 +1512,28 @@ bool UTPSocket::flush_packets()
 			send_packet(pkt);
 		}
 	}
-	return false;
+
+	if (paced)
+		schedule_pace();
+	else
+		removeSocketFromPaceList(this);
+
+	utp_end_send_run(ctx, run);
+	return full;
 }
 
 // @payload: number of bytes to send
 // @flags: either ST_DATA, or ST_FIN
-// @iovec: base address of iovec array
-// @num_iovecs: number of iovecs in array
-void UTPSocket::write_outgoing_packet(size_t payload, uint flags, struct utp_iovec *iovec, size_t num_iovecs)
+// @data: where to take the payload from; advanced past it
+// @ref: if set, data is the single buffer passed to utp_write_ref(), and
+//       the packets point into it instead of copying from it
+// Returns false if a packet could not be allocated.  Whatever was queued
+// before that is still sent; the rest of the payload is left in data.
+bool UTPSocket::write_outgoing_packet(size_t payload, uint flags, utp_iovec_cursor *data,
+									  utp_buf_ref *ref)
 {
+	bool queued = true;
+
 	// Setup initial timeout timer
 	if (cur_window_packets == 0) {
 		retransmit_timeout = rto;
@@ -989,8 +1542,9 @@ void UTPSocket::write_outgoing_packet(size_t payload, uint flags, struct utp_iov
 	}
 
 	size_t packet_size = get_packet_size();
+	const uint64 now_us = utp_call_get_microseconds(ctx, this);
 	do {
-		assert(cur_window_packets < OUTGOING_BUFFER_MAX_SIZE);
+		assert(cur_window_packets < outgoing_buffer_max());
 		assert(flags == ST_DATA || flags == ST_FIN);
 
 		size_t added = 0;
@@ -1005,62 +1559,58 @@ void UTPSocket::write_outgoing_packet(size_t payload, uint flags, struct utp_iov
 		bool append = true;
 
 		// if there's any room left in the last packet in the window
-		// and it hasn't been sent yet, fill that frame first
-		if (payload && pkt && !pkt->transmissions && pkt->payload < packet_size) {
+		// and it hasn't been sent yet, fill that frame first.  Packets
+		// pointing into a utp_write_ref() buffer are never merged.
+		if (payload && pkt && !pkt->transmissions && pkt->payload < packet_size &&
+			!pkt->ref && !ref) {
 			// Use the previous unsent packet
 			added = min(payload + pkt->payload, max<size_t>(packet_size, pkt->payload)) - pkt->payload;
-			pkt = (OutgoingPacket*)realloc(pkt,
+			OutgoingPacket *grown = (OutgoingPacket*)ctx->pool.realloc(pkt,
 										   (sizeof(OutgoingPacket) - 1) +
 										   header_size +
 										   pkt->payload + added);
+			// on failure pkt is left as it was, still in the window
+			if (!grown) {
+				queued = false;
+				break;
+			}
+			pkt = grown;
 			outbuf.put(seq_nr - 1, pkt);
 			append = false;
 			assert(!pkt->need_resend);
 		} else {
 			// Create the packet to send.
 			added = payload;
-			pkt = (OutgoingPacket*)malloc((sizeof(OutgoingPacket) - 1) +
+			pkt = (OutgoingPacket*)ctx->pool.alloc((sizeof(OutgoingPacket) - 1) +
 										  header_size +
-										  added);
+										  (ref ? 0 : added));
+			if (!pkt) {
+				queued = false;
+				break;
+			}
 			pkt->payload = 0;
 			pkt->transmissions = 0;
 			pkt->need_resend = false;
+			pkt->time_first = now_us;
+			pkt->ref = NULL;
+			pkt->ref_payload = NULL;
 		}
 
-		if (added) {
+		if (added && ref) {
 			assert(flags == ST_DATA);
 
-			// Fill it with data from the upper layer.
-			unsigned char *p = pkt->data + header_size + pkt->payload;
-			size_t needed = added;
-
-			/*
-			while (needed) {
-				*p = *(char*)iovec[0].iov_base;
-				p++;
-				iovec[0].iov_base = (char *)iovec[0].iov_base + 1;
-				needed--;
-			}
-			*/
-
-			for (size_t i = 0; i < num_iovecs && needed; i++) {
-				if (iovec[i].iov_len == 0)
-					continue;
-
-				size_t num = min<size_t>(needed, iovec[i].iov_len);
-				memcpy(p, iovec[i].iov_base, num);
-
-				p += num;
-
-				iovec[i].iov_len -= num;
-				iovec[i].iov_base = (byte*)iovec[i].iov_base + num;	// iovec[i].iov_base += num, but without void* pointers
-				needed -= num;
-			}
+			pkt->ref = ref;
+			pkt->ref_payload = data->take(added);
+			ref->refs++;
+		} else if (added) {
+			assert(flags == ST_DATA);
 
-			assert(needed == 0);
+			// Fill it with data from the upper layer.
+			data->copy(pkt->data + header_size + pkt->payload, added);
 		}
 		pkt->payload += added;
 		pkt->length = header_size + pkt->payload;
+		unsent_bytes += added;
 
 		last_rcv_win = get_rcv_window();
 
@@ -1085,7 +1635,13 @@ void UTPSocket::write_outgoing_packet(size_t payload, uint flags, struct utp_iov
 
 	} while (payload);
 
+	#if UTP_DEBUG_LOGGING
+	if (!queued) log(UTP_LOG_DEBUG, "out of memory for an outgoing packet, %u bytes not queued", (uint)payload);
+	#endif
+
 	flush_packets();
+	schedule_timeout();
+	return queued;
 }
 
 #ifdef _DEBUG
@@ -1144,6 +1700,7 @@ void UTPSocket::check_timeouts()
 				&& ((seq_nr - 1) & ACK_NR_MASK) == mtu_probe_seq
 				&& mtu_probe_seq != 0) {
 				// we only had  a single outstanding packet that timed out, and it was the probe
+				trace(UTP_TRACE_MTU_PROBE, mtu_probe_seq, mtu_probe_size, mtu_floor, mtu_ceiling, 2);
 				mtu_ceiling = mtu_probe_size - 1;
 				mtu_search_update();
 				// this packet was most likely dropped because the packet size being
@@ -1197,25 +1754,8 @@ void UTPSocket::check_timeouts()
 			if (!ignore_loss) {
 				// On Timeout
 				duplicate_ack = 0;
-
-				int packet_size = get_packet_size();
-
-				if ((cur_window_packets == 0) && ((int)max_window > packet_size)) {
-					// we don't have any packets in-flight, even though
-					// we could. This implies that the connection is just
-					// idling. No need to be aggressive about resetting the
-					// congestion window. Just let it decay by a 3:rd.
-					// don't set it any lower than the packet size though
-					max_window = max(max_window * 2 / 3, size_t(packet_size));
-				} else {
-					// our delay was so high that our congestion window
-					// was shrunk below one packet, preventing us from
-					// sending anything for one time-out period. Now, reset
-					// the congestion window to fit one packet, to start over
-					// again
-					max_window = packet_size;
-					slow_start = true;
-				}
+				if (cc->on_timeout)
+					cc->on_timeout(this);
 			}
 
 			// every packet should be considered lost
@@ -1229,11 +1769,13 @@ void UTPSocket::check_timeouts()
 
 			if (cur_window_packets > 0) {
 				retransmit_count++;
-				// used in parse_log.py
+				++_stats.nrto;
 				log(UTP_LOG_NORMAL, "Packet timeout. Resend. seq_nr:%u. timeout:%u "
 					"max_window:%u cur_window_packets:%d"
 					, seq_nr - cur_window_packets, retransmit_timeout
 					, (uint)max_window, int(cur_window_packets));
+				trace(UTP_TRACE_RTO, seq_nr - cur_window_packets, retransmit_timeout,
+					(uint32)max_window, cur_window_packets, retransmit_count);
 
 				fast_timeout = true;
 				timeout_seq_nr = seq_nr;
@@ -1286,6 +1828,73 @@ void UTPSocket::check_timeouts()
 	}
 }
 
+// The earliest time at which check_timeouts() has something to do, or
+// (uint64)-1 if there is nothing it is waiting for
+uint64 UTPSocket::next_timeout() const
+{
+	uint64 next = (uint64)-1;
+
+	switch (state) {
+	case CS_SYN_SENT:
+	case CS_SYN_RECV:
+	case CS_CONNECTED_FULL:
+	case CS_CONNECTED:
+	case CS_FIN_SENT:
+		if (max_window_user == 0)
+			next = min(next, zerowindow_time);
+		if (rto_timeout > 0)
+			next = min(next, rto_timeout);
+		if (state >= CS_CONNECTED && state < CS_GOT_FIN)
+			next = min(next, last_sent_packet + KEEPALIVE_INTERVAL);
+
+		// While there are packets queued, or the socket is waiting to become
+		// writable, keep running flush_packets() and is_full() as often as
+		// the old fixed sweep did
+		if (cur_window_packets > 0 || state == CS_CONNECTED_FULL)
+			next = min(next, ctx->current_ms + TIMEOUT_CHECK_INTERVAL);
+		break;
+
+	case CS_GOT_FIN:
+	case CS_DESTROY_DELAY:
+		next = rto_timeout;
+		break;
+
+	case CS_DESTROY:
+		// utp_check_timeouts() deletes it
+		next = ctx->current_ms;
+		break;
+
+	// prevent warning
+	case CS_UNINITIALIZED:
+	case CS_IDLE:
+	case CS_RESET:
+		break;
+	}
+
+	return next;
+}
+
+// Make sure the timer fires no later than next_timeout().  This is called
+// after anything that may have moved a deadline earlier; firing early is
+// harmless, check_timeouts() just finds nothing to do, so a later deadline
+// leaves the timer alone unless forced, as it is after check_timeouts().
+void UTPSocket::schedule_timeout(bool force)
+{
+	if (!timer.owner)
+		return;
+
+	uint64 next = next_timeout();
+	if (next == (uint64)-1) {
+		if (force) ctx->timers.cancel(&timer);
+		return;
+	}
+
+	if (!force && timer.in_wheel && timer.expires <= next)
+		return;
+
+	ctx->timers.schedule(&timer, next);
+}
+
 // this should be called every time we change mtu_floor or mtu_ceiling
 void UTPSocket::mtu_search_update()
 {
@@ -1359,10 +1968,15 @@ int UTPSocket::ack_packet(uint16 seq)
 
 	outbuf.put(seq, NULL);
 
+	const uint64 now_us = utp_call_get_precise_microseconds(this->ctx, this);
+	ctx->histograms.record(UTP_HIST_ACK_WAIT, now_us - pkt->time_first);
+
 	// if we never re-sent the packet, update the RTT estimate
 	if (pkt->transmissions == 1) {
+		ctx->histograms.record(UTP_HIST_RTT, now_us - pkt->time_sent);
+
 		// Estimate the round trip time.
-		const uint32 ertt = (uint32)((utp_call_get_microseconds(this->ctx, this) - pkt->time_sent) / 1000);
+		const uint32 ertt = (uint32)((now_us - pkt->time_sent) / 1000);
 		if (rtt == 0) {
 			// First round trip time sample
 			rtt = ertt;
@@ -1395,7 +2009,10 @@ int UTPSocket::ack_packet(uint16 seq)
 		assert(cur_window >= pkt->payload);
 		cur_window -= pkt->payload;
 	}
-	free(pkt);
+	trace(UTP_TRACE_ACKED, seq, (uint32)pkt->payload, pkt->transmissions,
+		pkt->transmissions == 1 ? (uint32)(now_us - pkt->time_sent) : 0,
+		(uint32)cur_window, now_us);
+	utp_free_packet(ctx, pkt);
 	retransmit_count = 0;
 	return 0;
 }
@@ -1406,8 +2023,8 @@ size_t UTPSocket::selective_ack_bytes(uint base, const byte* mask, byte len, int
 	if (cur_window_packets == 0) return 0;
 
 	size_t acked_bytes = 0;
-	int bits = len * 8;
-	uint64 now = utp_call_get_microseconds(this->ctx, this);
+	int bits = len * 8 - 1;
+	uint64 now = utp_call_get_precise_microseconds(this->ctx, this);
 
 	do {
 		uint v = base + bits;
@@ -1455,13 +2072,15 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 	int nr = 0;
 
 #if UTP_DEBUG_LOGGING
-	char bitmask[1024] = {0};
+	// one character per bit of the largest mask len can describe
+	char bitmask[255 * 8 + 1];
 	int counter = bits;
 	for (int i = 0; i <= bits; ++i) {
 		bool bit_set = counter >= 0 && mask[counter>>3] & (1 << (counter & 7));
 		bitmask[i] = bit_set ? '1' : '0';
 		--counter;
 	}
+	bitmask[bits + 1] = '\0';
 
 	log(UTP_LOG_DEBUG, "Got EACK [%s] base:%u", bitmask, base);
 #endif
@@ -1535,7 +2154,7 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 		// if count is less than our re-send limit, we haven't seen enough
 		// acked packets in front of this one to warrant a re-send.
 		// if count == 0, we're still going through the tail of zeroes
-		if (((v - fast_resend_seq_nr) & ACK_NR_MASK) <= OUTGOING_BUFFER_MAX_SIZE &&
+		if (((v - fast_resend_seq_nr) & ACK_NR_MASK) <= outgoing_buffer_max() &&
 			count >= DUPLICATE_ACKS_BEFORE_RESEND) {
 			// resends is a stack, and we're mostly interested in the top of it
 			// if we're full, just throw away the lower half
@@ -1558,7 +2177,7 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 		}
 	} while (--bits >= -1);
 
-	if (((base - 1 - fast_resend_seq_nr) & ACK_NR_MASK) <= OUTGOING_BUFFER_MAX_SIZE &&
+	if (((base - 1 - fast_resend_seq_nr) & ACK_NR_MASK) <= outgoing_buffer_max() &&
 		count >= DUPLICATE_ACKS_BEFORE_RESEND) {
 		// if we get enough duplicate acks to start
 		// resending, the first packet we should resend
@@ -1590,15 +2209,14 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 		// case they will not be in the send queue anymore
 		if (!pkt) continue;
 
-		// used in parse_log.py
 		log(UTP_LOG_NORMAL, "Packet %u lost. Resending", v);
+		trace(UTP_TRACE_LOST, v, (uint32)pkt->payload, pkt->transmissions,
+			(uint32)cur_window, (uint32)max_window);
 
 		// On Loss
 		back_off = true;
 
-		#ifdef _DEBUG
 		++_stats.rexmit;
-		#endif
 
 		send_packet(pkt);
 		fast_resend_seq_nr = (v + 1) & ACK_NR_MASK;
@@ -1607,8 +2225,8 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 		if (++i >= 4) break;
 	}
 
-	if (back_off)
-		maybe_decay_win(ctx->current_ms);
+	if (back_off && cc->on_loss)
+		cc->on_loss(this);
 
 	duplicate_ack = count;
 }
@@ -1619,11 +2237,35 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	// variable is the RTT in microseconds
 
 	assert(min_rtt >= 0);
-	int32 our_delay = min<uint32>(our_hist.get_value(), uint32(min_rtt));
-	assert(our_delay != INT_MAX);
-	assert(our_delay >= 0);
+	int32 our_delay = -1;
+	if (actual_delay != 0) {
+		our_delay = min<uint32>(our_hist.get_value(), uint32(min_rtt));
+		assert(our_delay != INT_MAX);
+		assert(our_delay >= 0);
+
+		utp_call_on_delay_sample(this->ctx, this, our_delay / 1000);
+		ctx->histograms.record(UTP_HIST_QUEUING_DELAY, our_delay);
+	}
+
+	cc->on_ack(this, bytes_acked, our_delay, min_rtt);
 
-	utp_call_on_delay_sample(this->ctx, this, our_delay / 1000);
+	// make sure that the congestion window is below max
+	// make sure that we don't shrink our window too small
+	max_window = clamp<size_t>(max_window, MIN_WINDOW_SIZE, opt_sndbuf);
+
+	trace(UTP_TRACE_CWND, 0, (uint32)max_window, (uint32)cur_window,
+		our_delay < 0 ? 0 : (uint32)our_delay, (uint32)target_delay);
+}
+
+// LEDBAT (RFC 6817): grow the window while our queuing delay is below
+// target_delay and shrink it in proportion as it goes above, so that we
+// yield to any other traffic on the bottleneck
+static void ledbat_on_ack(UTPSocket *conn, size_t bytes_acked, int32 our_delay, int64 min_rtt)
+{
+	// without a delay measurement there's no point in invoking the
+	// congestion control
+	if (our_delay < 0)
+		return;
 
 	// This test the connection under heavy load from foreground
 	// traffic. Pretend that our delays are very high to force the
@@ -1631,7 +2273,7 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	//our_delay *= 4;
 
 	// target is microseconds
-	int target = target_delay;
+	int target = conn->target_delay;
 	if (target <= 0) target = 100000;
 
 	// this is here to compensate for very large clock drift that affects
@@ -1645,8 +2287,8 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	// if clock_drift < -200000 start applying a penalty delay proportional
 	// to how far beoynd -200000 the clock drift is
 	int32 penalty = 0;
-	if (clock_drift < -200000) {
-		penalty = (-clock_drift - 200000) / 7;
+	if (conn->clock_drift < -200000) {
+		penalty = (-conn->clock_drift - 200000) / 7;
 		our_delay += penalty;
 	}
 
@@ -1667,7 +2309,7 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	// window, in order to keep the gain within sane boundries.
 
 	assert(bytes_acked > 0);
-	double window_factor = (double)min(bytes_acked, max_window) / (double)max(max_window, bytes_acked);
+	double window_factor = (double)min(bytes_acked, conn->max_window) / (double)max(conn->max_window, bytes_acked);
 
 	double delay_factor = off_target / target;
 	double scaled_gain = MAX_CWND_INCREASE_BYTES_PER_RTT * window_factor * delay_factor;
@@ -1677,9 +2319,9 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	// to the number of bytes that were acked, so that once one window has been acked (one rtt)
 	// the increase limit is not exceeded
 	// the +1. is to allow for floating point imprecision
-	assert(scaled_gain <= 1. + MAX_CWND_INCREASE_BYTES_PER_RTT * (double)min(bytes_acked, max_window) / (double)max(max_window, bytes_acked));
+	assert(scaled_gain <= 1. + MAX_CWND_INCREASE_BYTES_PER_RTT * (double)min(bytes_acked, conn->max_window) / (double)max(conn->max_window, bytes_acked));
 
-	if (scaled_gain > 0 && ctx->current_ms - last_maxed_out_window > 1000) {
+	if (scaled_gain > 0 && conn->ctx->current_ms - conn->last_maxed_out_window > 1000) {
 		// if it was more than 1 second since we tried to send a packet
 		// and stopped because we hit the max window, we're most likely rate
 		// limited (which prevents us from ever hitting the window size)
@@ -1687,56 +2329,208 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 		scaled_gain = 0;
 	}
 
-	size_t ledbat_cwnd = (max_window + scaled_gain < MIN_WINDOW_SIZE) ? MIN_WINDOW_SIZE : (size_t)(max_window + scaled_gain);
+	size_t ledbat_cwnd = (conn->max_window + scaled_gain < MIN_WINDOW_SIZE) ? MIN_WINDOW_SIZE : (size_t)(conn->max_window + scaled_gain);
+
+	if (conn->slow_start) {
+		size_t ss_cwnd = (size_t)(conn->max_window + window_factor*conn->get_packet_size());
+		if (ss_cwnd > conn->ssthresh) {
+			conn->slow_start = false;
+		} else if (our_delay > target*0.9) {
+			// even if we're a little under the target delay, we conservatively
+			// discontinue the slow start phase
+			conn->slow_start = false;
+			conn->ssthresh = conn->max_window;
+		} else {
+			conn->max_window = max(ss_cwnd, ledbat_cwnd);
+		}
+	} else {
+		conn->max_window = ledbat_cwnd;
+	}
+}
+
+static void ledbat_on_loss(UTPSocket *conn)
+{
+	conn->maybe_decay_win(conn->ctx->current_ms);
+}
+
+static void ledbat_on_timeout(UTPSocket *conn)
+{
+	size_t packet_size = conn->get_packet_size();
+
+	if ((conn->cur_window_packets == 0) && (conn->max_window > packet_size)) {
+		// we don't have any packets in-flight, even though
+		// we could. This implies that the connection is just
+		// idling. No need to be aggressive about resetting the
+		// congestion window. Just let it decay by a 3:rd.
+		// don't set it any lower than the packet size though
+		conn->max_window = max(conn->max_window * 2 / 3, packet_size);
+	} else {
+		// our delay was so high that our congestion window
+		// was shrunk below one packet, preventing us from
+		// sending anything for one time-out period. Now, reset
+		// the congestion window to fit one packet, to start over
+		// again
+		conn->max_window = packet_size;
+		conn->slow_start = true;
+	}
+}
+
+// Both controllers keep their window in max_window
+static size_t max_window_cwnd(const UTPSocket *conn)
+{
+	return conn->max_window;
+}
+
+static const utp_ccontrol utp_ledbat = {
+	"ledbat",
+	NULL,
+	ledbat_on_ack,
+	NULL,
+	ledbat_on_loss,
+	ledbat_on_timeout,
+	max_window_cwnd,
+};
+
+// CUBIC (RFC 8312): after a loss, grow the window along a cubic curve that
+// flattens out around the window the loss happened at, and cut it by only
+// CUBIC_BETA.  It ignores delay and competes like TCP, which is what we want
+// on links we have to ourselves.  Slow start ends early on a rise in RTT
+// (the delay half of HyStart).
+static void cubic_init(UTPSocket *conn)
+{
+	conn->cubic_w_max = 0;
+	conn->cubic_w_est = 0;
+	conn->cubic_k = 0;
+	conn->cubic_epoch_start = 0;
+	conn->cubic_rtt_min = 0;
+}
+
+static void cubic_on_ack(UTPSocket *conn, size_t bytes_acked, int32 our_delay, int64 min_rtt)
+{
+	if (min_rtt > 0 && min_rtt != INT64_MAX
+		&& (conn->cubic_rtt_min == 0 || (uint64)min_rtt < conn->cubic_rtt_min))
+		conn->cubic_rtt_min = min_rtt;
+
+	// not cwnd-limited for a while (see ledbat_on_ack); don't grow
+	if (conn->ctx->current_ms - conn->last_maxed_out_window > 1000)
+		return;
+
+	const double mss = (double)conn->get_packet_size();
+
+	if (conn->slow_start) {
+		uint64 eta = clamp<uint64>(conn->cubic_rtt_min / 8, CUBIC_HYSTART_MIN, CUBIC_HYSTART_MAX);
+		if (conn->cubic_rtt_min && min_rtt != INT64_MAX
+			&& (uint64)min_rtt > conn->cubic_rtt_min + eta
+			&& conn->max_window >= 16 * mss) {
+			conn->slow_start = false;
+			conn->ssthresh = conn->max_window;
+		} else {
+			conn->max_window += bytes_acked;
+			if (conn->max_window >= conn->ssthresh)
+				conn->slow_start = false;
+			return;
+		}
+	}
+
+	const double cwnd = conn->max_window / mss;
+	const double acked = bytes_acked / mss;
+
+	if (conn->cubic_epoch_start == 0) {
+		conn->cubic_epoch_start = conn->ctx->current_ms;
+		if (cwnd < conn->cubic_w_max) {
+			conn->cubic_k = cbrt((conn->cubic_w_max - cwnd) / CUBIC_C);
+		} else {
+			conn->cubic_k = 0;
+			conn->cubic_w_max = cwnd;
+		}
+		conn->cubic_w_est = cwnd;
+	}
+
+	// where the curve will be one RTT from now
+	double t = (conn->ctx->current_ms - conn->cubic_epoch_start + conn->rtt) / 1000.;
+	double w_cubic = conn->cubic_w_max + CUBIC_C * (t - conn->cubic_k) * (t - conn->cubic_k) * (t - conn->cubic_k);
+
+	// never do worse than Reno would with the same decrease factor
+	conn->cubic_w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cwnd;
+	if (conn->cubic_w_est > w_cubic) {
+		conn->max_window = max(conn->max_window, (size_t)(conn->cubic_w_est * mss));
+		return;
+	}
+
+	double target = clamp(w_cubic, cwnd, 1.5 * cwnd);
+	double grow = (target > cwnd) ? (target - cwnd) / cwnd : 0.01 / cwnd;
+	conn->max_window += (size_t)(grow * acked * mss + 0.5);
+}
 
-	if (slow_start) {
-		size_t ss_cwnd = (size_t)(max_window + window_factor*get_packet_size());
-		if (ss_cwnd > ssthresh) {
-			slow_start = false;
-		} else if (our_delay > target*0.9) {
-			// even if we're a little under the target delay, we conservatively
-			// discontinue the slow start phase
-			slow_start = false;
-			ssthresh = max_window;
-		} else {
-			max_window = max(ss_cwnd, ledbat_cwnd);
-		}
-	} else {
-		max_window = ledbat_cwnd;
+static void cubic_on_loss(UTPSocket *conn)
+{
+	// one reduction per round trip
+	int64 now = conn->ctx->current_ms;
+	if (now - conn->last_rwin_decay < max<int64>(conn->rtt, MAX_WINDOW_DECAY))
+		return;
+	conn->last_rwin_decay = now;
+
+	const double mss = (double)conn->get_packet_size();
+	const double cwnd = conn->max_window / mss;
+
+	// fast convergence: if we lost before reaching the last maximum, another
+	// flow is probably taking bandwidth; give it some room
+	if (cwnd < conn->cubic_w_max)
+		conn->cubic_w_max = cwnd * (1 + CUBIC_BETA) / 2;
+	else
+		conn->cubic_w_max = cwnd;
+
+	conn->max_window = max<size_t>((size_t)(conn->max_window * CUBIC_BETA), MIN_WINDOW_SIZE);
+	conn->ssthresh = conn->max_window;
+	conn->slow_start = false;
+	conn->cubic_epoch_start = 0;
+}
+
+static void cubic_on_timeout(UTPSocket *conn)
+{
+	size_t packet_size = conn->get_packet_size();
+
+	// idle, not congested; decay as LEDBAT does
+	if ((conn->cur_window_packets == 0) && (conn->max_window > packet_size)) {
+		conn->max_window = max(conn->max_window * 2 / 3, packet_size);
+		return;
 	}
 
+	conn->cubic_w_max = conn->max_window / (double)packet_size;
+	conn->ssthresh = max<size_t>((size_t)(conn->max_window * CUBIC_BETA), 2 * packet_size);
+	conn->max_window = packet_size;
+	conn->slow_start = true;
+	conn->cubic_epoch_start = 0;
+}
 
-	// make sure that the congestion window is below max
-	// make sure that we don't shrink our window too small
-	max_window = clamp<size_t>(max_window, MIN_WINDOW_SIZE, opt_sndbuf);
+static const utp_ccontrol utp_cubic = {
+	"cubic",
+	cubic_init,
+	cubic_on_ack,
+	NULL,
+	cubic_on_loss,
+	cubic_on_timeout,
+	max_window_cwnd,
+};
 
-	// used in parse_log.py
-	log(UTP_LOG_NORMAL, "actual_delay:%u our_delay:%d their_delay:%u off_target:%d max_window:%u "
-			"delay_base:%u delay_sum:%d target_delay:%d acked_bytes:%u cur_window:%u "
-			"scaled_gain:%f rtt:%u rate:%u wnduser:%u rto:%u timeout:%d get_microseconds:" I64u " "
-			"cur_window_packets:%u packet_size:%u their_delay_base:%u their_actual_delay:%u "
-			"average_delay:%d clock_drift:%d clock_drift_raw:%d delay_penalty:%d current_delay_sum:" I64u
-			"current_delay_samples:%d average_delay_base:%d last_maxed_out_window:" I64u " opt_sndbuf:%d "
-			"current_ms:" I64u "",
-			actual_delay, our_delay / 1000, their_hist.get_value() / 1000,
-			int(off_target / 1000), uint(max_window), uint32(our_hist.delay_base),
-			int((our_delay + their_hist.get_value()) / 1000), int(target / 1000), uint(bytes_acked),
-			(uint)(cur_window - bytes_acked), (float)(scaled_gain), rtt,
-			(uint)(max_window * 1000 / (rtt_hist.delay_base?rtt_hist.delay_base:50)),
-			(uint)max_window_user, rto, (int)(rto_timeout - ctx->current_ms),
-			utp_call_get_microseconds(this->ctx, this), cur_window_packets, (uint)get_packet_size(),
-			their_hist.delay_base, their_hist.delay_base + their_hist.get_value(),
-			average_delay, clock_drift, clock_drift_raw, penalty / 1000,
-			current_delay_sum, current_delay_samples, average_delay_base,
-			uint64(last_maxed_out_window), int(opt_sndbuf), uint64(ctx->current_ms));
+// Indexed by UTP_CC_*
+static const utp_ccontrol *const utp_ccontrols[] = {
+	&utp_ledbat,
+	&utp_cubic,
+};
+
+static int utp_ccontrol_index(const utp_ccontrol *cc)
+{
+	for (size_t i = 0; i < sizeof(utp_ccontrols) / sizeof(utp_ccontrols[0]); i++)
+		if (utp_ccontrols[i] == cc)
+			return (int)i;
+	return -1;
 }
 
 static void utp_register_recv_packet(UTPSocket *conn, size_t len)
 {
-	#ifdef _DEBUG
 	++conn->_stats.nrecv;
 	conn->_stats.nbytes_recv += len;
-	#endif
 
 	if (len <= PACKET_SIZE_MID) {
 		if (len <= PACKET_SIZE_EMPTY) {
@@ -1769,7 +2563,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 {
 	utp_register_recv_packet(conn, len);
 
-	conn->ctx->current_ms = utp_call_get_milliseconds(conn->ctx, conn);
+	// ctx->current_ms has already been sampled by utp_process_udp(), or once
+	// for the whole batch by utp_process_udp_batch()
 
 	const PacketFormatV1 *pf1 = (PacketFormatV1*)packet;
 	const byte *packet_end = packet + len;
@@ -1787,7 +2582,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	#endif
 
 	// mark receipt time
-	uint64 time = utp_call_get_microseconds(conn->ctx, conn);
+	uint64 time = utp_call_get_precise_microseconds(conn->ctx, conn);
 
 	// window packets size is used to calculate a minimum
 	// permissible range for received acks. connections with acks falling
@@ -1888,8 +2683,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	const uint seqnr = (pk_seq_nr - conn->ack_nr - 1) & SEQ_NR_MASK;
 
 	// Getting an invalid sequence number?
-	if (seqnr >= REORDER_BUFFER_MAX_SIZE) {
-		if (seqnr >= (SEQ_NR_MASK + 1) - REORDER_BUFFER_MAX_SIZE && pk_flags != ST_STATE) {
+	if (seqnr >= conn->reorder_buffer_max()) {
+		if (seqnr >= (SEQ_NR_MASK + 1) - conn->reorder_buffer_max() && pk_flags != ST_STATE) {
 			conn->schedule_ack();
 		}
 
@@ -1929,6 +2724,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 				// It's likely that the probe was rejected due to its size, but we haven't got an
 				// ICMP report back yet
 				if (pk_ack_nr == ((conn->mtu_probe_seq - 1) & ACK_NR_MASK)) {
+					conn->trace(UTP_TRACE_MTU_PROBE, conn->mtu_probe_seq, conn->mtu_probe_size,
+						conn->mtu_floor, conn->mtu_ceiling, 2);
 					conn->mtu_ceiling = conn->mtu_probe_size - 1;
 					conn->mtu_search_update();
 					conn->log(UTP_LOG_MTU, "MTU [DUPACK] floor:%d ceiling:%d current:%d"
@@ -1959,7 +2756,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	// this is done in apply_ledbat_ccontrol()
 	int64 min_rtt = INT64_MAX;
 
-	uint64 now = utp_call_get_microseconds(conn->ctx, conn);
+	uint64 now = utp_call_get_precise_microseconds(conn->ctx, conn);
 
 	for (int i = 0; i < acks; ++i) {
 		int seq = (conn->seq_nr - conn->cur_window_packets + i) & ACK_NR_MASK;
@@ -1968,6 +2765,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 		assert((int)(pkt->payload) >= 0);
 		acked_bytes += pkt->payload;
 		if (conn->mtu_probe_seq && seq == conn->mtu_probe_seq) {
+			conn->trace(UTP_TRACE_MTU_PROBE, conn->mtu_probe_seq, conn->mtu_probe_size,
+				conn->mtu_floor, conn->mtu_ceiling, 1, now);
 			conn->mtu_floor = conn->mtu_probe_size;
 			conn->mtu_search_update();
 			conn->log(UTP_LOG_MTU, "MTU [ACK] floor:%d ceiling:%d current:%d"
@@ -2023,6 +2822,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	// we have a true measured sample
 	if (actual_delay != 0) {
 		conn->our_hist.add_sample(actual_delay, conn->ctx->current_ms);
+		if (conn->cc->on_delay_sample)
+			conn->cc->on_delay_sample(conn, actual_delay);
 
 		// this is keeping an average of the delay samples
 		// we've recevied within the last 5 seconds. We sum
@@ -2135,9 +2936,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	}
 
 	// only apply the congestion controller on acks
-	// if we don't have a delay measurement, there's
-	// no point in invoking the congestion control
-	if (actual_delay != 0 && acked_bytes >= 1)
+	if (acked_bytes >= 1)
 		conn->apply_ccontrol(acked_bytes, actual_delay, min_rtt);
 
 	// sanity check, the other end should never ack packets
@@ -2242,6 +3041,12 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 		// this invariant should always be true
 		assert(conn->cur_window_packets == 0 || conn->outbuf.get(conn->seq_nr - conn->cur_window_packets));
 
+		// the send queue drained, so nothing limits the socket any more.
+		// is_full() may not run again until the next write, and idle time
+		// must not count as cwnd/rwnd limited
+		if (conn->cur_window_packets == 0)
+			conn->set_limited_by(LIMITED_NONE);
+
 		// flush Nagle
 		if (conn->cur_window_packets == 1) {
 			OutgoingPacket *pkt = (OutgoingPacket*)conn->outbuf.get(conn->seq_nr - 1);
@@ -2272,9 +3077,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 					conn->log(UTP_LOG_DEBUG, "Packet %u fast timeout-retry.", conn->seq_nr - conn->cur_window_packets);
 					#endif
 
-					#ifdef _DEBUG
 					++conn->_stats.fastrexmit;
-					#endif
 
 					conn->fast_resend_seq_nr++;
 					conn->send_packet(pkt);
@@ -2285,6 +3088,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 
 	// Process selective acknowledgent
 	if (selack_ptr != NULL) {
+		++conn->_stats.neack_recv;
 		conn->selective_ack(pk_ack_nr + 2, selack_ptr, selack_ptr[-1]);
 	}
 
@@ -2387,19 +3191,21 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 
 			// Check if there are additional buffers in the reorder buffers
 			// that need delivery.
-			byte *p = (byte*)conn->inbuf.get(conn->ack_nr+1);
-			if (p == NULL)
+			ReorderEntry *e = (ReorderEntry*)conn->inbuf.get(conn->ack_nr+1);
+			if (e == NULL)
 				break;
 			conn->inbuf.put(conn->ack_nr+1, NULL);
-			count = *(uint*)p;
+			conn->ctx->histograms.record(UTP_HIST_REORDER_WAIT,
+				utp_call_get_microseconds(conn->ctx, conn) - e->time_received);
+			count = e->len;
 			if (count > 0 && conn->state != CS_FIN_SENT) {
 				// Pass the bytes to the upper layer
-				utp_call_on_read(conn->ctx, conn, p + sizeof(uint), count);
+				utp_call_on_read(conn->ctx, conn, e->data, count);
 			}
 			conn->ack_nr++;
 
 			// Free the element from the reorder buffer
-			free(p);
+			conn->ctx->pool.free(e);
 			assert(conn->reorder_count > 0);
 			conn->reorder_count--;
 		}
@@ -2425,7 +3231,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 		// if the sequence number is entirely off the expected
 		// one, just drop it. We can't allocate buffer space in
 		// the inbuf entirely based on untrusted input
-		if (seqnr > 0x3ff) {
+		if (seqnr >= conn->reorder_buffer_max()) {
 
 			#if UTP_DEBUG_LOGGING
 			conn->log(UTP_LOG_DEBUG, "0x%08x: Got an invalid packet sequence number, too far off "
@@ -2444,17 +3250,23 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 		// Has this packet already been received? (i.e. a duplicate)
 		// If that is the case, just discard it.
 		if (conn->inbuf.get(pk_seq_nr) != NULL) {
-			#ifdef _DEBUG
 			++conn->_stats.nduprecv;
-			#endif
 
 			return 0;
 		}
 
 		// Allocate memory to fit the packet that needs to re-ordered
-		byte *mem = (byte*)malloc((packet_end - data) + sizeof(uint));
-		*(uint*)mem = (uint)(packet_end - data);
-		memcpy(mem + sizeof(uint), data, packet_end - data);
+		ReorderEntry *mem = (ReorderEntry*)conn->ctx->pool.alloc(offsetof(ReorderEntry, data) + (packet_end - data));
+		if (!mem) {
+			// Drop it; it will be sent again
+			#if UTP_DEBUG_LOGGING
+			conn->log(UTP_LOG_DEBUG, "out of memory for out of order packet seq_nr:%u", pk_seq_nr);
+			#endif
+			return 0;
+		}
+		mem->time_received = utp_call_get_microseconds(conn->ctx, conn);
+		mem->len = packet_end - data;
+		memcpy(mem->data, data, packet_end - data);
 
 		// Insert into reorder buffer and increment the count
 		// of # of packets to be reordered.
@@ -2492,9 +3304,9 @@ UTPSocket::~UTPSocket()
 
 	utp_call_on_state_change(ctx, this, UTP_STATE_DESTROYING);
 
-	if (ctx->last_utp_socket == this) {
-		ctx->last_utp_socket = NULL;
-	}
+	removeSocketFromCache(this);
+
+	ctx->timers.cancel(&timer);
 
 	// Remove object from the global hash table
 	UTPSocketKeyData* kd = ctx->utp_sockets->Delete(UTPSocketKey(addr, conn_id_recv));
@@ -2502,13 +3314,14 @@ UTPSocket::~UTPSocket()
 
 	// remove the socket from ack_sockets if it was there also
 	removeSocketFromAckList(this);
+	removeSocketFromPaceList(this);
 
 	// Free all memory occupied by the socket object.
 	for (size_t i = 0; i <= inbuf.mask; i++) {
-		free(inbuf.elements[i]);
+		ctx->pool.free(inbuf.elements[i]);
 	}
 	for (size_t i = 0; i <= outbuf.mask; i++) {
-		free(outbuf.elements[i]);
+		utp_free_packet(ctx, (OutgoingPacket*)outbuf.elements[i]);
 	}
 	// TODO: The circular buffer should have a destructor
 	free(inbuf.elements);
@@ -2538,6 +3351,13 @@ void utp_initialize_socket(	utp_socket *conn,
 			conn_seed = utp_call_get_random(conn->ctx, conn);
 			// we identify v1 and higher by setting the first two bytes to 0x0001
 			conn_seed &= 0xffff;
+			// the peer's packets carry conn_seed, which must steer to our shard
+			if (conn->ctx->shard_count > 1) {
+				conn_seed -= conn_seed % conn->ctx->shard_count;
+				conn_seed += conn->ctx->shard_index;
+				if (conn_seed > 0xffff)
+					conn_seed -= conn->ctx->shard_count;
+			}
 		} while (conn->ctx->utp_sockets->Lookup(UTPSocketKey(psaddr, conn_seed)));
 
 		conn_id_recv += conn_seed;
@@ -2565,9 +3385,12 @@ void utp_initialize_socket(	utp_socket *conn,
 	conn->mtu_last = conn->mtu_ceiling;
 
 	conn->ctx->utp_sockets->Add(UTPSocketKey(conn->addr, conn->conn_id_recv))->socket = conn;
+	conn->timer.owner = conn;
 
 	// we need to fit one packet in the window when we start the connection
 	conn->max_window = conn->get_packet_size();
+	if (conn->cc->init)
+		conn->cc->init(conn);
 
 	#if UTP_DEBUG_LOGGING
 	conn->log(UTP_LOG_DEBUG, "UTP socket initialized");
@@ -2617,6 +3440,11 @@ utp_socket*	utp_create_socket(utp_context *ctx)
 	conn->opt_rcvbuf			= ctx->opt_rcvbuf;
 	conn->slow_start			= true;
 	conn->ssthresh				= conn->opt_sndbuf;
+	conn->cc					= utp_ccontrols[ctx->ccontrol];
+	conn->pacing				= ctx->pacing;
+	conn->large_window			= ctx->large_window;
+	conn->pace_next				= 0;
+	conn->unsent_bytes			= 0;
 	conn->clock_drift			= 0;
 	conn->clock_drift_raw		= 0;
 	conn->outbuf.mask			= 15;
@@ -2625,12 +3453,13 @@ utp_socket*	utp_create_socket(utp_context *ctx)
 	conn->inbuf.elements		= (void**)calloc(16, sizeof(void*));
 	conn->ida					= -1;	// set the index of every new socket in ack_sockets to
 										// -1, which also means it is not in ack_sockets yet
+	conn->idp					= -1;	// likewise for paced_sockets
 
 	memset(conn->extensions, 0, sizeof(conn->extensions));
 
-	#ifdef _DEBUG
-	memset(&conn->_stats, 0, sizeof(utp_socket_stats));
-	#endif
+	memset(&conn->_stats, 0, sizeof(conn->_stats));
+	conn->limited_by			= LIMITED_NONE;
+	conn->limited_since			= 0;
 
 	return conn;
 }
@@ -2666,6 +3495,56 @@ int utp_context_set_option(utp_context *ctx, int opt, int val)
 			assert(val >= 1);
 			ctx->opt_rcvbuf = val;
 			return 0;
+
+		case UTP_POOL_MAX_SLOTS:
+			assert(val >= 0);
+			ctx->pool.max_slots = val;
+			return 0;
+
+		case UTP_SHARD_INDEX:
+			assert(val >= 0);
+			ctx->shard_index = val;
+			return 0;
+
+		case UTP_SHARD_COUNT:
+			assert(val >= 1 && val <= 0x10000);
+			ctx->shard_count = val;
+			return 0;
+
+		case UTP_TRACE_SIZE:
+			assert(val >= 0);
+			return ctx->trace.resize(val) ? 0 : -1;
+
+		case UTP_CLOCK_MODE:
+			assert(val >= UTP_CLOCK_DIRECT && val <= UTP_CLOCK_HOST);
+			if (val < UTP_CLOCK_DIRECT || val > UTP_CLOCK_HOST) return -1;
+			ctx->clock_mode = val;
+			ctx->clock_us_valid = ctx->clock_ms_valid = false;
+			return 0;
+
+		case UTP_PRECISE_RTT:
+			ctx->clock_precise_rtt = (val != 0);
+			return 0;
+
+		case UTP_CCONTROL:
+			assert(val >= 0 && val < (int)(sizeof(utp_ccontrols) / sizeof(utp_ccontrols[0])));
+			if (val < 0 || val >= (int)(sizeof(utp_ccontrols) / sizeof(utp_ccontrols[0]))) return -1;
+			ctx->ccontrol = val;
+			return 0;
+
+		case UTP_PACING:
+			ctx->pacing = (val != 0);
+			return 0;
+
+		case UTP_PACING_QUANTUM:
+			assert(val >= 0);
+			if (val < 0) return -1;
+			ctx->pacing_quantum = val;
+			return 0;
+
+		case UTP_LARGE_WINDOW:
+			ctx->large_window = (val != 0);
+			return 0;
 	}
 	return -1;
 }
@@ -2682,6 +3561,16 @@ int utp_context_get_option(utp_context *ctx, int opt)
     	case UTP_TARGET_DELAY:	return ctx->target_delay;
 		case UTP_SNDBUF:		return ctx->opt_sndbuf;
 		case UTP_RCVBUF:		return ctx->opt_rcvbuf;
+		case UTP_POOL_MAX_SLOTS:	return ctx->pool.max_slots;
+		case UTP_SHARD_INDEX:	return ctx->shard_index;
+		case UTP_SHARD_COUNT:	return ctx->shard_count;
+		case UTP_TRACE_SIZE:	return (int)ctx->trace.size();
+		case UTP_CLOCK_MODE:	return ctx->clock_mode;
+		case UTP_PRECISE_RTT:	return ctx->clock_precise_rtt ? 1 : 0;
+		case UTP_CCONTROL:		return ctx->ccontrol;
+		case UTP_PACING:		return ctx->pacing ? 1 : 0;
+		case UTP_PACING_QUANTUM:	return (int)ctx->pacing_quantum;
+		case UTP_LARGE_WINDOW:	return ctx->large_window ? 1 : 0;
 	}
 	return -1;
 }
@@ -2707,6 +3596,18 @@ int utp_setsockopt(UTPSocket* conn, int opt, int val)
 	case UTP_TARGET_DELAY:
 		conn->target_delay = val;
 		return 0;
+
+	case UTP_CCONTROL:
+		assert(val >= 0 && val < (int)(sizeof(utp_ccontrols) / sizeof(utp_ccontrols[0])));
+		if (val < 0 || val >= (int)(sizeof(utp_ccontrols) / sizeof(utp_ccontrols[0]))) return -1;
+		conn->cc = utp_ccontrols[val];
+		if (conn->state != CS_UNINITIALIZED && conn->cc->init)
+			conn->cc->init(conn);
+		return 0;
+
+	case UTP_PACING:
+		conn->pacing = (val != 0);
+		return 0;
 	}
 
 	return -1;
@@ -2721,6 +3622,8 @@ int utp_getsockopt(UTPSocket* conn, int opt)
 		case UTP_SNDBUF:		return conn->opt_sndbuf;
 		case UTP_RCVBUF:		return conn->opt_rcvbuf;
 		case UTP_TARGET_DELAY:	return conn->target_delay;
+		case UTP_CCONTROL:		return utp_ccontrol_index(conn->cc);
+		case UTP_PACING:		return conn->pacing ? 1 : 0;
 	}
 
 	return -1;
@@ -2735,9 +3638,11 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 	assert(conn->state == CS_UNINITIALIZED);
 	if (conn->state != CS_UNINITIALIZED) {
 		conn->state = CS_DESTROY;
+		conn->schedule_timeout();
 		return -1;
 	}
 
+	conn->ctx->new_epoch();
 	utp_initialize_socket(conn, to, tolen, true, 0, 0, 1);
 
 	assert(conn->cur_window_packets == 0);
@@ -2749,7 +3654,6 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 
 	// Create and send a connect message
 
-	// used in parse_log.py
 	conn->log(UTP_LOG_NORMAL, "UTP_Connect conn_seed:%u packet_size:%u (B) "
 			"target_delay:%u (ms) delay_history:%u "
 			"delay_base_history:%u (minutes)",
@@ -2765,10 +3669,15 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 	//conn->seq_nr = 1;
 	conn->seq_nr = utp_call_get_random(conn->ctx, conn);
 
-	// Create the connect packet.
-	const size_t header_size = sizeof(PacketFormatV1);
+	// Create the connect packet, with the extension bits we set
+	const size_t header_size = sizeof(PacketFormatV1) + 2 + EXT_BITS_LEN;
 
-	OutgoingPacket *pkt = (OutgoingPacket*)malloc(sizeof(OutgoingPacket) - 1 + header_size);
+	OutgoingPacket *pkt = (OutgoingPacket*)conn->ctx->pool.alloc(sizeof(OutgoingPacket) - 1 + header_size);
+	if (!pkt) {
+		conn->state = CS_DESTROY;
+		conn->schedule_timeout();
+		return -1;
+	}
 	PacketFormatV1* p1 = (PacketFormatV1*)pkt->data;
 
 	memset(p1, 0, header_size);
@@ -2776,13 +3685,17 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 	// instead of conn_id_send.
 	p1->set_version(1);
 	p1->set_type(ST_SYN);
-	p1->ext = 0;
+	p1->ext = 2;
+	write_extension_bits(pkt->data + sizeof(PacketFormatV1), conn->large_window);
 	p1->connid = conn->conn_id_recv;
 	p1->windowsize = (uint32)conn->last_rcv_win;
 	p1->seq_nr = conn->seq_nr;
 	pkt->transmissions = 0;
 	pkt->length = header_size;
 	pkt->payload = 0;
+	pkt->time_first = utp_call_get_microseconds(conn->ctx, conn);
+	pkt->ref = NULL;
+	pkt->ref_payload = NULL;
 
 	/*
 	#if UTP_DEBUG_LOGGING
@@ -2805,20 +3718,11 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 	return 0;
 }
 
-// Returns 1 if the UDP payload was recognized as a UTP packet, or 0 if it was not
-int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen)
+// Processes a single datagram once the caller has decoded its source address
+// and sampled ctx->current_ms.  Shared by utp_process_udp() and
+// utp_process_udp_batch().
+static int utp_process_udp_packet(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen, const PackedSockAddr &addr)
 {
-	assert(ctx);
-	if (!ctx) return 0;
-
-	assert(buffer);
-	if (!buffer) return 0;
-
-	assert(to);
-	if (!to) return 0;
-
-	const PackedSockAddr addr((const SOCKADDR_STORAGE*)to, tolen);
-
 	if (len < sizeof(PacketFormatV1)) {
 		#if UTP_DEBUG_LOGGING
 		ctx->log(UTP_LOG_DEBUG, NULL, "recv %s len:%u too small", addrfmt(addr, addrbuf), (uint)len);
@@ -2866,6 +3770,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 				conn->state = CS_DESTROY;
 			else
 				conn->state = CS_RESET;
+			conn->schedule_timeout();
 
 			utp_call_on_overhead_statistics(conn->ctx, conn, false, len + conn->get_udp_overhead(), close_overhead);
 			const int err = (conn->state == CS_SYN_SENT) ? UTP_ECONNREFUSED : UTP_ECONNRESET;
@@ -2879,17 +3784,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		return 1;
 	}
 	else if (flags != ST_SYN) {
-		UTPSocket* conn = NULL;
-
-		if (ctx->last_utp_socket && ctx->last_utp_socket->addr == addr && ctx->last_utp_socket->conn_id_recv == id) {
-			conn = ctx->last_utp_socket;
-		} else {
-			UTPSocketKeyData* keyData = ctx->utp_sockets->Lookup(UTPSocketKey(addr, id));
-			if (keyData) {
-				conn = keyData->socket;
-				ctx->last_utp_socket = conn;
-			}
-		}
+		UTPSocket* conn = lookup_socket(ctx, addr, id);
 
 		if (conn) {
 
@@ -2898,6 +3793,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 			#endif
 
 			const size_t read = utp_process_incoming(conn, buffer, len);
+			conn->schedule_timeout();
 			utp_call_on_overhead_statistics(conn->ctx, conn, false, (len - read) + conn->get_udp_overhead(), header_overhead);
 			return 1;
 		}
@@ -2906,8 +3802,6 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 	// We have not found a matching utp_socket, and this isn't a SYN.  Reject it.
 	const uint32 seq_nr = pf1->seq_nr;
 	if (flags != ST_SYN) {
-		ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
-
 		for (size_t i = 0; i < ctx->rst_info.GetCount(); i++) {
 			if ((ctx->rst_info[i].connid == id)   &&
 				(ctx->rst_info[i].addr   == addr) &&
@@ -2995,6 +3889,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		#endif
 
 		conn->send_ack(true);
+		conn->schedule_timeout();
 
 		utp_call_on_accept(ctx, conn, to, tolen);
 
@@ -3013,6 +3908,76 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 	return 1;
 }
 
+// Returns 1 if the UDP payload was recognized as a UTP packet, or 0 if it was not
+int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	assert(ctx);
+	if (!ctx) return 0;
+
+	assert(buffer);
+	if (!buffer) return 0;
+
+	assert(to);
+	if (!to) return 0;
+
+	const PackedSockAddr addr((const SOCKADDR_STORAGE*)to, tolen);
+
+	ctx->new_epoch();
+	ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
+
+	return utp_process_udp_packet(ctx, buffer, len, to, tolen, addr);
+}
+
+// Processes an array of datagrams, typically filled by a single recvmmsg().
+// The clock is read once for the whole batch, the source address is only
+// re-packed when it differs from the previous datagram's, and deferred ACKs
+// are issued once at the end, so there is no need to call
+// utp_issue_deferred_acks() afterwards.
+//
+// Returns the number of datagrams that were recognized as UTP packets
+int utp_process_udp_batch(utp_context *ctx, const struct utp_udp_packet *packets, size_t count)
+{
+	assert(ctx);
+	if (!ctx) return 0;
+
+	assert(packets || !count);
+	if (!packets) return 0;
+
+	ctx->new_epoch();
+	ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
+
+	// acks in this batch may open the window of several sockets; collect
+	// what they send until the batch is done
+	bool run = utp_begin_send_run(ctx);
+
+	PackedSockAddr addr;
+	const struct sockaddr *last_to = NULL;
+	socklen_t last_tolen = 0;
+	int handled = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		const struct utp_udp_packet *p = &packets[i];
+
+		assert(p->buf && p->addr);
+		if (!p->buf || !p->addr) continue;
+
+		// consecutive datagrams from the same peer are the common case
+		// (one connection draining a burst), so only re-pack the address
+		// when it actually changes
+		if (!last_to || p->addrlen != last_tolen || memcmp(p->addr, last_to, p->addrlen) != 0) {
+			addr.set((const SOCKADDR_STORAGE*)p->addr, p->addrlen);
+		}
+		last_to = p->addr;
+		last_tolen = p->addrlen;
+
+		handled += utp_process_udp_packet(ctx, p->buf, p->len, p->addr, p->addrlen, addr);
+	}
+
+	utp_end_send_run(ctx, run);
+	utp_issue_deferred_acks(ctx);
+	return handled;
+}
+
 // Called by utp_process_icmp_fragmentation() and utp_process_icmp_error() below
 static UTPSocket* parse_icmp_payload(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen)
 {
@@ -3079,6 +4044,8 @@ int utp_process_icmp_fragmentation(utp_context *ctx, const byte* buffer, size_t
 	UTPSocket* conn = parse_icmp_payload(ctx, buffer, len, to, tolen);
 	if (!conn) return 0;
 
+	ctx->new_epoch();
+
 	// Constrain the next_hop_mtu to sane values.  It might not be initialized or sent properly
 	if (next_hop_mtu >= 576 && next_hop_mtu < 0x2000) {
 		conn->mtu_ceiling = min<uint32>(next_hop_mtu, conn->mtu_ceiling);
@@ -3117,6 +4084,8 @@ int utp_process_icmp_error(utp_context *ctx, const byte *buffer, size_t len, con
 	UTPSocket* conn = parse_icmp_payload(ctx, buffer, len, to, tolen);
 	if (!conn) return 0;
 
+	ctx->new_epoch();
+
 	const int err = (conn->state == CS_SYN_SENT) ? UTP_ECONNREFUSED : UTP_ECONNRESET;
 	const PackedSockAddr addr((const SOCKADDR_STORAGE*)to, tolen);
 
@@ -3142,35 +4111,17 @@ int utp_process_icmp_error(utp_context *ctx, const byte *buffer, size_t len, con
 			conn->state = CS_RESET;
 			break;
 	}
+	conn->schedule_timeout();
 
 	utp_call_on_error(conn->ctx, conn, err);
 	return 1;
 }
 
-// Write bytes to the UTP socket.  Returns the number of bytes written.
-// 0 indicates the socket is no longer writable, -1 indicates an error
-ssize_t utp_writev(utp_socket *conn, struct utp_iovec *iovec_input, size_t num_iovecs)
+// Shared by utp_writev() and utp_write_ref()
+static ssize_t utp_write_internal(utp_socket *conn, utp_iovec_cursor *data, utp_buf_ref *ref)
 {
-	static utp_iovec iovec[UTP_IOV_MAX];
-
-	assert(conn);
-	if (!conn) return -1;
-
-	assert(iovec_input);
-	if (!iovec_input) return -1;
-
-	assert(num_iovecs);
-	if (!num_iovecs) return -1;
-
-	if (num_iovecs > UTP_IOV_MAX)
-		num_iovecs = UTP_IOV_MAX;
-
-	memcpy(iovec, iovec_input, sizeof(struct utp_iovec)*num_iovecs);
-
-	size_t bytes = 0;
+	size_t bytes = data->remaining();
 	size_t sent = 0;
-	for (size_t i = 0; i < num_iovecs; i++)
-		bytes += iovec[i].iov_len;
 
 	#if UTP_DEBUG_LOGGING
 	size_t param = bytes;
@@ -3183,8 +4134,13 @@ ssize_t utp_writev(utp_socket *conn, struct utp_iovec *iovec_input, size_t num_i
 		return 0;
 	}
 
+	conn->ctx->new_epoch();
 	conn->ctx->current_ms = utp_call_get_milliseconds(conn->ctx, conn);
 
+	// every packet of this write goes through its own flush_packets(), so
+	// collect the run across the whole write
+	bool run = utp_begin_send_run(conn->ctx);
+
 	// don't send unless it will all fit in the window
 	size_t packet_size = conn->get_packet_size();
 	size_t num_to_send = min<size_t>(bytes, packet_size);
@@ -3203,13 +4159,23 @@ ssize_t utp_writev(utp_socket *conn, struct utp_iovec *iovec_input, size_t num_i
 			(uint)conn->last_rcv_win, num_to_send,
 			conn->cur_window_packets);
 		#endif
-		conn->write_outgoing_packet(num_to_send, ST_DATA, iovec, num_iovecs);
+		if (!conn->write_outgoing_packet(num_to_send, ST_DATA, data, ref)) {
+			// Out of memory.  Report what did get queued, or an error if
+			// nothing did; the rest is still the caller's to write again.
+			sent -= data->remaining() - bytes;
+			#if UTP_DEBUG_LOGGING
+			conn->log(UTP_LOG_DEBUG, "UTP_Write %u bytes = %u (out of memory)", (uint)param, (uint)sent);
+			#endif
+			utp_end_send_run(conn->ctx, run);
+			return sent ? (ssize_t)sent : -1;
+		}
 		num_to_send = min<size_t>(bytes, packet_size);
 
 		if (num_to_send == 0) {
 			#if UTP_DEBUG_LOGGING
 			conn->log(UTP_LOG_DEBUG, "UTP_Write %u bytes = true", (uint)param);
 			#endif
+			utp_end_send_run(conn->ctx, run);
 			return sent;
 		}
 	}
@@ -3227,6 +4193,64 @@ ssize_t utp_writev(utp_socket *conn, struct utp_iovec *iovec_input, size_t num_i
 	// returns whether or not the socket is still writable
 	// if the congestion window is not full, we can still write to it
 	//return !full;
+	utp_end_send_run(conn->ctx, run);
+	return sent;
+}
+
+// Write bytes to the UTP socket.  Returns the number of bytes written.
+// 0 indicates the socket is no longer writable, -1 indicates an error
+ssize_t utp_writev(utp_socket *conn, struct utp_iovec *iovec, size_t num_iovecs)
+{
+	assert(conn);
+	if (!conn) return -1;
+
+	assert(iovec);
+	if (!iovec) return -1;
+
+	assert(num_iovecs);
+	if (!num_iovecs) return -1;
+
+	if (num_iovecs > UTP_IOV_MAX)
+		num_iovecs = UTP_IOV_MAX;
+
+	utp_iovec_cursor data(iovec, num_iovecs);
+	return utp_write_internal(conn, &data, NULL);
+}
+
+// Like utp_write(), but the packets point into buf instead of copying it.
+// The first count bytes returned must stay untouched until release(cookie)
+// is called, which happens once every packet carrying part of them has been
+// acked, or the socket is destroyed.  If nothing is written, release is not
+// called and buf is not referenced.
+ssize_t utp_write_ref(utp_socket *conn, const void *buf, size_t count, utp_release_t *release, void *cookie)
+{
+	assert(conn);
+	if (!conn) return -1;
+
+	assert(buf && release);
+	if (!buf || !release) return -1;
+
+	assert(count);
+	if (!count) return -1;
+
+	// from malloc rather than the pool, whose slots are packet-sized
+	utp_buf_ref *ref = (utp_buf_ref*)malloc(sizeof(utp_buf_ref));
+	if (!ref) return -1;
+	ref->release = release;
+	ref->cookie = cookie;
+	ref->refs = 1;	// ours, so release() cannot run before we return
+
+	struct utp_iovec iovec = { (void*)buf, count };
+	utp_iovec_cursor data(&iovec, 1);
+	ssize_t sent = utp_write_internal(conn, &data, ref);
+
+	if (ref->refs == 1) {
+		// no packet took a slice
+		assert(sent == 0);
+		free(ref);
+		return sent;
+	}
+	utp_release_ref(conn->ctx, ref);
 	return sent;
 }
 
@@ -3238,6 +4262,8 @@ void utp_read_drained(utp_socket *conn)
 	assert(conn->state != CS_UNINITIALIZED);
 	if (conn->state == CS_UNINITIALIZED) return;
 
+	conn->ctx->new_epoch();
+
 	const size_t rcvwin = conn->get_rcv_window();
 
 	if (rcvwin > conn->last_rcv_win) {
@@ -3257,6 +4283,8 @@ void utp_issue_deferred_acks(utp_context *ctx)
 	assert(ctx);
 	if (!ctx) return;
 
+	ctx->new_epoch();
+
 	for (size_t i = 0; i < ctx->ack_sockets.GetCount(); i++) {
 		UTPSocket *conn = ctx->ack_sockets[i];
 		conn->send_ack();
@@ -3264,33 +4292,35 @@ void utp_issue_deferred_acks(utp_context *ctx)
 	}
 }
 
-// Should be called every 500ms
+// Should be called every 500ms, or whenever utp_next_timeout_ms() says so
 void utp_check_timeouts(utp_context *ctx)
 {
 	assert(ctx);
 	if (!ctx) return;
 
+	ctx->new_epoch();
 	ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
 
-	if (ctx->current_ms - ctx->last_check < TIMEOUT_CHECK_INTERVAL)
-		return;
-
-	ctx->last_check = ctx->current_ms;
+	if (ctx->current_ms - ctx->last_check >= TIMEOUT_CHECK_INTERVAL) {
+		ctx->last_check = ctx->current_ms;
 
-	for (size_t i = 0; i < ctx->rst_info.GetCount(); i++) {
-		if ((int)(ctx->current_ms - ctx->rst_info[i].timestamp) >= RST_INFO_TIMEOUT) {
-			ctx->rst_info.MoveUpLast(i);
-			i--;
+		for (size_t i = 0; i < ctx->rst_info.GetCount(); i++) {
+			if ((int)(ctx->current_ms - ctx->rst_info[i].timestamp) >= RST_INFO_TIMEOUT) {
+				ctx->rst_info.MoveUpLast(i);
+				i--;
+			}
+		}
+		if (ctx->rst_info.GetCount() != ctx->rst_info.GetAlloc()) {
+			ctx->rst_info.Compact();
 		}
-	}
-	if (ctx->rst_info.GetCount() != ctx->rst_info.GetAlloc()) {
-		ctx->rst_info.Compact();
 	}
 
-	utp_hash_iterator_t it;
-	UTPSocketKeyData* keyData;
-	while ((keyData = ctx->utp_sockets->Iterate(it))) {
-		UTPSocket *conn = keyData->socket;
+	// Only visit the sockets that have a deadline due
+	utp_timer_list due;
+	ctx->timers.advance(ctx->current_ms, &due);
+
+	while (utp_timer *t = due.pop()) {
+		UTPSocket *conn = (UTPSocket*)t->owner;
 		conn->check_timeouts();
 
 		// Check if the object was deleted
@@ -3299,10 +4329,104 @@ void utp_check_timeouts(utp_context *ctx)
 			conn->log(UTP_LOG_DEBUG, "Destroying");
 			#endif
 			delete conn;
+			continue;
 		}
+
+		conn->schedule_timeout(true);
+	}
+
+	utp_send_paced(ctx);
+}
+
+// Returns the number of milliseconds until utp_check_timeouts() next has
+// something to do, 0 if it already has, or -1 if no socket is waiting on
+// anything
+int utp_next_timeout_ms(utp_context *ctx)
+{
+	assert(ctx);
+	if (!ctx) return -1;
+
+	uint64 next = ctx->timers.next_expiry();
+
+	// round the pacer's deadline up, or the host would spin until it's due
+	int paced = utp_next_send_us(ctx);
+	if (paced >= 0 && next == (uint64)-1)
+		return (paced + 999) / 1000;
+	if (next == (uint64)-1)
+		return -1;
+
+	ctx->new_epoch();
+	uint64 now = utp_call_get_milliseconds(ctx, NULL);
+	int timeout = next <= now ? 0 : (int)min<uint64>(next - now, INT_MAX);
+	if (paced >= 0)
+		timeout = min(timeout, (paced + 999) / 1000);
+	return timeout;
+}
+
+// Sends whatever the pacer has held back that is now due; see UTP_PACING.
+// utp_check_timeouts() calls this too.
+void utp_send_paced(utp_context *ctx)
+{
+	assert(ctx);
+	if (!ctx) return;
+
+	if (ctx->paced_sockets.GetCount() == 0)
+		return;
+
+	ctx->new_epoch();
+	ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
+	const uint64 now = utp_call_get_microseconds(ctx, NULL);
+
+	// flush_packets() takes the socket off the list, and puts it back at the
+	// end if the pacer holds it back again, so walk the list from the end
+	for (size_t i = ctx->paced_sockets.GetCount(); i-- > 0;) {
+		UTPSocket *conn = ctx->paced_sockets[i];
+		if (conn->pace_next > now)
+			continue;
+		if (conn->state == CS_DESTROY)
+			removeSocketFromPaceList(conn);
+		else
+			conn->flush_packets();
 	}
 }
 
+// Returns the number of microseconds until utp_send_paced() next has
+// something to do, 0 if it already has, or -1 if the pacer is holding
+// nothing back
+int utp_next_send_us(utp_context *ctx)
+{
+	assert(ctx);
+	if (!ctx) return -1;
+
+	if (ctx->paced_sockets.GetCount() == 0)
+		return -1;
+
+	uint64 next = (uint64)-1;
+	for (size_t i = 0; i < ctx->paced_sockets.GetCount(); i++)
+		next = min(next, ctx->paced_sockets[i]->pace_next);
+
+	ctx->new_epoch();
+	uint64 now = utp_call_get_microseconds(ctx, NULL);
+	if (next <= now)
+		return 0;
+	return (int)min<uint64>(next - now, INT_MAX);
+}
+
+// With UTP_CLOCK_HOST, sets the time the library sees until the next call;
+// microseconds must come from the same clock as UTP_GET_MICROSECONDS
+void utp_set_time(utp_context *ctx, uint64 microseconds)
+{
+	assert(ctx);
+	if (!ctx) return;
+
+	assert(ctx->clock_mode == UTP_CLOCK_HOST);
+	if (ctx->clock_mode != UTP_CLOCK_HOST) return;
+
+	ctx->clock_us = microseconds;
+	ctx->clock_ms = microseconds / 1000;
+	ctx->clock_us_valid = ctx->clock_ms_valid = true;
+}
+
 int utp_getpeername(utp_socket *conn, struct sockaddr *addr, socklen_t *addrlen)
 {
 	assert(addr);
@@ -3360,11 +4484,18 @@ void utp_close(UTPSocket *conn)
 	conn->log(UTP_LOG_DEBUG, "UTP_Close in state:%s", statenames[conn->state]);
 	#endif
 
+	conn->ctx->new_epoch();
+
 	switch(conn->state) {
 	case CS_CONNECTED:
 	case CS_CONNECTED_FULL:
 		conn->state = CS_FIN_SENT;
-		conn->write_outgoing_packet(0, ST_FIN, NULL, 0);
+		if (!conn->write_outgoing_packet(0, ST_FIN, NULL)) {
+			// No memory for the FIN; drop the connection as if it had
+			// never got past the handshake
+			conn->rto_timeout = utp_call_get_milliseconds(conn->ctx, conn);
+			conn->state = CS_DESTROY_DELAY;
+		}
 		break;
 
 	case CS_SYN_SENT:
@@ -3379,6 +4510,8 @@ void utp_close(UTPSocket *conn)
 		conn->state = CS_DESTROY;
 		break;
 	}
+
+	conn->schedule_timeout();
 }
 
 utp_context* utp_get_context(utp_socket *socket) {
@@ -3430,14 +4563,114 @@ inline bool struct_utp_context::would_log(int level)
 	return true;
 }
 
+// The socket's counters, with the gauges and the window-limited time up to
+// now filled in
+static void utp_collect_socket_stats(UTPSocket *conn, utp_socket_stats_ex *st)
+{
+	*st = conn->_stats;
+	st->size = sizeof(*st);
+	st->nsockets = 1;
+	if (conn->limited_by == LIMITED_CWND)
+		st->cwnd_limited_ms += conn->ctx->current_ms - conn->limited_since;
+	else if (conn->limited_by == LIMITED_RWND)
+		st->rwnd_limited_ms += conn->ctx->current_ms - conn->limited_since;
+	st->mtu_guess = conn->mtu_last ? conn->mtu_last : conn->mtu_ceiling;
+	st->max_window_total = conn->max_window;
+	st->cur_window_total = conn->cur_window;
+	st->max_window = (uint32)min<uint64>(st->max_window_total, UINT_MAX);
+	st->cur_window = (uint32)min<uint64>(st->cur_window_total, UINT_MAX);
+	st->rtt = conn->rtt;
+	st->rtt_var = conn->rtt_var;
+	st->rto = conn->rto;
+}
+
+// Copy as much of src as the caller's struct has room for
+static int utp_copy_socket_stats(utp_socket_stats_ex *dst, const utp_socket_stats_ex *src)
+{
+	size_t n = min<size_t>(dst->size, sizeof(*src));
+	if (n < offsetof(utp_socket_stats_ex, nsockets) + sizeof(uint32))
+		return -1;
+	memcpy(dst, src, n);
+	dst->size = (uint32)n;
+	return 0;
+}
+
 utp_socket_stats* utp_get_stats(utp_socket *socket)
 {
-	#ifdef _DEBUG
-		assert(socket);
-		if (!socket) return NULL;
-		socket->_stats.mtu_guess = socket->mtu_last ? socket->mtu_last : socket->mtu_ceiling;
-		return &socket->_stats;
-	#else
-		return NULL;
-	#endif
+	assert(socket);
+	if (!socket) return NULL;
+
+	utp_socket_stats_ex st;
+	utp_collect_socket_stats(socket, &st);
+
+	utp_socket_stats *legacy = &socket->_legacy_stats;
+	legacy->nbytes_recv = st.nbytes_recv;
+	legacy->nbytes_xmit = st.nbytes_xmit;
+	legacy->rexmit = (uint32)st.rexmit;
+	legacy->fastrexmit = (uint32)st.fastrexmit;
+	legacy->nxmit = (uint32)st.nxmit;
+	legacy->nrecv = (uint32)st.nrecv;
+	legacy->nduprecv = (uint32)st.nduprecv;
+	legacy->mtu_guess = st.mtu_guess;
+	return legacy;
+}
+
+int utp_get_socket_stats(utp_socket *socket, utp_socket_stats_ex *stats)
+{
+	assert(socket && stats);
+	if (!socket || !stats) return -1;
+
+	utp_socket_stats_ex st;
+	utp_collect_socket_stats(socket, &st);
+	return utp_copy_socket_stats(stats, &st);
+}
+
+// Sum of every socket's statistics, see utp_socket_stats_ex
+int utp_get_context_socket_stats(utp_context *ctx, utp_socket_stats_ex *stats)
+{
+	assert(ctx && stats);
+	if (!ctx || !stats) return -1;
+
+	utp_socket_stats_ex sum;
+	memset(&sum, 0, sizeof(sum));
+	uint64 mtu = 0, rtt = 0, rtt_var = 0, rto = 0;
+
+	utp_hash_iterator_t it;
+	UTPSocketKeyData* keyData;
+	while ((keyData = ctx->utp_sockets->Iterate(it))) {
+		utp_socket_stats_ex st;
+		utp_collect_socket_stats(keyData->socket, &st);
+
+		sum.nsockets++;
+		sum.nbytes_recv += st.nbytes_recv;
+		sum.nbytes_xmit += st.nbytes_xmit;
+		sum.nrecv += st.nrecv;
+		sum.nxmit += st.nxmit;
+		sum.rexmit += st.rexmit;
+		sum.fastrexmit += st.fastrexmit;
+		sum.nduprecv += st.nduprecv;
+		sum.neack_sent += st.neack_sent;
+		sum.neack_recv += st.neack_recv;
+		sum.nrto += st.nrto;
+		sum.nmtu_probes += st.nmtu_probes;
+		sum.cwnd_limited_ms += st.cwnd_limited_ms;
+		sum.rwnd_limited_ms += st.rwnd_limited_ms;
+		sum.max_window_total += st.max_window_total;
+		sum.cur_window_total += st.cur_window_total;
+		mtu += st.mtu_guess;
+		rtt += st.rtt;
+		rtt_var += st.rtt_var;
+		rto += st.rto;
+	}
+
+	sum.max_window = (uint32)min<uint64>(sum.max_window_total, UINT_MAX);
+	sum.cur_window = (uint32)min<uint64>(sum.cur_window_total, UINT_MAX);
+	if (sum.nsockets) {
+		sum.mtu_guess = (uint32)(mtu / sum.nsockets);
+		sum.rtt = (uint32)(rtt / sum.nsockets);
+		sum.rtt_var = (uint32)(rtt_var / sum.nsockets);
+		sum.rto = (uint32)(rto / sum.nsockets);
+	}
+	sum.size = sizeof(sum);
+	return utp_copy_socket_stats(stats, &sum);
 }
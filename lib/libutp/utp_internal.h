@@ -32,7 +32,10 @@
 #include "utp_callbacks.h"
 #include "utp_templates.h"
 #include "utp_hash.h"
-#include "utp_hash.h"
+#include "utp_timer.h"
+#include "utp_pool.h"
+#include "utp_histogram.h"
+#include "utp_trace.h"
 #include "utp_packedsockaddr.h"
 
 /* These originally lived in utp_config.h */
@@ -96,14 +99,12 @@ struct UTPSocketKeyData {
 	utp_link_t link;
 };
 
-#define UTP_SOCKET_BUCKETS 79
 #define UTP_SOCKET_INIT    15
 
 struct UTPSocketHT : utpHashTable<UTPSocketKey, UTPSocketKeyData> {
 	UTPSocketHT() {
-		const int buckets = UTP_SOCKET_BUCKETS;
 		const int initial = UTP_SOCKET_INIT;
-		this->Create(buckets, initial);
+		this->Create(initial);
 	}
 	~UTPSocketHT() {
 		UTP_FreeAll(this);
@@ -111,21 +112,83 @@ struct UTPSocketHT : utpHashTable<UTPSocketKey, UTPSocketKeyData> {
 	}
 };
 
+// Incoming packets look for their socket in a small set-associative cache
+// before going to utp_sockets.  Each set keeps its sockets most recently
+// used first, with their receive IDs alongside so that a miss does not
+// touch the sockets themselves; a set fills one 64-byte cache line.
+#define UTP_SOCKET_CACHE_SETS	256
+#define UTP_SOCKET_CACHE_WAYS	4
+
+struct UTPSocketCacheEntry {
+	UTPSocket *socket;	// NULL if unused, and so are the entries after it
+	uint32 recv_id;
+};
+
 struct struct_utp_context {
 	void *userdata;
 	utp_callback_t* callbacks[UTP_ARRAY_SIZE];
 
 	uint64 current_ms;
 	utp_context_stats context_stats;
-	UTPSocket *last_utp_socket;
+	utp_histograms histograms;
+	utp_trace trace;
+	// aligned so that every set is one cache line, not two halves; new
+	// honors that from C++17 on
+	UTPSocketCacheEntry socket_cache[UTP_SOCKET_CACHE_SETS][UTP_SOCKET_CACHE_WAYS] ALIGNED_ATTRIBUTE(64);
 	Array<UTPSocket*> ack_sockets;
+	Array<UTPSocket*> paced_sockets;	// held back by the pacer, see utp_send_paced()
 	Array<RST_Info> rst_info;
 	UTPSocketHT *utp_sockets;
+	utp_timer_wheel timers;		// every socket's next deadline, see UTPSocket::next_timeout()
+	utp_pool pool;				// OutgoingPacket and reorder buffers; outlives utp_sockets
 	size_t target_delay;
+	int ccontrol;				// UTP_CCONTROL for new sockets
+	bool pacing;				// UTP_PACING for new sockets
+	uint32 pacing_quantum;		// UTP_PACING_QUANTUM, microseconds
+	bool large_window;			// UTP_LARGE_WINDOW for new sockets
 	size_t opt_sndbuf;
 	size_t opt_rcvbuf;
 	uint64 last_check;
 
+	// With UTP_SHARD_COUNT > 1, the context is one of several sharing a UDP
+	// port, and packets are steered between them by connection ID (see
+	// utp_io_attach_shard_filter()).  Outgoing connections pick IDs that
+	// steer back here.
+	uint32 shard_index;
+	uint32 shard_count;
+
+	// Full-size packets queued for one UTP_SENDTO_RUN call while a run is
+	// open; see utp_queue_send_run()
+	bool send_run_open;
+	PackedSockAddr send_run_addr;
+	byte *send_run_buf;
+	size_t send_run_seg_size;
+	size_t send_run_count;
+
+	// With UTP_CLOCK_MODE other than UTP_CLOCK_DIRECT, the clock callbacks
+	// are read at most once per epoch and the values kept here.  In
+	// UTP_CLOCK_CACHED, every call into the library starts a new epoch; in
+	// UTP_CLOCK_HOST, only utp_set_time() does.
+	int clock_mode;
+	bool clock_precise_rtt;		// see UTP_PRECISE_RTT
+	bool clock_us_valid;
+	bool clock_ms_valid;
+	uint64 clock_us;
+	uint64 clock_ms;
+
+	// Kept by the default clock callbacks (utp_utils.cpp) to make the system
+	// clock monotonic.  Per context rather than per thread or process, so a
+	// context sees the same clock whichever thread drives it and contexts
+	// on different threads share nothing.
+	uint64 sys_clock_offset;
+	uint64 sys_clock_previous;
+	int64 sys_clock_skew;		// QPC drift correction, Windows only
+
+	void new_epoch() {
+		if (clock_mode == UTP_CLOCK_CACHED)
+			clock_us_valid = clock_ms_valid = false;
+	}
+
 	struct_utp_context();
 	~struct_utp_context();
 
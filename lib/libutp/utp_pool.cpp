@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "utp_pool.h"
+
+// Every block, pooled or not, starts with one of these.  It is 16 bytes so
+// that what follows stays 16-byte aligned.
+struct utp_pool_block {
+	uint64 size;	// requested size
+	uint64 pooled;
+};
+
+#define BLOCK_HEADER sizeof(utp_pool_block)
+#define SLOT_CAPACITY (UTP_POOL_SLOT_SIZE - BLOCK_HEADER)
+
+static inline utp_pool_block *block_of(void *p)
+{
+	return (utp_pool_block*)p - 1;
+}
+
+utp_pool::utp_pool()
+	: max_slots(0)
+	, free_list(NULL)
+	, chunks(NULL)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+utp_pool::~utp_pool()
+{
+	while (chunks) {
+		void *next = *(void**)chunks;
+		::free(chunks);
+		chunks = next;
+	}
+}
+
+bool utp_pool::grow()
+{
+	size_t n = UTP_POOL_CHUNK_SLOTS;
+	if (max_slots) {
+		if (stats.nslots >= max_slots) return false;
+		if (n > max_slots - stats.nslots) n = max_slots - stats.nslots;
+	}
+
+	void *raw = ::malloc(sizeof(void*) + n * UTP_POOL_SLOT_SIZE + UTP_POOL_ALIGN - 1);
+	if (!raw) return false;
+	*(void**)raw = chunks;
+	chunks = raw;
+
+	byte *base = (byte*)(((size_t)raw + sizeof(void*) + UTP_POOL_ALIGN - 1) & ~(size_t)(UTP_POOL_ALIGN - 1));
+	// thread the new slots onto the free list, lowest address first
+	for (size_t i = n; i-- > 0;) {
+		free_slot *s = (free_slot*)(base + i * UTP_POOL_SLOT_SIZE);
+		s->next = free_list;
+		free_list = s;
+	}
+	stats.nslots += n;
+	stats.nchunks++;
+	return true;
+}
+
+void *utp_pool::alloc(size_t size)
+{
+	utp_pool_block *b;
+
+	if (size <= SLOT_CAPACITY && (free_list || grow())) {
+		b = (utp_pool_block*)free_list;
+		free_list = free_list->next;
+		b->pooled = 1;
+		stats.nalloc++;
+		stats.nslots_used++;
+	} else {
+		b = (utp_pool_block*)::malloc(BLOCK_HEADER + size);
+		if (!b) return NULL;
+		b->pooled = 0;
+		stats.nfallback++;
+	}
+	b->size = size;
+	return b + 1;
+}
+
+void *utp_pool::realloc(void *p, size_t size)
+{
+	if (!p) return alloc(size);
+
+	utp_pool_block *b = block_of(p);
+	if (b->pooled && size <= SLOT_CAPACITY) {
+		b->size = size;
+		return p;
+	}
+	if (!b->pooled) {
+		b = (utp_pool_block*)::realloc(b, BLOCK_HEADER + size);
+		if (!b) return NULL;
+		b->size = size;
+		return b + 1;
+	}
+
+	// outgrew its slot
+	void *q = alloc(size);
+	if (!q) return NULL;
+	memcpy(q, p, (size_t)b->size);
+	free(p);
+	return q;
+}
+
+void utp_pool::free(void *p)
+{
+	if (!p) return;
+
+	utp_pool_block *b = block_of(p);
+	if (!b->pooled) {
+		::free(b);
+		return;
+	}
+	free_slot *s = (free_slot*)b;
+	s->next = free_list;
+	free_list = s;
+	assert(stats.nslots_used > 0);
+	stats.nslots_used--;
+}
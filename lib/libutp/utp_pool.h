@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __UTP_POOL_H__
+#define __UTP_POOL_H__
+
+#include "utp.h"
+#include "utp_templates.h"
+
+// A per-context pool of fixed-size packet buffers.
+//
+// Outgoing packets and out-of-order receive buffers are all at most one
+// datagram plus a little bookkeeping, so instead of going to malloc for each
+// one they are carved out of cache-line aligned chunks of UTP_POOL_SLOT_SIZE
+// byte slots and recycled through a free list.  Requests that do not fit in
+// a slot (jumbo MTUs), or that would take the pool past its cap, fall back to
+// malloc; free() tells the two apart from a small header in front of every
+// block.
+//
+// Slots are never handed back to the system before the pool is destroyed.
+
+#define UTP_POOL_ALIGN			64
+#define UTP_POOL_SLOT_SIZE		1600	// a 1500 byte datagram plus OutgoingPacket and the block header
+#define UTP_POOL_CHUNK_SLOTS	64
+
+struct utp_pool {
+	utp_pool();
+	~utp_pool();
+
+	// Like malloc/realloc/free.  realloc of a pooled block that still fits
+	// in its slot returns the block unchanged.
+	void *alloc(size_t size);
+	void *realloc(void *p, size_t size);
+	void free(void *p);
+
+	// Most slots the pool may carve, or 0 for no limit
+	size_t max_slots;
+	utp_pool_stats stats;
+
+private:
+	struct free_slot { free_slot *next; };
+
+	bool grow();
+
+	free_slot *free_list;
+	void *chunks;			// as returned by malloc, each starting with the next
+
+	utp_pool(const utp_pool&);
+	utp_pool& operator=(const utp_pool&);
+};
+
+#endif //__UTP_POOL_H__
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "utp_timer.h"
+
+#define SLOT_MASK (UTP_TIMER_SLOTS - 1)
+
+// how far ahead the wheel reaches
+#define WHEEL_SPAN ((uint64)1 << (UTP_TIMER_LEVELS * UTP_TIMER_SLOT_BITS))
+
+static inline size_t slot_index(uint64 t, int level)
+{
+	return (size_t)(t >> (level * UTP_TIMER_SLOT_BITS)) & SLOT_MASK;
+}
+
+void utp_timer_wheel::place(utp_timer *t)
+{
+	// overdue timers fire on the next tick
+	uint64 expires = t->expires < base ? base : t->expires;
+	uint64 delta = expires - base;
+	int level = 0;
+
+	while (level < UTP_TIMER_LEVELS - 1 &&
+		   delta >= ((uint64)1 << ((level + 1) * UTP_TIMER_SLOT_BITS))) {
+		level++;
+	}
+
+	// out of range; park it in the furthest slot, and place it again when
+	// that slot is cascaded
+	if (delta >= WHEEL_SPAN)
+		expires = base + WHEEL_SPAN - 1;
+
+	slots[level][slot_index(expires, level)].push(t);
+	t->in_wheel = true;
+}
+
+void utp_timer_wheel::cascade(int level, size_t index)
+{
+	utp_timer_list &slot = slots[level][index];
+	utp_timer_list pending;
+
+	// move the slot aside first, since place() may put timers back into it
+	while (utp_timer *t = slot.pop())
+		pending.push(t);
+
+	while (utp_timer *t = pending.pop())
+		place(t);
+}
+
+void utp_timer_wheel::schedule(utp_timer *t, uint64 expires)
+{
+	cancel(t);
+	t->expires = expires;
+	place(t);
+	count++;
+}
+
+void utp_timer_wheel::cancel(utp_timer *t)
+{
+	if (t->in_wheel) {
+		t->in_wheel = false;
+		count--;
+	}
+	t->unlink();
+}
+
+void utp_timer_wheel::advance(uint64 now, utp_timer_list *due)
+{
+	if (now < base) {
+		// Only timers scheduled in the past since the last call can be
+		// due; place() put them in the slot for base
+		utp_timer_list &slot = slots[0][slot_index(base, 0)];
+		utp_timer *t = slot.head.next;
+		while (t != &slot.head) {
+			utp_timer *next = t->next;
+			if (t->expires <= now) {
+				cancel(t);
+				due->push(t);
+			}
+			t = next;
+		}
+		return;
+	}
+
+	if (count == 0) {
+		base = now + 1;
+		started = true;
+		return;
+	}
+
+	if (!started || now - base >= WHEEL_SPAN) {
+		// This is the first call, and timers scheduled before it were
+		// placed relative to a base of 0, or we have been away for longer
+		// than the wheel reaches.  Either way, walking the slots one
+		// millisecond at a time up to now would be wasted work; take every
+		// timer out and start over from now.
+		utp_timer_list all;
+		for (int level = 0; level < UTP_TIMER_LEVELS; level++) {
+			for (size_t i = 0; i < UTP_TIMER_SLOTS; i++) {
+				while (utp_timer *t = slots[level][i].pop())
+					all.push(t);
+			}
+		}
+
+		base = now + 1;
+		started = true;
+		while (utp_timer *t = all.pop()) {
+			if (t->expires <= now) {
+				t->in_wheel = false;
+				count--;
+				due->push(t);
+			} else {
+				place(t);
+			}
+		}
+		return;
+	}
+
+	while (base <= now) {
+		size_t index = slot_index(base, 0);
+
+		if (index == 0) {
+			size_t index1 = slot_index(base, 1);
+			if (index1 == 0)
+				cascade(2, slot_index(base, 2));
+			cascade(1, index1);
+		}
+
+		utp_timer_list &slot = slots[0][index];
+		while (utp_timer *t = slot.pop()) {
+			t->in_wheel = false;
+			count--;
+			due->push(t);
+		}
+
+		base++;
+
+		if (count == 0) {
+			base = now + 1;
+			break;
+		}
+	}
+}
+
+static uint64 earliest(const utp_timer_list &list)
+{
+	uint64 best = (uint64)-1;
+	for (const utp_timer *t = list.head.next; t != &list.head; t = t->next) {
+		if (t->expires < best)
+			best = t->expires;
+	}
+	return best;
+}
+
+uint64 utp_timer_wheel::next_expiry() const
+{
+	uint64 best = (uint64)-1;
+
+	if (count == 0)
+		return best;
+
+	// Level 0 slots are exact, so the first non-empty one from base on
+	// holds the earliest level 0 timer.  Higher levels are scanned in the
+	// order their slots will be cascaded, starting with the current slot if
+	// base sits on its boundary (it is cascaded when advance() reaches base)
+	// or the one after it otherwise.  The last level also holds the
+	// out-of-range timers parked by place(), so all of its slots are looked
+	// at.
+	for (int level = 0; level < UTP_TIMER_LEVELS; level++) {
+		uint64 below = ((uint64)1 << (level * UTP_TIMER_SLOT_BITS)) - 1;
+		size_t start = slot_index(base, level) + ((base & below) ? 1 : 0);
+		for (size_t i = 0; i < UTP_TIMER_SLOTS; i++) {
+			const utp_timer_list &slot = slots[level][(start + i) & SLOT_MASK];
+			if (!slot.empty()) {
+				uint64 t = earliest(slot);
+				if (t < best)
+					best = t;
+				if (level < UTP_TIMER_LEVELS - 1)
+					break;
+			}
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __UTP_TIMER_H__
+#define __UTP_TIMER_H__
+
+#include "utp_types.h"
+
+// A hierarchical timer wheel with millisecond resolution.
+//
+// Level 0 has one slot per millisecond for the next 256 ms, level 1 one slot
+// per 256 ms for the next ~65 s, and level 2 one slot per ~65 s for the next
+// ~4.6 hours.  Whenever level 0 wraps, the next level 1 slot is cascaded down
+// into it, and likewise for level 2.  Timers further out than level 2 reaches
+// sit in its last slot and are cascaded again until they come into range.
+//
+// Timers are intrusive: embed a utp_timer in the object and point owner back
+// at it.
+
+#define UTP_TIMER_LEVELS		3
+#define UTP_TIMER_SLOT_BITS		8
+#define UTP_TIMER_SLOTS			(1 << UTP_TIMER_SLOT_BITS)
+
+struct utp_timer {
+	utp_timer *next;
+	utp_timer *prev;
+	uint64 expires;
+	void *owner;
+	bool in_wheel;	// as opposed to on the list handed out by advance()
+
+	utp_timer() : next(NULL), prev(NULL), expires(0), owner(NULL), in_wheel(false) {}
+
+	// Is the timer in a wheel slot, or on the list handed out by advance()?
+	bool scheduled() const { return next != NULL; }
+
+	// Take the timer off whatever list it is on
+	void unlink() {
+		if (!next) return;
+		next->prev = prev;
+		prev->next = next;
+		next = prev = NULL;
+	}
+};
+
+// A circular list of timers, headed by a sentinel
+struct utp_timer_list {
+	utp_timer head;
+
+	utp_timer_list() { head.next = head.prev = &head; }
+
+	bool empty() const { return head.next == &head; }
+
+	void push(utp_timer *t) {
+		t->prev = head.prev;
+		t->next = &head;
+		head.prev->next = t;
+		head.prev = t;
+	}
+
+	utp_timer *pop() {
+		if (empty()) return NULL;
+		utp_timer *t = head.next;
+		t->unlink();
+		return t;
+	}
+
+private:
+	// the sentinel's address is part of the list
+	utp_timer_list(const utp_timer_list&);
+	utp_timer_list& operator=(const utp_timer_list&);
+};
+
+struct utp_timer_wheel {
+	utp_timer_list slots[UTP_TIMER_LEVELS][UTP_TIMER_SLOTS];
+	uint64 base;	// every slot before this millisecond has been processed
+	size_t count;
+	bool started;	// base has been set from a clock reading by advance()
+
+	utp_timer_wheel() : base(0), count(0), started(false) {}
+
+	// (Re)schedule t to fire at expires
+	void schedule(utp_timer *t, uint64 expires);
+	void cancel(utp_timer *t);
+
+	// Move every timer that expires at or before now onto due, in no
+	// particular order
+	void advance(uint64 now, utp_timer_list *due);
+
+	// Earliest expiry of any scheduled timer, or (uint64)-1 if there is none
+	uint64 next_expiry() const;
+
+private:
+	void place(utp_timer *t);
+	void cascade(int level, size_t index);
+};
+
+#endif //__UTP_TIMER_H__
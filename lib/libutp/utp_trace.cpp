@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utp_internal.h"
+
+// utp_trace_dump() file header; records follow in host byte order
+struct utp_trace_file_header {
+	char magic[8];			// "UTPTRACE"
+	uint32 version;			// 1
+	uint32 record_size;		// sizeof(utp_trace_record)
+};
+
+utp_trace::utp_trace()
+	: ring(NULL)
+	, mask(0)
+	, head(0)
+	, tail(0)
+{}
+
+utp_trace::~utp_trace()
+{
+	free(ring);
+}
+
+bool utp_trace::resize(size_t size)
+{
+	free(ring);
+	ring = NULL;
+	mask = 0;
+	head = tail = 0;
+
+	if (size == 0)
+		return true;
+
+	size_t n = 1;
+	while (n < size)
+		n <<= 1;
+
+	ring = (utp_trace_record*)malloc(n * sizeof(utp_trace_record));
+	if (!ring)
+		return false;
+	mask = n - 1;
+	return true;
+}
+
+size_t utp_trace::read(utp_trace_record *out, size_t count)
+{
+	size_t n = 0;
+
+	if (head - tail > mask + 1) {
+		// the writer lapped us; say how much went missing
+		if (count == 0)
+			return 0;
+		uint64 lost = head - tail - (mask + 1);
+		memset(&out[n], 0, sizeof(out[n]));
+		out[n].time = ring[(head - mask - 1) & mask].time;
+		out[n].event = UTP_TRACE_OVERRUN;
+		out[n].arg[0] = (uint32)min<uint64>(lost, 0xffffffff);
+		n++;
+		tail = head - mask - 1;
+	}
+
+	while (n < count && tail != head)
+		out[n++] = ring[tail++ & mask];
+
+	return n;
+}
+
+extern "C" {
+
+// Moves up to count of the oldest records out of the ring
+size_t utp_trace_read(utp_context *ctx, utp_trace_record *out, size_t count)
+{
+	assert(ctx);
+	if (!ctx || !ctx->trace.enabled()) return 0;
+	return ctx->trace.read(out, count);
+}
+
+// Drains the ring onto the end of the file at path, starting the file with
+// a header if it is empty.  Returns the number of records written, or -1.
+ssize_t utp_trace_dump(utp_context *ctx, const char *path)
+{
+	assert(ctx && path);
+	if (!ctx || !path) return -1;
+
+	FILE *f = fopen(path, "ab");
+	if (!f) return -1;
+
+	fseek(f, 0, SEEK_END);
+	if (ftell(f) == 0) {
+		utp_trace_file_header hdr;
+		memcpy(hdr.magic, "UTPTRACE", 8);
+		hdr.version = 1;
+		hdr.record_size = sizeof(utp_trace_record);
+		if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+			fclose(f);
+			return -1;
+		}
+	}
+
+	utp_trace_record buf[256];
+	ssize_t total = 0;
+	size_t n;
+	while ((n = utp_trace_read(ctx, buf, sizeof(buf) / sizeof(buf[0]))) > 0) {
+		if (fwrite(buf, sizeof(buf[0]), n, f) != n) {
+			fclose(f);
+			return -1;
+		}
+		total += n;
+	}
+
+	if (fclose(f) != 0)
+		return -1;
+	return total;
+}
+
+}
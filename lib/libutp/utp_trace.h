@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015-2017 Nicolas Ojeda Bar <n.oje.bar@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __UTP_TRACE_H__
+#define __UTP_TRACE_H__
+
+#include "utp.h"
+
+// The trace ring of one context (see UTP_TRACE_SIZE).
+//
+// Records are written in place into a power-of-two array and the ring
+// overwrites its oldest records when the reader falls behind, so tracing
+// never allocates or blocks once it is on.  Both sides run on the thread
+// driving the context.
+
+struct utp_trace {
+	utp_trace_record *ring;
+	size_t mask;
+	uint64 head;	// records ever written
+	uint64 tail;	// records ever read or overwritten
+
+	utp_trace();
+	~utp_trace();
+
+	bool enabled() const { return ring != NULL; }
+	size_t size() const { return ring ? mask + 1 : 0; }
+
+	// size is rounded up to a power of two; 0 turns tracing off
+	bool resize(size_t size);
+
+	void record(uint64 time, uint16 conn_id, uint16 seq_nr, uint32 event,
+				uint32 a0, uint32 a1, uint32 a2, uint32 a3) {
+		utp_trace_record *r = &ring[head++ & mask];
+		r->time = time;
+		r->conn_id = conn_id;
+		r->seq_nr = seq_nr;
+		r->event = event;
+		r->arg[0] = a0;
+		r->arg[1] = a1;
+		r->arg[2] = a2;
+		r->arg[3] = a3;
+	}
+
+	size_t read(utp_trace_record *out, size_t count);
+};
+
+#endif //__UTP_TRACE_H__
@@ -40,6 +40,12 @@
 	#define ALIGNED_ATTRIBUTE(x)
 #endif
 
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 // hash.cpp needs socket definitions, which is why this networking specific
 // code is inclued in utypes.h
 #ifdef WIN32
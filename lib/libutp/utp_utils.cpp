@@ -37,9 +37,11 @@
 
 #if defined(__APPLE__)
 	#include <mach/mach_time.h>
+	#include <pthread.h>
 #endif
 
 #include "utp_utils.h"
+#include "utp_internal.h"
 
 #ifdef WIN32
 
@@ -47,10 +49,14 @@ typedef ULONGLONG (WINAPI GetTickCount64Proc)(void);
 static GetTickCount64Proc *pt2GetTickCount64;
 static GetTickCount64Proc *pt2RealGetTickCount;
 
+// Set once by Time_Initialize() and shared by every thread; the drift
+// correction is kept per context, in sys_clock_skew
 static uint64 startPerformanceCounter;
 static uint64 startGetTickCount;
 // MSVC 6 standard doesn't like division with uint64s
 static double counterPerMicrosecond;
+// 0 before Time_Initialize(), 1 while it runs, 2 after
+static volatile LONG time_init = 0;
 
 static uint64 UTGetTickCount64()
 {
@@ -81,12 +87,19 @@ static void Time_Initialize()
 
 static int64 abs64(int64 x) { return x < 0 ? -x : x; }
 
-static uint64 __GetMicroseconds()
+static uint64 __GetMicroseconds(utp_context *ctx)
 {
-	static bool time_init = false;
-	if (!time_init) {
-		time_init = true;
-		Time_Initialize();
+	int64 &counterSkew = ctx->sys_clock_skew;
+
+	if (time_init != 2) {
+		if (InterlockedCompareExchange(&time_init, 1, 0) == 0) {
+			Time_Initialize();
+			InterlockedExchange(&time_init, 2);
+		} else {
+			// another thread got there first
+			while (time_init != 2)
+				Sleep(0);
+		}
 	}
 
 	uint64 counter;
@@ -97,46 +110,50 @@ static uint64 __GetMicroseconds()
 
 	// unfortunately, QueryPerformanceCounter is not guaranteed
 	// to be monotonic. Make it so.
-	int64 ret = (int64)(((int64)counter - (int64)startPerformanceCounter) / counterPerMicrosecond);
+	int64 ret = (int64)(((int64)counter - (int64)startPerformanceCounter - counterSkew) / counterPerMicrosecond);
 	// if the QPC clock leaps more than one second off GetTickCount64()
 	// something is seriously fishy. Adjust QPC to stay monotonic
 	int64 tick_diff = tick - startGetTickCount;
 	if (abs64(ret / 100000 - tick_diff / 100) > 10) {
-		startPerformanceCounter -= (uint64)((int64)(tick_diff * 1000 - ret) * counterPerMicrosecond);
-		ret = (int64)((counter - startPerformanceCounter) / counterPerMicrosecond);
+		counterSkew -= (int64)((tick_diff * 1000 - ret) * counterPerMicrosecond);
+		ret = (int64)(((int64)counter - (int64)startPerformanceCounter - counterSkew) / counterPerMicrosecond);
 	}
 	return ret;
 }
 
-static inline uint64 UTP_GetMilliseconds()
+static inline uint64 UTP_GetMilliseconds(utp_context *ctx)
 {
 	return GetTickCount();
 }
 
 #else //!WIN32
 
-static inline uint64 UTP_GetMicroseconds(void);
-static inline uint64 UTP_GetMilliseconds()
+static inline uint64 UTP_GetMicroseconds(utp_context *ctx);
+static inline uint64 UTP_GetMilliseconds(utp_context *ctx)
 {
-	return UTP_GetMicroseconds() / 1000;
+	return UTP_GetMicroseconds(ctx) / 1000;
 }
 
 #if defined(__APPLE__)
 
-static uint64 __GetMicroseconds()
+// http://developer.apple.com/mac/library/qa/qa2004/qa1398.html
+// http://www.macresearch.org/tutorial_performance_and_time
+static mach_timebase_info_data_t sTimebaseInfo;
+static uint64_t start_tick = 0;
+static pthread_once_t time_once = PTHREAD_ONCE_INIT;
+
+static void Time_Initialize()
 {
-	// http://developer.apple.com/mac/library/qa/qa2004/qa1398.html
-	// http://www.macresearch.org/tutorial_performance_and_time
-	static mach_timebase_info_data_t sTimebaseInfo;
-	static uint64_t start_tick = 0;
-	uint64_t tick;
+	// Get the timer ratio to convert mach_absolute_time to nanoseconds
+	mach_timebase_info(&sTimebaseInfo);
+	start_tick = mach_absolute_time();
+}
+
+static uint64 __GetMicroseconds(utp_context *ctx)
+{
+	pthread_once(&time_once, Time_Initialize);
 	// Returns a counter in some fraction of a nanoseconds
-	tick = mach_absolute_time();
-	if (sTimebaseInfo.denom == 0) {
-		// Get the timer ratio to convert mach_absolute_time to nanoseconds
-		mach_timebase_info(&sTimebaseInfo);
-		start_tick = tick;
-	}
+	uint64_t tick = mach_absolute_time();
 	// Calculate the elapsed time, convert it to microseconds and return it.
 	return ((tick - start_tick) * sTimebaseInfo.numer) / (sTimebaseInfo.denom * 1000);
 }
@@ -151,12 +168,12 @@ static uint64 __GetMicroseconds()
    POSIX clocks work -- we could be running a recent libc with an ancient
    kernel (think OpenWRT). -- jch */
 
-static uint64_t __GetMicroseconds()
+static uint64_t __GetMicroseconds(utp_context *ctx)
 {
 	struct timeval tv;
 
 	#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
-		static int have_posix_clocks = -1;
+		static THREAD_LOCAL int have_posix_clocks = -1;
 		int rc;
 
 		if (have_posix_clocks < 0) {
@@ -194,11 +211,12 @@ static uint64_t __GetMicroseconds()
  * time is likely to happen, this protects all versions.
  */
 
-static inline uint64 UTP_GetMicroseconds()
+static inline uint64 UTP_GetMicroseconds(utp_context *ctx)
 {
-	static uint64 offset = 0, previous = 0;
+	uint64 &offset = ctx->sys_clock_offset;
+	uint64 &previous = ctx->sys_clock_previous;
 
-	uint64 now = __GetMicroseconds() + offset;
+	uint64 now = __GetMicroseconds(ctx) + offset;
 	if (previous > now) {
 		/* Eek! */
 		offset += previous - now;
@@ -246,9 +264,9 @@ uint64 utp_default_get_random(utp_callback_arguments *args) {
 }
 
 uint64 utp_default_get_milliseconds(utp_callback_arguments *args) {
-	return UTP_GetMilliseconds();
+	return UTP_GetMilliseconds(args->context);
 }
 
 uint64 utp_default_get_microseconds(utp_callback_arguments *args) {
-	return UTP_GetMicroseconds();
+	return UTP_GetMicroseconds(args->context);
 }
@@ -31,7 +31,10 @@ type error =
   | ECONNRESET
   | ETIMEDOUT
 
-external init: unit -> context = "stub_utp_init"
+external init: Unix.file_descr -> context = "stub_utp_init"
+external init_threaded: Unix.file_descr -> context = "stub_utp_init_threaded"
+external notify_fd: context -> Unix.file_descr = "stub_utp_notify_fd"
+external drain: context -> unit = "stub_utp_drain"
 external set_debug: context -> bool -> unit = "stub_utp_set_debug"
 external create_socket: context -> socket = "stub_utp_create_socket"
 external write: socket -> buffer -> int -> int -> int = "stub_utp_write"
@@ -40,5 +43,13 @@ external close: socket -> unit = "stub_utp_close"
 external process_udp: context -> Unix.sockaddr -> buffer -> int -> int -> bool = "stub_utp_process_udp"
 external issue_deferred_acks: context -> unit = "stub_utp_issue_deferred_acks"
 external check_timeouts: context -> unit = "stub_utp_check_timeouts"
+external next_timeout_ms: context -> int = "stub_utp_next_timeout_ms"
+external set_read_buffer: socket -> buffer -> unit = "stub_utp_set_read_buffer"
+external read_offset: socket -> int = "stub_utp_read_offset"
+external read_available: socket -> int = "stub_utp_read_available"
+external consume: socket -> int -> unit = "stub_utp_consume"
+external read_drained: socket -> int -> unit = "stub_utp_read_drained"
+external flush: context -> unit = "stub_utp_flush"
+external send_dropped: context -> int = "stub_utp_send_dropped"
 external get_context: socket -> context = "stub_utp_get_context"
 external destroy: context -> unit = "stub_utp_destroy"
@@ -36,7 +36,10 @@ type error =
   | ECONNRESET
   | ETIMEDOUT
 
-val init: unit -> context
+val init: Unix.file_descr -> context
+val init_threaded: Unix.file_descr -> context
+val notify_fd: context -> Unix.file_descr
+val drain: context -> unit
 val set_debug: context -> bool -> unit
 val create_socket: context -> socket
 val connect: socket -> Unix.sockaddr -> unit
@@ -44,6 +47,14 @@ val write: socket -> buffer -> int -> int -> int
 val close: socket -> unit
 val process_udp: context -> Unix.sockaddr -> buffer -> int -> int -> bool
 val check_timeouts: context -> unit
+val next_timeout_ms: context -> int
 val issue_deferred_acks: context -> unit
+val set_read_buffer: socket -> buffer -> unit
+val read_offset: socket -> int
+val read_available: socket -> int
+val consume: socket -> int -> unit
+val read_drained: socket -> int -> unit
+val flush: context -> unit
+val send_dropped: context -> int
 val get_context: socket -> context
 val destroy: context -> unit
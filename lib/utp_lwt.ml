@@ -49,6 +49,7 @@ type socket =
     id: Utp.socket;
     buffers: bytes Lwt_sequence.t;
     readers: bytes Lwt.u Lwt_sequence.t;
+    readable: unit Lwt_condition.t;
     writable: unit Lwt_condition.t;
     state_changed: unit Lwt_condition.t;
     write_mutex: Lwt_mutex.t;
@@ -61,7 +62,6 @@ type context =
     id: Utp.context;
     fd: Lwt_unix.file_descr;
     accept: (Unix.sockaddr * socket) Lwt_condition.t;
-    send_mutex: Lwt_mutex.t;
     loop: unit Lwt.t;
     mutable sockets: int;
     mutable destroyed: bool;
@@ -93,22 +93,44 @@ let read_loop stopper fd id =
 
 let periodic_loop stopper id =
   let rec loop () =
-    Lwt.pick [stopper >>= (fun () -> Lwt.fail Exit); Lwt_unix.sleep 0.5] >>= fun () ->
+    let timeout =
+      match Utp.next_timeout_ms id with
+      | -1 -> 0.5
+      | ms -> min 0.5 (float ms /. 1000.)
+    in
+    Lwt.pick [stopper >>= (fun () -> Lwt.fail Exit); Lwt_unix.sleep timeout] >>= fun () ->
     Utp.check_timeouts id;
     loop ()
   in
   safe "periodic_loop" loop Lwt.return_unit
 
+(* A threaded context runs libutp on its own native thread and only needs us
+   to run the callbacks it queued up; see [stub_utp_drain]. *)
+let event_loop stopper id =
+  let fd = Lwt_unix.of_unix_file_descr ~blocking:false ~set_flags:false (Utp.notify_fd id) in
+  let rec loop () =
+    Lwt.pick [stopper >>= (fun () -> Lwt.fail Exit); Lwt_unix.wait_read fd] >>= fun () ->
+    Utp.drain id;
+    if Hashtbl.mem contexts id then loop () else Lwt.return_unit
+  in
+  safe "event_loop" loop Lwt.return_unit
+
 let on_read id buf =
   really_debug "on_read";
   let sock = Hashtbl.find sockets id in
   let buf = Lwt_bytes.to_bytes buf in
   match Lwt_sequence.take_l sock.readers with
   | w ->
+      Utp.read_drained id (Bytes.length buf);
       Lwt.wakeup w buf
   | exception Lwt_sequence.Empty ->
       ignore (Lwt_sequence.add_r buf sock.buffers)
 
+let on_readable id =
+  really_debug "on_readable";
+  let sock = Hashtbl.find sockets id in
+  Lwt_condition.broadcast sock.readable ()
+
 let on_writable id =
   really_debug "on_writable";
   let sock = Hashtbl.find sockets id in
@@ -123,13 +145,15 @@ let on_connect id =
 let cancel_readers sock exn =
   let readers = Lwt_sequence.fold_l (fun x l -> x :: l) sock.readers [] in
   List.iter (fun w -> Lwt.wakeup_exn w exn) readers;
-  Lwt_sequence.iter_node_l Lwt_sequence.remove sock.readers
+  Lwt_sequence.iter_node_l Lwt_sequence.remove sock.readers;
+  Lwt_condition.broadcast sock.readable ()
 
 let on_close id =
   debug "on_close";
   let sock = Hashtbl.find sockets id in
   sock.state <- Closed;
   cancel_readers sock End_of_file;
+  Lwt_condition.broadcast sock.writable ();
   Lwt_condition.broadcast sock.state_changed ();
   Hashtbl.remove sockets id;
   let cid = Utp.get_context id in
@@ -151,6 +175,7 @@ let on_eof id =
 let create_socket id state =
   let buffers = Lwt_sequence.create () in
   let readers = Lwt_sequence.create () in
+  let readable = Lwt_condition.create () in
   let writable = Lwt_condition.create () in
   let state_changed = Lwt_condition.create () in
   let write_mutex = Lwt_mutex.create () in
@@ -159,6 +184,7 @@ let create_socket id state =
     id;
     buffers;
     readers;
+    readable;
     writable;
     state_changed;
     write_mutex;
@@ -174,28 +200,15 @@ let on_accept id sid addr =
   ctx.sockets <- ctx.sockets + 1;
   Lwt_condition.signal ctx.accept (addr, sock)
 
-external stub_sendto : Unix.file_descr -> Utp.buffer -> int -> int -> Unix.msg_flag list -> Unix.sockaddr -> int = "lwt_unix_bytes_sendto_byte" "lwt_unix_bytes_sendto"
-
-let total_queued = ref 0
-
-let on_sendto id addr buf =
-  really_debug "on_sendto";
+let on_send_blocked id =
+  really_debug "on_send_blocked";
   let ctx = Hashtbl.find contexts id in
-  if Lwt_unix.writable ctx.fd then
-    ignore (stub_sendto (Lwt_unix.unix_file_descr ctx.fd) buf 0 (Lwt_bytes.length buf) [] addr)
-  else begin
-    total_queued := !total_queued + (Lwt_bytes.length buf);
-    debug "queueing buffer: %d" !total_queued;
-    let buf = Lwt_bytes.to_bytes buf in
-    let _ =
-      Lwt_mutex.with_lock ctx.send_mutex (fun () ->
-          Lwt_unix.sendto ctx.fd buf 0 (Bytes.length buf) [] addr >>= fun _ ->
-          total_queued := !total_queued - (Bytes.length buf);
-          Lwt.return_unit
-        )
-    in
-    ()
-  end
+  let flush () =
+    Lwt_unix.wait_write ctx.fd >>= fun () ->
+    if Hashtbl.mem contexts id then Utp.flush id;
+    Lwt.return_unit
+  in
+  ignore (safe "on_send_blocked" flush Lwt.return_unit)
 
 let on_error id error =
   debug "on_error";
@@ -209,23 +222,28 @@ let on_error id error =
   let exn = Failure err in
   sock.state <- Error;
   cancel_readers sock exn;
+  Lwt_condition.broadcast_exn sock.writable exn;
   Lwt_condition.broadcast sock.state_changed ()
-(* Lwt_condition.broadcast_exn sock.writable exn *)
 
-let init addr =
-  let fd = Lwt_unix.socket Unix.PF_INET Unix.SOCK_DGRAM 0 in
+let init ?(threaded = false) addr =
+  let domain = Unix.domain_of_sockaddr addr in
+  let fd = Lwt_unix.socket domain Unix.SOCK_DGRAM 0 in
+  if domain = Unix.PF_INET6 then Lwt_unix.setsockopt fd Unix.IPV6_ONLY false;
   Lwt_unix.bind fd addr >>= fun () ->
-  let send_mutex = Lwt_mutex.create () in
   let accept = Lwt_condition.create () in
-  let id = Utp.init () in
+  let id = (if threaded then Utp.init_threaded else Utp.init) (Lwt_unix.unix_file_descr fd) in
   let starter, start = Lwt.wait () in
   let stopper, stop = Lwt.wait () in
   let stopper = stopper >>= fun () -> debug "stopping"; Lwt.return_unit in
   let loop =
     let safe_close () = safe "loop" (fun () -> Lwt_unix.close fd) Lwt.return_unit in
-    starter >>= fun () -> Lwt.join [read_loop stopper fd id; periodic_loop stopper id] >>= safe_close
+    let loops =
+      if threaded then [event_loop stopper id]
+      else [read_loop stopper fd id; periodic_loop stopper id]
+    in
+    starter >>= fun () -> Lwt.join loops >>= safe_close
   in
-  let ctx = {id; fd; accept; send_mutex; loop; sockets = 0; destroyed = false; stop} in
+  let ctx = {id; fd; accept; loop; sockets = 0; destroyed = false; stop} in
   Hashtbl.add contexts id ctx;
   Lwt.wakeup start ();
   Lwt.return ctx
@@ -270,10 +288,19 @@ let close (sock : socket) =
 let accept ctx =
   Lwt_condition.wait ctx.accept
 
+(* Data queued in [buffers] counts against the receive window until it is
+   read; see [stub_utp_read_drained]. *)
+let drained (sock : socket) n =
+  match sock.state with
+  | Closed -> ()
+  | _ -> Utp.read_drained sock.id n
+
 let read sock =
   match sock.state, Lwt_sequence.is_empty sock.buffers with
   | _, false ->
-      Lwt.return (Lwt_sequence.take_l sock.buffers)
+      let buf = Lwt_sequence.take_l sock.buffers in
+      drained sock (Bytes.length buf);
+      Lwt.return buf
   | (Connected | Closing), true ->
       Lwt.add_task_r sock.readers
   | (Closed | Eof), true ->
@@ -281,17 +308,52 @@ let read sock =
   | _, true ->
       Lwt.fail (Failure "read: not connected")
 
+let set_read_buffer (sock : socket) buf =
+  match sock.state with
+  | Closed -> invalid_arg "set_read_buffer: socket is closed"
+  | _ -> Utp.set_read_buffer sock.id buf
+
+let rec read_ring (sock : socket) =
+  match sock.state with
+  | Closed ->
+      Lwt.fail End_of_file
+  | state ->
+      let n = Utp.read_available sock.id in
+      if n > 0 then
+        Lwt.return (Utp.read_offset sock.id, n)
+      else begin
+        match state with
+        | Connected | Closing ->
+            Lwt_condition.wait sock.readable >>= fun () -> read_ring sock
+        | Eof ->
+            Lwt.fail End_of_file
+        | _ ->
+            Lwt.fail (Failure "read: not connected")
+      end
+
+let consume (sock : socket) n =
+  match sock.state with
+  | Closed -> ()
+  | _ -> Utp.consume sock.id n
+
+(* [sock.id] is freed once the socket is [Closed], so check before every call
+   into [Utp.write].  [on_close] and [on_error] wake any writer waiting for
+   [writable]. *)
 let write_bytes (sock : socket) buf off len =
   let rec loop off len =
     if len = 0 then
       Lwt.return_unit
     else
-      let n = Utp.write sock.id buf off len in
-      if n = 0 then
-        Lwt_condition.wait sock.writable >>= fun () ->
-        loop off len
-      else
-        loop (off + n) (len - n)
+      match sock.state with
+      | Closed | Error ->
+          Lwt.fail (Failure "write: not connected")
+      | _ ->
+          let n = Utp.write sock.id buf off len in
+          if n = 0 then
+            Lwt_condition.wait sock.writable >>= fun () ->
+            loop off len
+          else
+            loop (off + n) (len - n)
   in
   loop off len
 
@@ -307,6 +369,9 @@ let write sock buf off len =
   in
   Lwt_mutex.with_lock sock.write_mutex (fun () -> loop off len)
 
+let dropped ctx =
+  if Hashtbl.mem contexts ctx.id then Utp.send_dropped ctx.id else 0
+
 let destroy ctx =
   if not ctx.destroyed then begin
     ctx.destroyed <- true;
@@ -321,9 +386,10 @@ let destroy ctx =
 let () =
   Callback.register "utp_on_error" (on_error : Utp.socket -> Utp.error -> unit);
   Callback.register "utp_on_read" (on_read : Utp.socket -> Utp.buffer -> unit);
+  Callback.register "utp_on_readable" (on_readable : Utp.socket -> unit);
   Callback.register "utp_on_connect" (on_connect : Utp.socket -> unit);
   Callback.register "utp_on_writable" (on_writable : Utp.socket -> unit);
   Callback.register "utp_on_eof" (on_eof : Utp.socket -> unit);
   Callback.register "utp_on_close" (on_close : Utp.socket -> unit);
   Callback.register "utp_on_accept" (on_accept : Utp.context -> Utp.socket -> Unix.sockaddr -> unit);
-  Callback.register "utp_on_sendto" (on_sendto : Utp.context -> Unix.sockaddr -> Utp.buffer -> unit)
+  Callback.register "utp_on_send_blocked" (on_send_blocked : Utp.context -> unit)
@@ -29,8 +29,15 @@ type context
 (** The type of UTP contexts.  A UTP context corresponds one-to-one to
     underlying UDP sockets.  A context may spawn any number of sockets. *)
 
-val init: Unix.sockaddr -> context Lwt.t
-(** [init addr] create a context and binds it to [addr]. *)
+val init: ?threaded:bool -> Unix.sockaddr -> context Lwt.t
+(** [init addr] create a context and binds it to [addr].  If [addr] is an
+    IPv6 address, the context is dual-stack: it also talks to IPv4 peers,
+    whose addresses appear as ordinary IPv4 addresses.
+
+    With [~threaded:true], the context is driven by a native thread of its
+    own, which reads the socket, runs the protocol and timers and sends
+    without holding the OCaml runtime lock.  Callbacks are then run in
+    batches from the [Lwt] main loop.  Defaults to [false]. *)
 
 val connect: context -> Unix.sockaddr -> socket Lwt.t
 (** [connect ctx addr] connects to [addr] and returns the resulting connected
@@ -41,15 +48,40 @@ val accept: context -> (Unix.sockaddr * socket) Lwt.t
     connected socket and the source address. *)
 
 val read: socket -> bytes Lwt.t
-(** [read sock] returns the next chunk of data read from [sock]. *)
+(** [read sock] returns the next chunk of data read from [sock].  Chunks not
+    yet read count against the receive window of [sock], so a slow reader
+    holds the sender back rather than letting data pile up. *)
+
+val set_read_buffer: socket -> Lwt_bytes.t -> unit
+(** [set_read_buffer sock buf] makes [buf] the receive buffer of [sock].  From
+    then on, data received on [sock] is copied straight into [buf], used as a
+    ring, and is read with [read_ring] and [consume] instead of [read].
+    [buf] must not be modified by the caller while it is in use.  Fails if data
+    is still unread in the previous buffer. *)
+
+val read_ring: socket -> (int * int) Lwt.t
+(** [read_ring sock] waits until data is available in the buffer given to
+    [set_read_buffer] and returns the offset and length of the longest
+    contiguous part of it.  The data stays in the buffer until [consume] is
+    called. *)
+
+val consume: socket -> int -> unit
+(** [consume sock n] releases the first [n] bytes returned by [read_ring],
+    making room for more data. *)
 
 val write: socket -> bytes -> int -> int -> unit Lwt.t
 (** [write sock buf off len] writes bytes from [buf] between [off] and [off+len]
-    to [sock]. *)
+    to [sock].  Fails with [Failure] if [sock] is closed or has failed, including
+    while [write] is waiting for room to send. *)
 
 val close: socket -> unit Lwt.t
 (** [close sock] closes [sock]. *)
 
+val dropped: context -> int
+(** [dropped ctx] is the number of outgoing datagrams of [ctx] dropped so far
+    because its send queue was full.  uTP retransmits them like any other
+    lost packet. *)
+
 val destroy: context -> unit Lwt.t
 (** [destroy ctx] signals that the context [ctx] is no longer useful.  It will
     be destroyed once all dependant sockets are closed. *)
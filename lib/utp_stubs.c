@@ -21,8 +21,18 @@
    SOFTWARE. */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
@@ -33,8 +43,10 @@
 #include <caml/custom.h>
 #include <caml/socketaddr.h>
 #include <caml/unixsupport.h>
+#include <caml/signals.h>
 
 #include "utp.h"
+#include "libutp_io.h"
 
 #define UTP_DEBUG(msg, ...) \
   do { \
@@ -45,25 +57,470 @@
 
 #define Utp_context_val(v) ((utp_context *) v)
 #define Val_utp_context(c) ((value) c)
-#define Utp_socket_val(v) ((utp_socket *) v)
-#define Val_utp_socket(s) ((value) s)
+#define Stub_socket_val(v) ((stub_socket *) v)
+#define Val_stub_socket(s) ((value) s)
 
-static uint64 on_read (utp_callback_arguments* a)
+/* Per-context state, attached with utp_context_set_userdata.
+
+   Outgoing datagrams are queued in a libutp_io send queue on the context's
+   UDP socket instead of going through OCaml.  Every stub that enters libutp
+   brackets the call with [enter] and [leave], and the outermost [leave]
+   writes the queue out with one sendmmsg.  If the kernel would block, the
+   rest stays queued, up to UTP_IO_SEND_SIZE bytes beyond which datagrams are
+   dropped and counted, and OCaml is asked once to call stub_utp_flush when
+   the socket is writable again.
+
+   A context destroyed from within a callback is only freed by the outermost
+   [leave], so that libutp is never left running on a freed context.
+
+   A context on an IPv6 socket is dual-stack.  libutp hands us IPv4 peers as
+   AF_INET addresses, which go out as v4-mapped IPv6 addresses, and
+   addresses passed up to OCaml are unmapped again, so IPv4 peers look the
+   same to the application whatever socket they came in on.
+
+   A context created with stub_utp_init_threaded is driven by a native thread
+   of its own (see [network_thread]), which reads the socket, runs libutp and
+   writes out the send queue without ever taking the OCaml runtime lock.  The
+   context's [mutex] serialises it with the stubs: every [enter] takes it,
+   with the runtime lock released while it waits, and every [leave] gives it
+   back.  It is recursive, since a callback run from a stub may call another
+   stub, and it is the only thing that lets a stub in: the runtime lock is
+   given up while waiting, so another OCaml thread or domain may well be
+   calling stubs on the same context meanwhile.  The callbacks cannot call
+   into OCaml from the network thread, so they queue events instead, and
+   OCaml runs them in batches with stub_utp_drain when [notify_fd] becomes
+   readable.  Once the context is destroyed and its thread stopped, what is
+   still queued is delivered and the context runs unthreaded to the end, so
+   that the callbacks, and any stubs they call, find libutp's context still
+   there. */
+
+#define EV_READ       0         /* data, len: payload */
+#define EV_READABLE   1
+#define EV_STATE      2         /* arg: state */
+#define EV_ERROR      3         /* arg: error code */
+#define EV_ACCEPT     4         /* data, len: peer address */
+
+struct stub_socket;
+
+typedef struct stub_event {
+  int type;
+  int arg;
+  struct stub_socket *socket;
+  unsigned char *data;          /* malloc'd, freed once the event is delivered */
+  size_t len;
+  struct stub_event *next;      /* in [overflow] */
+} stub_event;
+
+/* Events go from whichever thread holds the mutex to the OCaml thread
+   through a single-producer single-consumer ring: producers are serialised
+   by the mutex, and the consumer needs no lock.  When the ring is full,
+   events go to the [overflow] list, under the mutex, until the consumer has
+   taken the whole list. */
+#define STUB_EVENTS 4096
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int notify_fd[2];         /* OCaml waits on [0], producers signal [1] */
+  int wake_fd[2];           /* the network thread waits on [0] */
+  int stop;
+  int pushed;               /* events queued since the last signal */
+  int64_t sleep_until;      /* when the network thread looks again, in ms */
+  stub_event events[STUB_EVENTS];
+  size_t head;              /* next slot to fill, written by the producer */
+  size_t tail;              /* next slot to deliver, written by the consumer */
+  stub_event *overflow;
+  stub_event *overflow_last;
+} stub_thread;
+
+typedef struct {
+  utp_context *ctx;
+  utp_io *io;
+  int fd;                   /* our own dup of the UDP socket if threaded */
+  int family;               /* of the UDP socket */
+  int depth;                /* stubs currently inside libutp; under [mutex]
+                               if threaded */
+  int draining;             /* stub_utp_drain is delivering events */
+  int blocked;              /* waiting for stub_utp_flush */
+  int destroyed;
+  stub_thread *thread;      /* NULL unless threaded */
+} stub_context;
+
+/* Per-socket state kept on the C side, attached with utp_set_userdata.  It is
+   also what OCaml holds as the socket: libutp frees its own socket as soon as
+   it is destroyed, which for a threaded context may be well before OCaml
+   hears of it, so [socket] is cleared then and the stubs ignore the socket
+   from there on.  This is only freed once OCaml has been told.
+
+   Data that has been delivered but not yet consumed by the application counts
+   against the receive window (see on_get_read_buffer_size), and
+   utp_read_drained is only called once it is consumed, so a slow reader
+   throttles the sender instead of piling up memory.
+
+   Once the application hands a socket a read buffer with
+   stub_utp_set_read_buffer, incoming payload is copied straight from the
+   libutp packet into that buffer, used as a ring, instead of being passed to
+   OCaml one Bigarray per packet.  OCaml is only told when the ring goes from
+   empty to non-empty.  Payload that does not fit is kept in [spill] and moved
+   into the ring as the application consumes it. */
+
+typedef struct stub_socket {
+  utp_socket *socket;       /* NULL once destroyed */
+  utp_context *ctx;
+  value ring;               /* the Bigarray, a generational global root once
+                               [rooted] */
+  int rooted;
+  unsigned char *data;
+  size_t size;
+  size_t rd;                /* offset of the first unread byte */
+  size_t len;               /* unread bytes in the ring */
+  unsigned char *spill;
+  size_t spill_len;
+  size_t spill_size;
+  size_t held;              /* bytes handed to OCaml by on_read and not yet
+                               released with stub_utp_read_drained */
+} stub_socket;
+
+static int64_t now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* A pair of descriptors used to wake up a poller: an eventfd where there is
+   one, else a pipe. */
+static int make_signal (int fds[2])
+{
+#ifdef __linux__
+  fds[0] = fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return fds[0] < 0 ? -1 : 0;
+#else
+  if (pipe (fds) < 0) return -1;
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+static void close_signal (int fds[2])
+{
+  close (fds[0]);
+  if (fds[1] != fds[0]) close (fds[1]);
+}
+
+static void raise_signal (int fds[2])
+{
+  uint64_t one = 1;
+
+  if (write (fds[1], &one, sizeof (one)) < 0 && errno != EAGAIN)
+    UTP_DEBUG ("raise_signal: %s", strerror (errno));
+}
+
+static void clear_signal (int fds[2])
+{
+  uint64_t buf[8];
+
+  while (read (fds[0], buf, sizeof (buf)) > 0)
+    ;
+}
+
+static stub_socket *stub_socket_new (utp_socket *socket)
+{
+  stub_socket *s = calloc (1, sizeof (stub_socket));
+
+  if (s == NULL) return NULL;
+  s->socket = socket;
+  s->ctx = utp_get_context (socket);
+  s->ring = Val_unit;
+  utp_set_userdata (socket, s);
+  return s;
+}
+
+static void stub_socket_free (stub_socket *s)
+{
+  if (s->rooted) caml_remove_generational_global_root (&s->ring);
+  free (s->spill);
+  free (s);
+}
+
+static void push_event (stub_thread *t, const stub_event *ev)
+{
+  size_t tail = __atomic_load_n (&t->tail, __ATOMIC_ACQUIRE);
+  stub_event *e;
+
+  t->pushed = 1;
+  if (t->overflow == NULL && t->head - tail < STUB_EVENTS) {
+    t->events[t->head % STUB_EVENTS] = *ev;
+    __atomic_store_n (&t->head, t->head + 1, __ATOMIC_RELEASE);
+    return;
+  }
+  e = malloc (sizeof (stub_event));
+  if (e == NULL) {
+    UTP_DEBUG ("push_event: dropping event %d, out of memory", ev->type);
+    return;
+  }
+  *e = *ev;
+  e->next = NULL;
+  if (t->overflow == NULL)
+    __atomic_store_n (&t->overflow, e, __ATOMIC_RELEASE);
+  else
+    t->overflow_last->next = e;
+  t->overflow_last = e;
+}
+
+static void queue_event (stub_thread *t, int type, stub_socket *s, int arg, const void *data, size_t len)
+{
+  stub_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.type = type;
+  ev.socket = s;
+  ev.arg = arg;
+  if (len > 0) {
+    ev.data = malloc (len);
+    if (ev.data == NULL) {
+      UTP_DEBUG ("queue_event: dropping event %d, out of memory", type);
+      return;
+    }
+    memcpy (ev.data, data, len);
+    ev.len = len;
+  }
+  push_event (t, &ev);
+}
+
+/* Takes the next event for the consumer, if any.  [list] holds what is left
+   of the overflow list once taken; it is only looked at once the ring is
+   empty, since everything in it is newer. */
+static int pop_event (stub_thread *t, stub_event **list, stub_event *ev)
+{
+  size_t head = __atomic_load_n (&t->head, __ATOMIC_ACQUIRE);
+  stub_event *e;
+
+  if (*list == NULL && t->tail != head) {
+    *ev = t->events[t->tail % STUB_EVENTS];
+    __atomic_store_n (&t->tail, t->tail + 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  if (*list == NULL && __atomic_load_n (&t->overflow, __ATOMIC_ACQUIRE) != NULL) {
+    caml_enter_blocking_section ();
+    pthread_mutex_lock (&t->mutex);
+    caml_leave_blocking_section ();
+    *list = t->overflow;
+    t->overflow = t->overflow_last = NULL;
+    pthread_mutex_unlock (&t->mutex);
+  }
+  if (*list == NULL) return 0;
+  e = *list;
+  *list = e->next;
+  *ev = *e;
+  free (e);
+  return 1;
+}
+
+static void deliver_events (stub_context *c, stub_thread *t);
+
+static void free_context (stub_context *c)
+{
+  stub_thread *t = c->thread;
+
+  c->depth = 1;
+  if (t != NULL) {
+    t->stop = 1;
+    pthread_mutex_unlock (&t->mutex);
+    raise_signal (t->wake_fd);
+    caml_enter_blocking_section ();
+    pthread_join (t->thread, NULL);
+    caml_leave_blocking_section ();
+    /* from here on the callbacks call OCaml directly, as for an unthreaded
+       context, starting with what the thread left queued; all of it while
+       libutp's context is still alive for the stubs they may call */
+    c->thread = NULL;
+    deliver_events (c, t);
+  }
+  utp_destroy (c->ctx);
+  utp_io_flush (c->io);
+  utp_io_destroy (c->io);
+  if (t != NULL) {
+    close_signal (t->notify_fd);
+    close_signal (t->wake_fd);
+    pthread_mutex_destroy (&t->mutex);
+    close (c->fd);
+    free (t);
+  }
+  free (c);
+}
+
+static stub_context *enter (utp_context *ctx)
+{
+  stub_context *c = utp_context_get_userdata (ctx);
+
+  if (c->thread != NULL && pthread_mutex_trylock (&c->thread->mutex) != 0) {
+    caml_enter_blocking_section ();
+    pthread_mutex_lock (&c->thread->mutex);
+    caml_leave_blocking_section ();
+  }
+  c->depth++;
+  return c;
+}
+
+static void leave (stub_context *c)
+{
+  static value *on_send_blocked_fun = NULL;
+  stub_thread *t = c->thread;
+  int notify, wake, timeout;
+
+  if (--c->depth > 0) {
+    if (t != NULL) pthread_mutex_unlock (&t->mutex);
+    return;
+  }
+  if (c->destroyed && c->draining == 0) {
+    free_context (c);
+    return;
+  }
+  if (t != NULL) {
+    /* nothing else will send the acks a stub deferred before the next
+       datagram comes in */
+    utp_issue_deferred_acks (c->ctx);
+    utp_io_flush (c->io);
+    /* the network thread only needs waking if there is something left to
+       send, or if it should look sooner than it was going to */
+    timeout = utp_next_timeout_ms (c->ctx);
+    wake = utp_io_pending (c->io) > 0 || (timeout >= 0 && now_ms () + timeout < t->sleep_until);
+    notify = t->pushed;
+    t->pushed = 0;
+    pthread_mutex_unlock (&t->mutex);
+    if (notify) raise_signal (t->notify_fd);
+    if (wake) raise_signal (t->wake_fd);
+    return;
+  }
+  utp_io_flush (c->io);
+  if (utp_io_pending (c->io) > 0 && !c->blocked) {
+    c->blocked = 1;
+    if (on_send_blocked_fun == NULL) on_send_blocked_fun = caml_named_value ("utp_on_send_blocked");
+    caml_callback (*on_send_blocked_fun, Val_utp_context (c->ctx));
+  }
+}
+
+/* The loop of a threaded context: read and process everything the socket
+   has, run the timers, write out the send queue, and sleep until the next
+   deadline, more input, or a wake-up from [leave]. */
+static void *network_thread (void *arg)
+{
+  stub_context *c = arg;
+  stub_thread *t = c->thread;
+  struct pollfd p[2];
+  int timeout, notify;
+
+  pthread_mutex_lock (&t->mutex);
+  while (!t->stop) {
+    utp_io_recv (c->io);
+    utp_check_timeouts (c->ctx);
+    utp_io_flush (c->io);
+    timeout = utp_next_timeout_ms (c->ctx);
+    if (timeout < 0 || timeout > 500) timeout = 500;
+    t->sleep_until = now_ms () + timeout;
+    p[0].fd = c->fd;
+    p[0].events = POLLIN | (utp_io_pending (c->io) > 0 ? POLLOUT : 0);
+    p[1].fd = t->wake_fd[0];
+    p[1].events = POLLIN;
+    notify = t->pushed;
+    t->pushed = 0;
+    pthread_mutex_unlock (&t->mutex);
+    if (notify) raise_signal (t->notify_fd);
+    if (poll (p, 2, timeout) > 0 && (p[1].revents & POLLIN)) clear_signal (t->wake_fd);
+    pthread_mutex_lock (&t->mutex);
+  }
+  pthread_mutex_unlock (&t->mutex);
+  return NULL;
+}
+
+/* Copies up to [len] bytes from [buf] into the free part of the ring and
+   returns how many were copied. */
+static size_t ring_push (stub_socket *s, const unsigned char *buf, size_t len)
+{
+  size_t wr, n, first;
+
+  n = s->size - s->len;
+  if (len < n) n = len;
+  wr = (s->rd + s->len) % s->size;
+  first = s->size - wr;
+  if (first > n) first = n;
+  memcpy (s->data + wr, buf, first);
+  memcpy (s->data, buf + first, n - first);
+  s->len += n;
+  return n;
+}
+
+static int spill (stub_socket *s, const unsigned char *buf, size_t len)
+{
+  unsigned char *p;
+  size_t size;
+
+  if (s->spill_len + len > s->spill_size) {
+    size = s->spill_size ? s->spill_size : 4096;
+    while (size < s->spill_len + len) size *= 2;
+    p = realloc (s->spill, size);
+    if (p == NULL) return -1;
+    s->spill = p;
+    s->spill_size = size;
+  }
+  memcpy (s->spill + s->spill_len, buf, len);
+  s->spill_len += len;
+  return 0;
+}
+
+/* Allocates the OCaml sockaddr for [sa], turning v4-mapped IPv6 addresses
+   into plain IPv4 ones. */
+static value alloc_peer (const struct sockaddr *sa, socklen_t len)
+{
+  union sock_addr_union sock_addr;
+  socklen_param_type sock_addr_len;
+
+#ifdef HAS_IPV6
+  if (sa->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED (&((struct sockaddr_in6 *) sa)->sin6_addr)) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+    memset (&sock_addr.s_inet, 0, sizeof (struct sockaddr_in));
+    sock_addr.s_inet.sin_family = AF_INET;
+    sock_addr.s_inet.sin_port = sin6->sin6_port;
+    memcpy (&sock_addr.s_inet.sin_addr, &sin6->sin6_addr.s6_addr[12], 4);
+    return alloc_sockaddr (&sock_addr, sizeof (struct sockaddr_in), 0);
+  }
+#endif
+  sock_addr_len = len < sizeof (sock_addr) ? len : sizeof (sock_addr);
+  memcpy (&sock_addr, sa, sock_addr_len);
+  return alloc_sockaddr (&sock_addr, sock_addr_len, 0);
+}
+
+/* The calls into OCaml, made straight from the libutp callbacks below, or
+   from [deliver_events] for a threaded context. */
+
+static void call_read (stub_socket *s, const unsigned char *buf, size_t len)
 {
   CAMLparam0 ();
   CAMLlocal1 (ba);
   static value *on_read_fun = NULL;
 
   if (on_read_fun == NULL) on_read_fun = caml_named_value ("utp_on_read");
-  ba = caml_ba_alloc_dims (CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, (void *) a->buf, a->len);
-  caml_callback2 (*on_read_fun, Val_utp_socket (a->socket), ba);
-  utp_read_drained (a->socket);
-  CAMLreturn (0);
+  ba = caml_ba_alloc_dims (CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, (void *) buf, len);
+  caml_callback2 (*on_read_fun, Val_stub_socket (s), ba);
+  CAMLreturn0;
 }
 
-static uint64 on_state_change (utp_callback_arguments *a)
+static void call_readable (stub_socket *s)
+{
+  static value *on_readable_fun = NULL;
+
+  if (on_readable_fun == NULL) on_readable_fun = caml_named_value ("utp_on_readable");
+  caml_callback (*on_readable_fun, Val_stub_socket (s));
+}
+
+static void call_state (stub_socket *s, int state)
 {
-  CAMLparam0 ();
   value *cb;
   static value *on_connect_fun = NULL;
   static value *on_writable_fun = NULL;
@@ -74,7 +531,7 @@ static uint64 on_state_change (utp_callback_arguments *a)
   if (on_writable_fun == NULL) on_writable_fun = caml_named_value ("utp_on_writable");
   if (on_eof_fun == NULL) on_eof_fun = caml_named_value ("utp_on_eof");
   if (on_close_fun == NULL) on_close_fun = caml_named_value ("utp_on_close");
-  switch (a->state) {
+  switch (state) {
     case UTP_STATE_CONNECT:
       cb = on_connect_fun;
       break;
@@ -89,39 +546,156 @@ static uint64 on_state_change (utp_callback_arguments *a)
       cb = on_close_fun;
       break;
     default:
-      UTP_DEBUG ("unknown state change: %d", a->state);
+      UTP_DEBUG ("unknown state change: %d", state);
       cb = NULL;
       break;
   }
-  if (cb) caml_callback (*cb, Val_utp_socket (a->socket));
-  CAMLreturn (0);
+  if (cb) caml_callback (*cb, Val_stub_socket (s));
 }
 
-static uint64 on_sendto (utp_callback_arguments *a)
+static void call_error (stub_socket *s, int error_code)
+{
+  static value *on_error_fun = NULL;
+
+  if (on_error_fun == NULL) on_error_fun = caml_named_value ("utp_on_error");
+  caml_callback2 (*on_error_fun, Val_stub_socket (s), Val_int (error_code));
+}
+
+static void call_accept (utp_context *context, stub_socket *s, const struct sockaddr *sa, socklen_t len)
 {
   CAMLparam0 ();
-  CAMLlocal2 (addr, buf);
-  union sock_addr_union sock_addr;
-  socklen_param_type sock_addr_len;
-  static value *on_sendto_fun = NULL;
+  CAMLlocal1 (addr);
+  static value *on_accept_fun = NULL;
 
-  if (on_sendto_fun == NULL) on_sendto_fun = caml_named_value ("utp_on_sendto");
-  sock_addr_len = sizeof (struct sockaddr_in);
-  memcpy (&sock_addr.s_inet, (struct sockaddr_in *) a->address, sock_addr_len);
-  addr = alloc_sockaddr (&sock_addr, sock_addr_len, 0);
-  buf = caml_ba_alloc_dims (CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, (void *) a->buf, a->len);
-  caml_callback3 (*on_sendto_fun, Val_utp_context (a->context), addr, buf);
-  CAMLreturn (0);
+  if (on_accept_fun == NULL) on_accept_fun = caml_named_value ("utp_on_accept");
+  addr = alloc_peer (sa, len);
+  caml_callback3 (*on_accept_fun, Val_utp_context (context), Val_stub_socket (s), addr);
+  CAMLreturn0;
+}
+
+/* Runs the events queued on [t], the thread of [c], in order.  The socket of
+   a UTP_STATE_DESTROYING event is freed once OCaml has seen it. */
+static void deliver_events (stub_context *c, stub_thread *t)
+{
+  stub_event *list = NULL;
+  stub_event ev;
+
+  while (pop_event (t, &list, &ev)) {
+    switch (ev.type) {
+      case EV_READ:
+        call_read (ev.socket, ev.data, ev.len);
+        break;
+      case EV_READABLE:
+        call_readable (ev.socket);
+        break;
+      case EV_STATE:
+        call_state (ev.socket, ev.arg);
+        if (ev.arg == UTP_STATE_DESTROYING) stub_socket_free (ev.socket);
+        break;
+      case EV_ERROR:
+        call_error (ev.socket, ev.arg);
+        break;
+      case EV_ACCEPT:
+        call_accept (c->ctx, ev.socket, (struct sockaddr *) ev.data, ev.len);
+        break;
+    }
+    free (ev.data);
+  }
+}
+
+static stub_thread *thread_of (utp_context *context)
+{
+  return ((stub_context *) utp_context_get_userdata (context))->thread;
+}
+
+static uint64 on_read (utp_callback_arguments* a)
+{
+  stub_thread *t = thread_of (a->context);
+  stub_socket *s = utp_get_userdata (a->socket);
+  size_t was_empty, n;
+
+  if (s == NULL) return 0;
+  if (s->data != NULL) {
+    was_empty = s->len == 0;
+    n = s->spill_len ? 0 : ring_push (s, a->buf, a->len);
+    if (n < a->len && spill (s, a->buf + n, a->len - n) < 0)
+      UTP_DEBUG ("on_read: dropping %zu bytes, out of memory", a->len - n);
+    if (was_empty && s->len > 0) {
+      if (t != NULL)
+        queue_event (t, EV_READABLE, s, 0, NULL, 0);
+      else
+        call_readable (s);
+    }
+    return 0;
+  }
+  s->held += a->len;
+  if (t != NULL)
+    queue_event (t, EV_READ, s, 0, a->buf, a->len);
+  else
+    call_read (s, a->buf, a->len);
+  return 0;
+}
+
+static uint64 on_get_read_buffer_size (utp_callback_arguments *a)
+{
+  stub_socket *s = utp_get_userdata (a->socket);
+
+  return s ? s->held + s->len + s->spill_len : 0;
+}
+
+static uint64 on_state_change (utp_callback_arguments *a)
+{
+  stub_thread *t = thread_of (a->context);
+  stub_socket *s = utp_get_userdata (a->socket);
+
+  if (s == NULL) return 0;
+  if (a->state == UTP_STATE_DESTROYING) {
+    s->socket = NULL;
+    utp_set_userdata (a->socket, NULL);
+  }
+  if (t != NULL) {
+    queue_event (t, EV_STATE, s, a->state, NULL, 0);
+  } else {
+    call_state (s, a->state);
+    if (a->state == UTP_STATE_DESTROYING) stub_socket_free (s);
+  }
+  return 0;
+}
+
+static uint64 on_sendto (utp_callback_arguments *a)
+{
+  stub_context *c = utp_context_get_userdata (a->context);
+
+#ifdef HAS_IPV6
+  if (c->family == AF_INET6 && a->address->sa_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) a->address;
+    struct sockaddr_in6 sin6;
+
+    memset (&sin6, 0, sizeof (sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = sin->sin_port;
+    sin6.sin6_addr.s6_addr[10] = 0xff;
+    sin6.sin6_addr.s6_addr[11] = 0xff;
+    memcpy (&sin6.sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+    utp_io_sendto (c->io, a->buf, a->len, (struct sockaddr *) &sin6, sizeof (sin6));
+    return 0;
+  }
+#endif
+  utp_io_sendto (c->io, a->buf, a->len, a->address, a->address_len);
+  return 0;
 }
 
 static uint64 on_error (utp_callback_arguments *a)
 {
-  CAMLparam0 ();
-  static value *on_error_fun = NULL;
+  stub_thread *t = thread_of (a->context);
+  stub_socket *s = utp_get_userdata (a->socket);
 
-  if (on_error_fun == NULL) on_error_fun = caml_named_value ("utp_on_error");
-  caml_callback2 (*on_error_fun, Val_utp_socket (a->socket), Val_int (a->error_code));
-  CAMLreturn (0);
+  if (s == NULL) return 0;
+  if (t != NULL)
+    queue_event (t, EV_ERROR, s, a->error_code, NULL, 0);
+  else
+    call_error (s, a->error_code);
+  return 0;
 }
 
 static uint64 on_log (utp_callback_arguments *a)
@@ -132,18 +706,18 @@ static uint64 on_log (utp_callback_arguments *a)
 
 static uint64 on_accept (utp_callback_arguments *a)
 {
-  CAMLparam0 ();
-  CAMLlocal2 (addr, val);
-  union sock_addr_union sock_addr;
-  socklen_param_type sock_addr_len;
-  static value *on_accept_fun = NULL;
+  stub_thread *t = thread_of (a->context);
+  stub_socket *s = stub_socket_new (a->socket);
 
-  if (on_accept_fun == NULL) on_accept_fun = caml_named_value ("utp_on_accept");
-  sock_addr_len = sizeof (struct sockaddr_in);
-  memcpy (&sock_addr.s_inet, (struct sockaddr_in *) a->address, sock_addr_len);
-  addr = alloc_sockaddr (&sock_addr, sock_addr_len, 0);
-  caml_callback3 (*on_accept_fun, Val_utp_context (a->context), Val_utp_socket (a->socket), addr);
-  CAMLreturn (0);
+  if (s == NULL) {
+    UTP_DEBUG ("on_accept: out of memory");
+    return 0;
+  }
+  if (t != NULL)
+    queue_event (t, EV_ACCEPT, s, 0, a->address, a->address_len);
+  else
+    call_accept (a->context, s, a->address, a->address_len);
+  return 0;
 }
 
 static uint64 on_firewall (utp_callback_arguments *a)
@@ -154,25 +728,142 @@ static uint64 on_firewall (utp_callback_arguments *a)
 CAMLprim value stub_utp_close (value socket)
 {
   CAMLparam1 (socket);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
 
-  utp_close (Utp_socket_val (socket));
+  c = enter (s->ctx);
+  if (s->socket != NULL) utp_close (s->socket);
+  leave (c);
   CAMLreturn (Val_unit);
 }
 
-CAMLprim value stub_utp_init (value unit)
+static value context_create (value fd, int threaded)
 {
-  CAMLparam1 (unit);
   utp_context *context;
+  stub_context *c;
+  stub_thread *t = NULL;
+  union sock_addr_union sock_addr;
+  socklen_param_type sock_addr_len;
+  int sfd = Int_val (fd);
 
+  sock_addr_len = sizeof (sock_addr);
+  if (getsockname (sfd, &sock_addr.s_gen, &sock_addr_len) < 0) uerror ("utp_init", Nothing);
+  if (threaded) {
+    /* so that closing the OCaml descriptor cannot pull the socket from under
+       the network thread */
+    sfd = dup (sfd);
+    if (sfd < 0) uerror ("utp_init", Nothing);
+    fcntl (sfd, F_SETFD, FD_CLOEXEC);
+  }
   context = utp_init (2);
+  c = calloc (1, sizeof (stub_context));
+  if (c != NULL) c->io = utp_io_create (context, sfd);
+  if (c != NULL && c->io != NULL && threaded) {
+    t = calloc (1, sizeof (stub_thread));
+    if (t != NULL && make_signal (t->notify_fd) < 0) {
+      free (t);
+      t = NULL;
+    } else if (t != NULL && make_signal (t->wake_fd) < 0) {
+      close_signal (t->notify_fd);
+      free (t);
+      t = NULL;
+    }
+  }
+  if (c == NULL || c->io == NULL || (threaded && t == NULL)) {
+    if (c != NULL && c->io != NULL) utp_io_destroy (c->io);
+    free (c);
+    utp_destroy (context);
+    if (threaded) close (sfd);
+    caml_raise_out_of_memory ();
+  }
+  c->ctx = context;
+  c->fd = sfd;
+  c->family = sock_addr.s_gen.sa_family;
+  c->thread = t;
+  utp_context_set_userdata (context, c);
   utp_set_callback (context, UTP_ON_READ, on_read);
+  utp_set_callback (context, UTP_GET_READ_BUFFER_SIZE, on_get_read_buffer_size);
   utp_set_callback (context, UTP_ON_STATE_CHANGE, on_state_change);
   utp_set_callback (context, UTP_SENDTO, on_sendto);
   utp_set_callback (context, UTP_LOG, on_log);
   utp_set_callback (context, UTP_ON_ERROR, on_error);
   utp_set_callback (context, UTP_ON_ACCEPT, on_accept);
   utp_set_callback (context, UTP_ON_FIREWALL, on_firewall);
-  CAMLreturn (Val_utp_context (context));
+  if (t != NULL) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (&t->mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
+    if (pthread_create (&t->thread, NULL, network_thread, c) != 0) {
+      c->thread = NULL;
+      close_signal (t->notify_fd);
+      close_signal (t->wake_fd);
+      pthread_mutex_destroy (&t->mutex);
+      free (t);
+      utp_destroy (context);
+      utp_io_destroy (c->io);
+      free (c);
+      close (sfd);
+      caml_failwith ("utp_init_threaded");
+    }
+  }
+  return Val_utp_context (context);
+}
+
+CAMLprim value stub_utp_init (value fd)
+{
+  CAMLparam1 (fd);
+
+  CAMLreturn (context_create (fd, 0));
+}
+
+CAMLprim value stub_utp_init_threaded (value fd)
+{
+  CAMLparam1 (fd);
+
+  CAMLreturn (context_create (fd, 1));
+}
+
+CAMLprim value stub_utp_notify_fd (value context)
+{
+  CAMLparam1 (context);
+  stub_context *c = utp_context_get_userdata (Utp_context_val (context));
+
+  if (c->thread == NULL) caml_invalid_argument ("utp_notify_fd");
+  CAMLreturn (Val_int (c->thread->notify_fd[0]));
+}
+
+CAMLprim value stub_utp_drain (value context)
+{
+  CAMLparam1 (context);
+  stub_context *c = utp_context_get_userdata (Utp_context_val (context));
+
+  /* a callback run while the context was being freed; nothing is queued */
+  if (c->thread == NULL && c->destroyed) CAMLreturn (Val_unit);
+  if (c->thread == NULL) caml_invalid_argument ("utp_drain");
+  clear_signal (c->thread->notify_fd);
+  c->draining++;
+  deliver_events (c, c->thread);
+  c->draining--;
+  /* a destroy from one of the callbacks may have been left for us, and
+     [leave] frees the context if so; only under [mutex] can we tell */
+  if (c->draining == 0) {
+    enter (c->ctx);
+    leave (c);
+  }
+  CAMLreturn (Val_unit);
+}
+
+/* The stubs that drive libutp by hand only make sense without a network
+   thread. */
+static stub_context *enter_unthreaded (utp_context *ctx, const char *name)
+{
+  stub_context *c = utp_context_get_userdata (ctx);
+
+  if (c->thread != NULL) caml_invalid_argument (name);
+  return enter (ctx);
 }
 
 CAMLprim value stub_utp_process_udp (value context, value addr, value buf, value off, value len)
@@ -181,37 +872,65 @@ CAMLprim value stub_utp_process_udp (value context, value addr, value buf, value
   union sock_addr_union sock_addr;
   socklen_param_type addr_len;
   int handled;
+  stub_context *c;
 
   get_sockaddr (addr, &sock_addr, &addr_len);
+  c = enter_unthreaded (Utp_context_val (context), "utp_process_udp");
   handled = utp_process_udp (Utp_context_val (context), Caml_ba_data_val (buf) + Int_val (off), Int_val (len), &sock_addr.s_gen, addr_len);
+  leave (c);
   CAMLreturn (Val_bool (handled));
 }
 
 CAMLprim value stub_utp_issue_deferred_acks (value context)
 {
   CAMLparam1 (context);
+  stub_context *c;
 
+  c = enter_unthreaded (Utp_context_val (context), "utp_issue_deferred_acks");
   utp_issue_deferred_acks (Utp_context_val (context));
+  leave (c);
   CAMLreturn (Val_unit);
 }
 
 CAMLprim value stub_utp_check_timeouts (value context)
 {
   CAMLparam1 (context);
+  stub_context *c;
 
+  c = enter_unthreaded (Utp_context_val (context), "utp_check_timeouts");
   utp_check_timeouts (Utp_context_val (context));
+  leave (c);
   CAMLreturn (Val_unit);
 }
 
+CAMLprim value stub_utp_next_timeout_ms (value context)
+{
+  CAMLparam1 (context);
+  stub_context *c;
+  int ms;
+
+  c = enter (Utp_context_val (context));
+  ms = utp_next_timeout_ms (Utp_context_val (context));
+  leave (c);
+  CAMLreturn (Val_int (ms));
+}
+
 CAMLprim value stub_utp_create_socket (value ctx)
 {
   CAMLparam1 (ctx);
-  CAMLlocal1 (val);
   utp_socket *socket;
+  stub_socket *s = NULL;
+  stub_context *c;
 
+  c = enter (Utp_context_val (ctx));
   socket = utp_create_socket (Utp_context_val (ctx));
-  if (socket == NULL) caml_failwith ("utp_create_socket");
-  CAMLreturn (Val_utp_socket (socket));
+  if (socket != NULL) {
+    s = stub_socket_new (socket);
+    if (s == NULL) utp_close (socket);
+  }
+  leave (c);
+  if (s == NULL) caml_failwith ("utp_create_socket");
+  CAMLreturn (Val_stub_socket (s));
 }
 
 CAMLprim value stub_utp_connect (value sock, value addr)
@@ -219,10 +938,14 @@ CAMLprim value stub_utp_connect (value sock, value addr)
   CAMLparam2 (sock, addr);
   union sock_addr_union sock_addr;
   socklen_param_type addr_len;
+  stub_socket *s = Stub_socket_val (sock);
   int res;
+  stub_context *c;
 
   get_sockaddr (addr, &sock_addr, &addr_len);
-  res = utp_connect (Utp_socket_val (sock), &sock_addr.s_gen, addr_len);
+  c = enter (s->ctx);
+  res = s->socket ? utp_connect (s->socket, &sock_addr.s_gen, addr_len) : -1;
+  leave (c);
   if (res < 0) caml_failwith ("utp_connect");
   CAMLreturn (Val_unit);
 }
@@ -230,35 +953,162 @@ CAMLprim value stub_utp_connect (value sock, value addr)
 CAMLprim value stub_utp_write (value socket, value buf, value off, value len)
 {
   CAMLparam4(socket, buf, off, len);
+  stub_socket *s = Stub_socket_val (socket);
   ssize_t written;
+  stub_context *c;
 
-  written = utp_write (Utp_socket_val (socket), Caml_ba_data_val(buf) + Int_val(off), Int_val(len));
+  c = enter (s->ctx);
+  written = s->socket ? utp_write (s->socket, Caml_ba_data_val(buf) + Int_val(off), Int_val(len)) : -1;
+  leave (c);
   if (written < 0) caml_failwith ("utp_write");
   CAMLreturn (Val_int (written));
 }
 
+CAMLprim value stub_utp_set_read_buffer (value socket, value buf)
+{
+  CAMLparam2 (socket, buf);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
+  int unread;
+
+  if (Caml_ba_array_val (buf)->dim[0] == 0) caml_invalid_argument ("utp_set_read_buffer");
+  c = enter (s->ctx);
+  unread = s->len > 0 || s->spill_len > 0;
+  if (!unread) {
+    if (!s->rooted) {
+      caml_register_generational_global_root (&s->ring);
+      s->rooted = 1;
+    }
+    caml_modify_generational_global_root (&s->ring, buf);
+    s->data = Caml_ba_data_val (buf);
+    s->size = Caml_ba_array_val (buf)->dim[0];
+    s->rd = 0;
+    /* advertise no more than the ring can take */
+    if (s->socket != NULL) utp_setsockopt (s->socket, UTP_RCVBUF, s->size);
+  }
+  leave (c);
+  if (unread) caml_failwith ("utp_set_read_buffer: unread data");
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value stub_utp_read_offset (value socket)
+{
+  CAMLparam1 (socket);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
+  size_t rd;
+
+  c = enter (s->ctx);
+  rd = s->rd;
+  leave (c);
+  CAMLreturn (Val_int (rd));
+}
+
+CAMLprim value stub_utp_read_available (value socket)
+{
+  CAMLparam1 (socket);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
+  size_t n = 0;
+
+  c = enter (s->ctx);
+  if (s->data != NULL) {
+    n = s->size - s->rd;
+    if (s->len < n) n = s->len;
+  }
+  leave (c);
+  CAMLreturn (Val_int (n));
+}
+
+CAMLprim value stub_utp_consume (value socket, value len)
+{
+  CAMLparam2 (socket, len);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
+  size_t n;
+
+  n = Long_val (len);
+  c = enter (s->ctx);
+  if (s->data == NULL || Long_val (len) < 0 || n > s->len) {
+    leave (c);
+    caml_invalid_argument ("utp_consume");
+  }
+  s->rd = (s->rd + n) % s->size;
+  s->len -= n;
+  if (s->spill_len > 0) {
+    n = ring_push (s, s->spill, s->spill_len);
+    s->spill_len -= n;
+    memmove (s->spill, s->spill + n, s->spill_len);
+  }
+  if (s->socket != NULL) utp_read_drained (s->socket);
+  leave (c);
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value stub_utp_read_drained (value socket, value len)
+{
+  CAMLparam2 (socket, len);
+  stub_socket *s = Stub_socket_val (socket);
+  stub_context *c;
+  size_t n;
+
+  n = Long_val (len);
+  c = enter (s->ctx);
+  s->held -= n < s->held ? n : s->held;
+  if (s->socket != NULL) utp_read_drained (s->socket);
+  leave (c);
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value stub_utp_flush (value context)
+{
+  CAMLparam1 (context);
+  stub_context *c;
+
+  c = enter (Utp_context_val (context));
+  c->blocked = 0;
+  leave (c);
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value stub_utp_send_dropped (value context)
+{
+  CAMLparam1 (context);
+  stub_context *c;
+  uint64 dropped;
+
+  c = enter (Utp_context_val (context));
+  dropped = utp_io_get_stats (c->io)->ndropped;
+  leave (c);
+  CAMLreturn (Val_long (dropped));
+}
+
 CAMLprim value stub_utp_set_debug (value context, value v)
 {
   CAMLparam2 (context, v);
+  stub_context *c;
 
+  c = enter (Utp_context_val (context));
   utp_context_set_option (Utp_context_val (context), UTP_LOG_DEBUG, Bool_val (v));
+  leave (c);
   CAMLreturn (Val_unit);
 }
 
 CAMLprim value stub_utp_get_context (value v)
 {
   CAMLparam1 (v);
-  utp_context *c;
 
-  c = utp_get_context (Utp_socket_val (v));
-  CAMLreturn (Val_utp_context (c));
+  CAMLreturn (Val_utp_context (Stub_socket_val (v)->ctx));
 }
 
 CAMLprim value stub_utp_destroy (value v)
 {
   CAMLparam1 (v);
+  stub_context *c;
 
   UTP_DEBUG ("stub_utp_destroy");
-  utp_destroy (Utp_context_val (v));
+  c = enter (Utp_context_val (v));
+  c->destroyed = 1;
+  leave (c);
   CAMLreturn (Val_unit);
 }